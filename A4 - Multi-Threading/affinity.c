@@ -0,0 +1,329 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include "affinity.h"
+
+// Affinity values
+typedef enum {
+    BITS_PER_WORD = 8 * sizeof(unsigned long),
+    PATH_SIZE = 256,
+    CPU_LIST_SIZE = 4096
+} AffinityValues;
+
+// Where the kernel describes the NUMA nodes
+const char* const nodeDirectory = "/sys/devices/system/node";
+
+/* The NUMA nodes that have CPUs, numbered from 0 in order of their node
+ * numbers (any beyond MAX_NODES share the last). 'cpuNode' is the node of
+ * each CPU. Without NUMA information every CPU belongs to node 0.
+ */
+typedef struct {
+    int count;
+    CpuSet cpus[MAX_NODES];
+    unsigned char cpuNode[MAX_CPUS];
+} Topology;
+
+Topology topology = {1, {{{0}}}, {0}};
+
+/* cpuset_add()
+ *
+ * This function adds a CPU to a CpuSet.
+ *
+ * cpus: A pointer to the CpuSet.
+ * cpu: The CPU number (below MAX_CPUS).
+ */
+void cpuset_add(CpuSet* cpus, int cpu)
+{
+    cpus->words[cpu / BITS_PER_WORD] |= 1UL << (cpu % BITS_PER_WORD);
+}
+
+/* cpuset_has()
+ *
+ * Returns: True if 'cpu' is in the CpuSet, otherwise false.
+ */
+bool cpuset_has(const CpuSet* cpus, int cpu)
+{
+    return cpus->words[cpu / BITS_PER_WORD] >> (cpu % BITS_PER_WORD) & 1;
+}
+
+/* cpuset_count()
+ *
+ * Returns: The number of CPUs in the CpuSet.
+ */
+int cpuset_count(const CpuSet* cpus)
+{
+    int count = 0;
+    for (unsigned i = 0; i < CPU_SET_WORDS; i++) {
+        count += __builtin_popcountl(cpus->words[i]);
+    }
+
+    return count;
+}
+
+/* parse_cpu_list()
+ *
+ * This function reads a list of CPUs in the format the kernel uses (e.g.
+ * "0-3,8,10-11"), which may end with a newline.
+ *
+ * list: The list to read.
+ * cpus: Used to return the CpuSet.
+ *
+ * Returns: True if the list is valid and only names CPUs below MAX_CPUS,
+ *     otherwise false.
+ */
+bool parse_cpu_list(const char* list, CpuSet* cpus)
+{
+    const char* c = list;
+    memset(cpus, 0, sizeof(CpuSet));
+
+    while (1) {
+        if (!isdigit((unsigned char)*c)) {
+            return false;
+        }
+        char* end;
+        long first = strtol(c, &end, 10);
+        long last = first;
+        if (*end == '-') {
+            c = end + 1;
+            if (!isdigit((unsigned char)*c)) {
+                return false;
+            }
+            last = strtol(c, &end, 10);
+        }
+        if (last < first || last >= MAX_CPUS) {
+            return false;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            cpuset_add(cpus, cpu);
+        }
+
+        c = end;
+        if (*c != ',') {
+            break;
+        }
+        c++;
+    }
+
+    return !*c || !strcmp(c, "\n");
+}
+
+/* compare_ints()
+ *
+ * This function compares two ints for qsort().
+ */
+int compare_ints(const void* a, const void* b)
+{
+    return *(const int*)a - *(const int*)b;
+}
+
+/* read_node_cpus()
+ *
+ * This function reads which CPUs belong to a NUMA node.
+ *
+ * id: The node number.
+ * cpus: Used to return the CpuSet.
+ *
+ * Returns: True if the node has any CPUs, otherwise false.
+ */
+bool read_node_cpus(int id, CpuSet* cpus)
+{
+    char path[PATH_SIZE];
+    char list[CPU_LIST_SIZE];
+    snprintf(path, sizeof(path), "%s/node%d/cpulist", nodeDirectory, id);
+
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return false;
+    }
+    bool found = fgets(list, sizeof(list), file) && parse_cpu_list(list, cpus);
+    fclose(file);
+
+    return found;
+}
+
+/* affinity_init()
+ *
+ * This function finds the NUMA nodes and the CPUs belonging to each of them.
+ * Nodes with memory but no CPUs are left out. It must be called before any
+ * other threads are started.
+ */
+void affinity_init(void)
+{
+    DIR* dir = opendir(nodeDirectory);
+    if (!dir) {
+        return;
+    }
+
+    int ids[MAX_CPUS];
+    int count = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) && count < MAX_CPUS) {
+        int id;
+        char extra;
+        if (sscanf(entry->d_name, "node%d%c", &id, &extra) == 1) {
+            ids[count++] = id;
+        }
+    }
+    closedir(dir);
+    qsort(ids, count, sizeof(int), compare_ints);
+
+    Topology found;
+    memset(&found, 0, sizeof(Topology));
+    for (int i = 0; i < count; i++) {
+        CpuSet cpus;
+        if (!read_node_cpus(ids[i], &cpus)) {
+            continue;
+        }
+        int node = (found.count < MAX_NODES) ? found.count++ : MAX_NODES - 1;
+        for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+            if (cpuset_has(&cpus, cpu)) {
+                cpuset_add(&found.cpus[node], cpu);
+                found.cpuNode[cpu] = node;
+            }
+        }
+    }
+    if (found.count) {
+        topology = found;
+    }
+}
+
+/* allowed_cpus()
+ *
+ * This function finds the CPUs the process is allowed to run on (which may be
+ * fewer than those online, e.g. inside a container).
+ *
+ * cpus: Used to return the CpuSet (empty if they can't be found).
+ */
+void allowed_cpus(CpuSet* cpus)
+{
+    cpu_set_t allowed;
+    memset(cpus, 0, sizeof(CpuSet));
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed)) {
+        return;
+    }
+
+    for (int cpu = 0; cpu < MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            cpuset_add(cpus, cpu);
+        }
+    }
+}
+
+/* node_count()
+ *
+ * Returns: The number of NUMA nodes with CPUs (1 if there is no NUMA
+ *     information).
+ */
+int node_count(void)
+{
+    return topology.count;
+}
+
+/* node_cpus()
+ *
+ * This function finds the CPUs of a NUMA node that are in a given set. Without
+ * NUMA information that is the whole set.
+ *
+ * node: The node (counting from 0, see affinity_init()).
+ * within: The CpuSet to choose from.
+ * cpus: Used to return the CpuSet.
+ */
+void node_cpus(int node, const CpuSet* within, CpuSet* cpus)
+{
+    bool known = cpuset_count(&topology.cpus[0]) > 0;
+
+    for (unsigned i = 0; i < CPU_SET_WORDS; i++) {
+        cpus->words[i] = within->words[i]
+                & (known ? topology.cpus[node].words[i] : ~0UL);
+    }
+}
+
+/* current_node()
+ *
+ * Returns: The NUMA node of the CPU the calling thread is running on (which
+ *     stays the same if the thread was placed on that node's CPUs).
+ */
+int current_node(void)
+{
+    int cpu = sched_getcpu();
+
+    return (cpu >= 0 && cpu < MAX_CPUS) ? topology.cpuNode[cpu] : 0;
+}
+
+/* allowed_cpu()
+ *
+ * This function finds one of the CPUs the process is allowed to run on. CPUs
+ * are counted in turn, wrapping around, so consecutive indices spread threads
+ * across all of the allowed CPUs.
+ *
+ * index: Which allowed CPU to find (counting from 0).
+ *
+ * Returns: The CPU number, or -1 if the allowed CPUs can't be found.
+ */
+int allowed_cpu(int index)
+{
+    CpuSet allowed;
+    allowed_cpus(&allowed);
+    int count = cpuset_count(&allowed);
+    if (!count) {
+        return -1;
+    }
+
+    index %= count;
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (cpuset_has(&allowed, cpu) && index-- == 0) {
+            return cpu;
+        }
+    }
+
+    return -1;
+}
+
+/* place_thread()
+ *
+ * This function restricts a thread to running on a set of CPUs. Placing
+ * threads is only a hint for performance, so failing to do so is ignored.
+ *
+ * thread: The thread to place.
+ * cpus: The CpuSet to run it on (NULL or empty to leave the thread as it is).
+ */
+void place_thread(pthread_t thread, const CpuSet* cpus)
+{
+    if (!cpus || !cpuset_count(cpus)) {
+        return;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu = 0; cpu < MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+        if (cpuset_has(cpus, cpu)) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    pthread_setaffinity_np(thread, sizeof(cpu_set_t), &set);
+}
+
+/* pin_thread()
+ *
+ * This function restricts a thread to running on a single CPU (see
+ * place_thread()).
+ *
+ * thread: The thread to pin.
+ * cpu: The CPU to run it on (-1 to leave the thread as it is).
+ */
+void pin_thread(pthread_t thread, int cpu)
+{
+    if (cpu < 0) {
+        return;
+    }
+
+    CpuSet cpus;
+    memset(&cpus, 0, sizeof(CpuSet));
+    cpuset_add(&cpus, cpu);
+    place_thread(thread, &cpus);
+}
@@ -0,0 +1,31 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+// Largest number of CPUs and NUMA nodes that threads are placed on
+#define MAX_CPUS 1024
+#define MAX_NODES 16
+#define CPU_SET_WORDS (MAX_CPUS / (8 * sizeof(unsigned long)))
+
+/* A set of CPUs, by CPU number */
+typedef struct {
+    unsigned long words[CPU_SET_WORDS];
+} CpuSet;
+
+// Function Prototypes
+void affinity_init(void);
+bool parse_cpu_list(const char* list, CpuSet* cpus);
+void cpuset_add(CpuSet* cpus, int cpu);
+bool cpuset_has(const CpuSet* cpus, int cpu);
+int cpuset_count(const CpuSet* cpus);
+void allowed_cpus(CpuSet* cpus);
+int node_count(void);
+void node_cpus(int node, const CpuSet* within, CpuSet* cpus);
+int current_node(void);
+int allowed_cpu(int index);
+void pin_thread(pthread_t thread, int cpu);
+void place_thread(pthread_t thread, const CpuSet* cpus);
+
+#endif
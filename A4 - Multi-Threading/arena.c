@@ -0,0 +1,231 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "arena.h"
+
+// Arena values
+typedef enum {
+    ARENA_BLOCK_SIZE = 4096,
+    ARENA_ALIGN = 16,
+    THREAD_SPARE_BLOCKS = 4,
+    SHARED_SPARE_BLOCKS = 256
+} ArenaValues;
+
+// Spare blocks kept by the calling thread
+__thread ArenaBlock* threadSpares = NULL;
+__thread unsigned threadSpareCount = 0;
+
+// Spare blocks shared by all threads. Requests are usually parsed by one
+// thread and finished by another, so blocks have to be able to move between
+// them.
+pthread_mutex_t sharedSparesLock = PTHREAD_MUTEX_INITIALIZER;
+ArenaBlock* sharedSpares = NULL;
+unsigned sharedSpareCount = 0;
+
+/* take_spare()
+ *
+ * This function takes a spare block of ARENA_BLOCK_SIZE bytes: the calling
+ * thread's own if it has one, otherwise one from the shared list.
+ *
+ * Returns: The block, or NULL if there are no spare blocks.
+ */
+ArenaBlock* take_spare(void)
+{
+    ArenaBlock* block = threadSpares;
+
+    if (block) {
+        threadSpares = block->next;
+        threadSpareCount--;
+        return block;
+    }
+
+    pthread_mutex_lock(&sharedSparesLock);
+    block = sharedSpares;
+    if (block) {
+        sharedSpares = block->next;
+        sharedSpareCount--;
+    }
+    pthread_mutex_unlock(&sharedSparesLock);
+
+    return block;
+}
+
+/* give_back_block()
+ *
+ * This function gives back a block that is no longer used. Blocks of
+ * ARENA_BLOCK_SIZE bytes are kept as spares (by the calling thread, or in the
+ * shared list once the thread has enough) until there are plenty of those;
+ * any other block is freed.
+ *
+ * block: The block to give back.
+ */
+void give_back_block(ArenaBlock* block)
+{
+    if (block->size != ARENA_BLOCK_SIZE) {
+        free(block);
+        return;
+    }
+    if (threadSpareCount < THREAD_SPARE_BLOCKS) {
+        block->next = threadSpares;
+        threadSpares = block;
+        threadSpareCount++;
+        return;
+    }
+
+    pthread_mutex_lock(&sharedSparesLock);
+    if (sharedSpareCount < SHARED_SPARE_BLOCKS) {
+        block->next = sharedSpares;
+        sharedSpares = block;
+        sharedSpareCount++;
+        block = NULL;
+    }
+    pthread_mutex_unlock(&sharedSparesLock);
+    free(block);
+}
+
+/* add_block()
+ *
+ * This function adds a new block with room for at least 'size' bytes to an
+ * arena. A block just for a large allocation goes behind the arena's current
+ * block so that the rest of the current block can still be used.
+ *
+ * arena: A pointer to the Arena.
+ * size: Number of bytes needed (a multiple of ARENA_ALIGN).
+ *
+ * Returns: The new block.
+ */
+ArenaBlock* add_block(Arena* arena, size_t size)
+{
+    ArenaBlock* block = NULL;
+
+    if (size <= ARENA_BLOCK_SIZE / 4) {
+        block = take_spare();
+        size = ARENA_BLOCK_SIZE;
+    }
+    if (!block) {
+        block = malloc(sizeof(ArenaBlock) + size);
+        block->size = size;
+        arena->heapAllocs++;
+    }
+    block->used = 0;
+
+    if (size != ARENA_BLOCK_SIZE && arena->blocks) {
+        block->next = arena->blocks->next;
+        arena->blocks->next = block;
+    } else {
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+
+    return block;
+}
+
+/* arena_alloc()
+ *
+ * This function allocates memory from an arena. The memory stays valid until
+ * the arena is released.
+ *
+ * arena: A pointer to the Arena.
+ * size: Number of bytes to allocate.
+ *
+ * Returns: A pointer to the (uninitialised) memory, aligned for any of the
+ *     types the server uses.
+ */
+void* arena_alloc(Arena* arena, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    ArenaBlock* block = arena->blocks;
+
+    if (!block || block->size - block->used < size) {
+        block = add_block(arena, size);
+    }
+    void* memory = block->data + block->used;
+    block->used += size;
+    arena->allocs++;
+
+    return memory;
+}
+
+/* arena_strndup()
+ *
+ * This function copies at most 'len' characters of a string into an arena.
+ *
+ * arena: A pointer to the Arena.
+ * str: The string to copy.
+ * len: Largest number of characters to copy.
+ *
+ * Returns: The NUL terminated copy.
+ */
+char* arena_strndup(Arena* arena, const char* str, size_t len)
+{
+    len = strnlen(str, len);
+    char* copy = arena_alloc(arena, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+
+    return copy;
+}
+
+/* arena_strdup()
+ *
+ * This function copies a string into an arena.
+ *
+ * arena: A pointer to the Arena.
+ * str: The string to copy.
+ *
+ * Returns: The copy.
+ */
+char* arena_strdup(Arena* arena, const char* str)
+{
+    return arena_strndup(arena, str, strlen(str));
+}
+
+/* arena_split()
+ *
+ * This function splits a string into fields at every 'separator' (like
+ * split_by_char() with no field limit). The separators within 'str' are
+ * replaced by NULs and the array of fields is allocated from the arena.
+ *
+ * arena: A pointer to the Arena.
+ * str: The string to split (modified).
+ * separator: The character separating fields.
+ *
+ * Returns: A NULL terminated array of the fields (which point into 'str').
+ */
+char** arena_split(Arena* arena, char* str, char separator)
+{
+    int count = 1;
+    for (char* c = strchr(str, separator); c; c = strchr(c + 1, separator)) {
+        count++;
+    }
+
+    char** fields = arena_alloc(arena, sizeof(char*) * (count + 1));
+    for (int i = 0; i < count; i++) {
+        fields[i] = str;
+        str = strchr(str, separator);
+        if (str) {
+            *str++ = '\0';
+        }
+    }
+    fields[count] = NULL;
+
+    return fields;
+}
+
+/* arena_release()
+ *
+ * This function gives back all of the memory allocated from an arena, which
+ * is then empty again (and its counters are reset).
+ *
+ * arena: A pointer to the Arena.
+ */
+void arena_release(Arena* arena)
+{
+    while (arena->blocks) {
+        ArenaBlock* block = arena->blocks;
+        arena->blocks = block->next;
+        give_back_block(block);
+    }
+    arena->allocs = 0;
+    arena->heapAllocs = 0;
+}
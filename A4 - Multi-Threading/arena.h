@@ -0,0 +1,34 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* A block of memory that arena allocations are carved out of */
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;
+    size_t used;
+    unsigned char data[] __attribute__((aligned(16)));
+} ArenaBlock;
+
+/* Memory for the many small things belonging to a single request, which are
+ * all given back at once by arena_release(). Blocks are recycled through a
+ * spare list kept by each thread (backed by one shared by all threads), so
+ * most requests never touch the heap at all. 'allocs' counts the allocations
+ * made from the arena and 'heapAllocs' how many blocks had to be taken from
+ * the heap for them. A zeroed Arena is empty and ready to use.
+ */
+typedef struct {
+    ArenaBlock* blocks;
+    unsigned long allocs;
+    unsigned long heapAllocs;
+} Arena;
+
+// Function Prototypes
+void* arena_alloc(Arena* arena, size_t size);
+char* arena_strndup(Arena* arena, const char* str, size_t len);
+char* arena_strdup(Arena* arena, const char* str);
+char** arena_split(Arena* arena, char* str, char separator);
+void arena_release(Arena* arena);
+
+#endif
@@ -0,0 +1,231 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "bufferpool.h"
+#include "affinity.h"
+
+// Buffer pool values. Size classes run from 2^MIN_CLASS_SHIFT (4 KiB) to
+// 2^MAX_CLASS_SHIFT (16 MiB) bytes and every power of two in between is split
+// into CLASS_STEPS classes, so a buffer is never more than a quarter larger
+// than needed.
+typedef enum {
+    MIN_CLASS_SHIFT = 12,
+    MAX_CLASS_SHIFT = 24,
+    CLASS_STEPS = 4,
+    CLASS_COUNT = (MAX_CLASS_SHIFT - MIN_CLASS_SHIFT) * CLASS_STEPS + 1,
+    UNPOOLED = CLASS_COUNT
+} BufferPoolValues;
+
+/* Bookkeeping kept just in front of every buffer */
+typedef struct BufferHeader {
+    unsigned sizeClass;
+    unsigned node;
+    size_t capacity;
+    struct BufferHeader* next;
+} __attribute__((aligned(16))) BufferHeader;
+
+/* The buffers of one size class that are waiting to be reused */
+typedef struct {
+    pthread_mutex_t lock;
+    BufferHeader* free;
+} SizeClass;
+
+/* The process wide pool of large buffers (request bodies, connection input
+ * and encoded results). Buffers are handed out in size classes and given back
+ * to their class when freed, so the same few large blocks are reused over and
+ * over instead of fragmenting the heap. Every NUMA node has its own classes:
+ * a buffer is first written by the thread that allocated it, so its memory
+ * ends up on that thread's node, and it is only ever reused by threads
+ * running on the same node. At most 'limit' bytes of free buffers are kept.
+ */
+typedef struct {
+    SizeClass classes[MAX_NODES][CLASS_COUNT];
+    size_t limit;
+    size_t retained;
+    unsigned long reused;
+    unsigned long allocated;
+} BufferPool;
+
+BufferPool bufferPool;
+
+/* class_capacity()
+ *
+ * Returns: The capacity (in bytes) of the buffers in size class 'index'.
+ */
+size_t class_capacity(unsigned index)
+{
+    unsigned shift = MIN_CLASS_SHIFT + index / CLASS_STEPS;
+
+    return (size_t)(CLASS_STEPS + index % CLASS_STEPS) << (shift - 2);
+}
+
+/* size_class()
+ *
+ * This function finds the smallest size class whose buffers can hold 'size'
+ * bytes.
+ *
+ * size: Number of bytes needed.
+ *
+ * Returns: The index of the size class, or UNPOOLED if the buffer is too small
+ *     or too large to be pooled.
+ */
+unsigned size_class(size_t size)
+{
+    if (size < class_capacity(0) / 2) {
+        return UNPOOLED;
+    }
+
+    for (unsigned i = 0; i < CLASS_COUNT; i++) {
+        if (class_capacity(i) >= size) {
+            return i;
+        }
+    }
+
+    return UNPOOLED;
+}
+
+/* buffer_pool_init()
+ *
+ * This function sets up the buffer pool. It must be called before any other
+ * threads are started.
+ *
+ * limit: Most bytes of free buffers to keep for reuse (0 to keep none).
+ */
+void buffer_pool_init(size_t limit)
+{
+    for (unsigned node = 0; node < MAX_NODES; node++) {
+        for (unsigned i = 0; i < CLASS_COUNT; i++) {
+            pthread_mutex_init(&bufferPool.classes[node][i].lock, NULL);
+            bufferPool.classes[node][i].free = NULL;
+        }
+    }
+    bufferPool.limit = limit;
+}
+
+/* buffer_alloc()
+ *
+ * This function allocates a buffer, reusing a free one of the right size
+ * class on the calling thread's NUMA node if there is one. The buffer must be
+ * freed with buffer_free().
+ *
+ * size: Number of bytes needed.
+ *
+ * Returns: A pointer to the buffer, which can hold buffer_capacity() bytes.
+ */
+void* buffer_alloc(size_t size)
+{
+    unsigned index = size_class(size);
+    unsigned node = current_node();
+    BufferHeader* header = NULL;
+
+    if (index != UNPOOLED) {
+        SizeClass* sizeClass = &bufferPool.classes[node][index];
+        pthread_mutex_lock(&sizeClass->lock);
+        header = sizeClass->free;
+        if (header) {
+            sizeClass->free = header->next;
+        }
+        pthread_mutex_unlock(&sizeClass->lock);
+    }
+
+    if (header) {
+        __atomic_sub_fetch(
+                &bufferPool.retained, header->capacity, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&bufferPool.reused, 1, __ATOMIC_RELAXED);
+    } else {
+        size_t capacity = (index != UNPOOLED) ? class_capacity(index) : size;
+        header = malloc(sizeof(BufferHeader) + capacity);
+        header->sizeClass = index;
+        header->node = node;
+        header->capacity = capacity;
+        __atomic_add_fetch(&bufferPool.allocated, 1, __ATOMIC_RELAXED);
+    }
+
+    return header + 1;
+}
+
+/* buffer_capacity()
+ *
+ * Returns: The number of bytes the buffer from buffer_alloc() can hold.
+ */
+size_t buffer_capacity(const void* buffer)
+{
+    return ((const BufferHeader*)buffer - 1)->capacity;
+}
+
+/* buffer_grow()
+ *
+ * This function makes sure a buffer can hold 'size' bytes, moving its
+ * contents to a larger buffer if it can't.
+ *
+ * buffer: The buffer from buffer_alloc() (or NULL for a new buffer).
+ * used: Number of bytes in use at the start of the buffer.
+ * size: Number of bytes needed.
+ *
+ * Returns: A pointer to the (possibly new) buffer.
+ */
+void* buffer_grow(void* buffer, size_t used, size_t size)
+{
+    if (buffer && buffer_capacity(buffer) >= size) {
+        return buffer;
+    }
+
+    void* grown = buffer_alloc(size);
+    if (buffer) {
+        memcpy(grown, buffer, used);
+        buffer_free(buffer);
+    }
+
+    return grown;
+}
+
+/* buffer_free()
+ *
+ * This function gives back a buffer from buffer_alloc(). It is kept for reuse
+ * (by the NUMA node it was allocated on) if it is of a pooled size and the
+ * pool isn't already holding its limit.
+ *
+ * buffer: The buffer to free (may be NULL).
+ */
+void buffer_free(void* buffer)
+{
+    if (!buffer) {
+        return;
+    }
+
+    BufferHeader* header = (BufferHeader*)buffer - 1;
+    if (header->sizeClass == UNPOOLED
+            || __atomic_add_fetch(&bufferPool.retained, header->capacity,
+                       __ATOMIC_RELAXED) > bufferPool.limit) {
+        if (header->sizeClass != UNPOOLED) {
+            __atomic_sub_fetch(&bufferPool.retained, header->capacity,
+                    __ATOMIC_RELAXED);
+        }
+        free(header);
+        return;
+    }
+
+    SizeClass* sizeClass
+            = &bufferPool.classes[header->node][header->sizeClass];
+    pthread_mutex_lock(&sizeClass->lock);
+    header->next = sizeClass->free;
+    sizeClass->free = header;
+    pthread_mutex_unlock(&sizeClass->lock);
+}
+
+/* buffer_pool_stats()
+ *
+ * This function takes a snapshot of the buffer pool's counters.
+ *
+ * Returns: The BufferPoolStats.
+ */
+BufferPoolStats buffer_pool_stats(void)
+{
+    BufferPoolStats stats = {
+            __atomic_load_n(&bufferPool.reused, __ATOMIC_RELAXED),
+            __atomic_load_n(&bufferPool.allocated, __ATOMIC_RELAXED),
+            __atomic_load_n(&bufferPool.retained, __ATOMIC_RELAXED),
+            bufferPool.limit};
+
+    return stats;
+}
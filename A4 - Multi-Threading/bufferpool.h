@@ -0,0 +1,22 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <stddef.h>
+
+/* A point in time copy of the buffer pool's counters */
+typedef struct {
+    unsigned long reused;
+    unsigned long allocated;
+    size_t retained;
+    size_t limit;
+} BufferPoolStats;
+
+// Function Prototypes
+void buffer_pool_init(size_t limit);
+void* buffer_alloc(size_t size);
+void* buffer_grow(void* buffer, size_t used, size_t size);
+size_t buffer_capacity(const void* buffer);
+void buffer_free(void* buffer);
+BufferPoolStats buffer_pool_stats(void);
+
+#endif
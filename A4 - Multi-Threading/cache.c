@@ -0,0 +1,298 @@
+#include <stdlib.h>
+#include <string.h>
+#include "cache.h"
+#include "hash.h"
+
+// Cache values
+typedef enum {
+    INITIAL_BUCKETS = 64
+} CacheValues;
+
+/* entry_cost()
+ *
+ * This function calculates how much of a cache's capacity an entry uses.
+ *
+ * keyLen: Length of the entry's key.
+ * size: Size of the entry's value.
+ *
+ * Returns: The number of bytes charged for the entry.
+ */
+size_t entry_cost(size_t keyLen, size_t size)
+{
+    return sizeof(CacheEntry) + keyLen + size;
+}
+
+/* find_entry()
+ *
+ * This function looks up a key. The cache's lock must be held.
+ *
+ * cache: A pointer to the Cache.
+ * key: The key to look for.
+ * keyLen: Length of the key.
+ * hash: hash64() of the key.
+ *
+ * Returns: The entry with the key, or NULL if there isn't one.
+ */
+CacheEntry* find_entry(
+        Cache* cache, const void* key, size_t keyLen, uint64_t hash)
+{
+    CacheEntry* entry = cache->buckets[hash % cache->bucketCount];
+
+    for (; entry; entry = entry->chain) {
+        if (entry->hash == hash && entry->keyLen == keyLen
+                && !memcmp(entry->key, key, keyLen)) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/* unlink_entry()
+ *
+ * This function removes an entry from the cache's recency list. The cache's
+ * lock must be held.
+ *
+ * cache: A pointer to the Cache.
+ * entry: The entry to remove.
+ */
+void unlink_entry(Cache* cache, CacheEntry* entry)
+{
+    if (entry->newer) {
+        entry->newer->older = entry->older;
+    } else {
+        cache->newest = entry->older;
+    }
+    if (entry->older) {
+        entry->older->newer = entry->newer;
+    } else {
+        cache->oldest = entry->newer;
+    }
+}
+
+/* make_newest()
+ *
+ * This function puts an (unlinked) entry at the most recently used end of the
+ * cache's recency list. The cache's lock must be held.
+ *
+ * cache: A pointer to the Cache.
+ * entry: The entry to add.
+ */
+void make_newest(Cache* cache, CacheEntry* entry)
+{
+    entry->newer = NULL;
+    entry->older = cache->newest;
+    if (cache->newest) {
+        cache->newest->newer = entry;
+    } else {
+        cache->oldest = entry;
+    }
+    cache->newest = entry;
+}
+
+/* drop_reference()
+ *
+ * This function releases one reference to an entry, freeing it once there are
+ * none left. The cache's lock must be held.
+ *
+ * cache: A pointer to the Cache.
+ * entry: The entry to release.
+ */
+void drop_reference(Cache* cache, CacheEntry* entry)
+{
+    if (--entry->refs == 0) {
+        cache->freeValue(entry->value);
+        free(entry->key);
+        free(entry);
+    }
+}
+
+/* evict_oldest()
+ *
+ * This function removes the least recently used entry from the cache. The
+ * cache's lock must be held and the cache must not be empty.
+ *
+ * cache: A pointer to the Cache.
+ */
+void evict_oldest(Cache* cache)
+{
+    CacheEntry* entry = cache->oldest;
+    unlink_entry(cache, entry);
+
+    CacheEntry** link = &cache->buckets[entry->hash % cache->bucketCount];
+    while (*link != entry) {
+        link = &(*link)->chain;
+    }
+    *link = entry->chain;
+
+    cache->used -= entry_cost(entry->keyLen, entry->size);
+    cache->count--;
+    cache->evictions++;
+    drop_reference(cache, entry);
+}
+
+/* grow_buckets()
+ *
+ * This function doubles the number of hash buckets once there are more
+ * entries than buckets. The cache's lock must be held.
+ *
+ * cache: A pointer to the Cache.
+ */
+void grow_buckets(Cache* cache)
+{
+    if (cache->count <= cache->bucketCount) {
+        return;
+    }
+
+    unsigned bucketCount = cache->bucketCount * 2;
+    CacheEntry** buckets = calloc(bucketCount, sizeof(CacheEntry*));
+    for (unsigned i = 0; i < cache->bucketCount; i++) {
+        CacheEntry* entry = cache->buckets[i];
+        while (entry) {
+            CacheEntry* next = entry->chain;
+            entry->chain = buckets[entry->hash % bucketCount];
+            buckets[entry->hash % bucketCount] = entry;
+            entry = next;
+        }
+    }
+
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->bucketCount = bucketCount;
+}
+
+/* cache_create()
+ *
+ * This function creates an empty Cache.
+ *
+ * capacity: Maximum number of bytes the cached entries may use.
+ * freeValue: Function used to free a value once its entry is gone.
+ *
+ * Returns: A pointer to the newly allocated Cache.
+ */
+Cache* cache_create(size_t capacity, void (*freeValue)(void*))
+{
+    Cache* cache = calloc(1, sizeof(Cache));
+    cache->buckets = calloc(INITIAL_BUCKETS, sizeof(CacheEntry*));
+    cache->bucketCount = INITIAL_BUCKETS;
+    cache->capacity = capacity;
+    cache->freeValue = freeValue;
+    pthread_mutex_init(&cache->lock, NULL);
+
+    return cache;
+}
+
+/* cache_get()
+ *
+ * This function looks up a key and marks its entry as the most recently used.
+ *
+ * cache: A pointer to the Cache.
+ * key: The key to look for.
+ * keyLen: Length of the key.
+ *
+ * Returns: The entry (which must be given back with cache_release()), or NULL
+ *     if the key isn't cached.
+ */
+CacheEntry* cache_get(Cache* cache, const void* key, size_t keyLen)
+{
+    uint64_t hash = hash64(key, keyLen, 0);
+
+    pthread_mutex_lock(&cache->lock);
+    CacheEntry* entry = find_entry(cache, key, keyLen, hash);
+    if (entry) {
+        unlink_entry(cache, entry);
+        make_newest(cache, entry);
+        entry->refs++;
+        cache->hits++;
+    } else {
+        cache->misses++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return entry;
+}
+
+/* cache_put()
+ *
+ * This function adds a value to the cache, evicting the least recently used
+ * entries to make room for it.
+ *
+ * cache: A pointer to the Cache.
+ * key: The key for the value (copied by the cache).
+ * keyLen: Length of the key.
+ * value: The value to add.
+ * size: Size of the value in bytes.
+ *
+ * Returns: If the value was added the cache takes ownership of it and the new
+ *     entry is returned (to be given back with cache_release()). NULL is
+ *     returned if the value is too large for the cache or the key is already
+ *     cached, in which case the caller keeps ownership of the value.
+ */
+CacheEntry* cache_put(Cache* cache, const void* key, size_t keyLen,
+        void* value, size_t size)
+{
+    size_t cost = entry_cost(keyLen, size);
+    if (cost > cache->capacity) {
+        return NULL;
+    }
+    uint64_t hash = hash64(key, keyLen, 0);
+
+    pthread_mutex_lock(&cache->lock);
+    if (find_entry(cache, key, keyLen, hash)) {
+        pthread_mutex_unlock(&cache->lock);
+        return NULL;
+    }
+    while (cache->used + cost > cache->capacity) {
+        evict_oldest(cache);
+    }
+
+    CacheEntry* entry = malloc(sizeof(CacheEntry));
+    entry->key = malloc(keyLen);
+    memcpy(entry->key, key, keyLen);
+    entry->keyLen = keyLen;
+    entry->hash = hash;
+    entry->value = value;
+    entry->size = size;
+    entry->refs = 2;
+    entry->chain = cache->buckets[hash % cache->bucketCount];
+    cache->buckets[hash % cache->bucketCount] = entry;
+    make_newest(cache, entry);
+    cache->used += cost;
+    cache->count++;
+    grow_buckets(cache);
+    pthread_mutex_unlock(&cache->lock);
+
+    return entry;
+}
+
+/* cache_release()
+ *
+ * This function gives back an entry returned by cache_get() or cache_put().
+ *
+ * cache: A pointer to the Cache.
+ * entry: The entry to release.
+ */
+void cache_release(Cache* cache, CacheEntry* entry)
+{
+    pthread_mutex_lock(&cache->lock);
+    drop_reference(cache, entry);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* cache_stats()
+ *
+ * This function takes a snapshot of a cache's counters.
+ *
+ * cache: A pointer to the Cache.
+ *
+ * Returns: The CacheStats.
+ */
+CacheStats cache_stats(Cache* cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    CacheStats stats = {cache->hits, cache->misses, cache->evictions,
+            cache->count, cache->used, cache->capacity};
+    pthread_mutex_unlock(&cache->lock);
+
+    return stats;
+}
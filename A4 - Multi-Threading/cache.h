@@ -0,0 +1,64 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* A single cached value. Entries are reference counted: the cache holds one
+ * reference while the entry is cached and every cache_get() or cache_put()
+ * gives the caller another, so an entry evicted while in use stays valid until
+ * it is released.
+ */
+typedef struct CacheEntry {
+    void* key;
+    size_t keyLen;
+    uint64_t hash;
+    void* value;
+    size_t size;
+    unsigned refs;
+    struct CacheEntry* newer;
+    struct CacheEntry* older;
+    struct CacheEntry* chain;
+} CacheEntry;
+
+/* A thread safe, size limited, least recently used cache of values keyed by
+ * arbitrary bytes. The total size of the cached entries (including their keys
+ * and bookkeeping) is kept within 'capacity' bytes by evicting the least
+ * recently used entries.
+ */
+typedef struct {
+    CacheEntry** buckets;
+    unsigned bucketCount;
+    unsigned count;
+    CacheEntry* newest;
+    CacheEntry* oldest;
+    size_t used;
+    size_t capacity;
+    void (*freeValue)(void*);
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    pthread_mutex_t lock;
+} Cache;
+
+/* A point in time copy of a cache's counters */
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned count;
+    size_t used;
+    size_t capacity;
+} CacheStats;
+
+// Function Prototypes
+Cache* cache_create(size_t capacity, void (*freeValue)(void*));
+CacheEntry* cache_get(Cache* cache, const void* key, size_t keyLen);
+CacheEntry* cache_put(Cache* cache, const void* key, size_t keyLen,
+        void* value, size_t size);
+void cache_release(Cache* cache, CacheEntry* entry);
+CacheStats cache_stats(Cache* cache);
+
+#endif
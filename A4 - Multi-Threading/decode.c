@@ -0,0 +1,459 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdint.h>
+#include "decode.h"
+#include "httprequest.h"
+
+// Raw image values
+typedef enum {
+    RGBA_CHANNELS = 4,
+    RGB_CHANNELS = 3,
+    NETPBM_MAXVAL = 255,
+    ROW_ALIGN = 4,
+    MAX_DIMENSION = 65535,
+    MAX_DIMENSION_DIGITS = 5
+} DecodeValues;
+
+// Media type of uploads of raw RGBA pixels
+const char* const rawRgbaType = "application/x-raw-rgba";
+
+/* Where the pixels of a raw image are: 'height' rows of 'width' 8 bit pixels
+ * with 'channels' channels (RGB or RGBA), starting 'offset' bytes into the
+ * upload and 'stride' bytes apart, top row first.
+ */
+typedef struct {
+    unsigned long width;
+    unsigned long height;
+    unsigned long channels;
+    unsigned long stride;
+    unsigned long offset;
+} RawLayout;
+
+/* parse_dimension()
+ *
+ * This function parses a positive decimal number of at most MAX_DIMENSION
+ * (as found in raw image headers).
+ *
+ * value: The number (may be NULL).
+ * len: Number of characters in the number.
+ *
+ * Returns: The number, or 0 if it is invalid.
+ */
+unsigned long parse_dimension(const char* value, size_t len)
+{
+    unsigned long number = 0;
+
+    if (!value || !len || len > MAX_DIMENSION_DIGITS) {
+        return 0;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (!isdigit(value[i])) {
+            return 0;
+        }
+        number = number * 10 + value[i] - '0';
+    }
+
+    return (number <= MAX_DIMENSION) ? number : 0;
+}
+
+/* header_dimension()
+ *
+ * This function parses a raw image dimension given in a request header.
+ *
+ * headers: The request's headers.
+ * name: Name of the header.
+ *
+ * Returns: The dimension, or 0 if it is missing or invalid.
+ */
+unsigned long header_dimension(HttpHeader** headers, const char* name)
+{
+    const char* value = get_header_value(headers, name);
+
+    return value ? parse_dimension(value, strlen(value)) : 0;
+}
+
+/* is_raw_rgba()
+ *
+ * This function checks whether an upload is declared to be raw RGBA pixels.
+ *
+ * headers: The request's headers.
+ *
+ * Returns: True if the Content-Type is application/x-raw-rgba.
+ */
+bool is_raw_rgba(HttpHeader** headers)
+{
+    const char* type = get_header_value(headers, "Content-Type");
+    size_t len = strlen(rawRgbaType);
+
+    return type && !strncasecmp(type, rawRgbaType, len)
+            && (type[len] == '\0' || type[len] == ';' || type[len] == ' ');
+}
+
+/* next_token()
+ *
+ * This function finds the next whitespace separated token of a Netpbm header,
+ * skipping comments (from '#' to the end of the line).
+ *
+ * data: The upload.
+ * len: Length of the upload.
+ * pos: Position to search from, updated to just after the token.
+ * tokenLen: Used to return the length of the token.
+ *
+ * Returns: The token, or NULL if the header ended first.
+ */
+const char* next_token(const unsigned char* data, unsigned long len,
+        unsigned long* pos, size_t* tokenLen)
+{
+    unsigned long i = *pos;
+
+    while (i < len && (isspace(data[i]) || data[i] == '#')) {
+        if (data[i] == '#') {
+            while (i < len && data[i] != '\n') {
+                i++;
+            }
+        } else {
+            i++;
+        }
+    }
+    unsigned long start = i;
+    while (i < len && !isspace(data[i]) && data[i] != '#') {
+        i++;
+    }
+    if (i == start || i == len) {
+        return NULL;
+    }
+    *pos = i;
+    *tokenLen = i - start;
+
+    return (const char*)data + start;
+}
+
+/* ppm_layout()
+ *
+ * This function parses the header of a binary PPM ("P6") with 8 bit samples.
+ *
+ * data: The upload.
+ * len: Length of the upload.
+ * layout: Filled in with where the pixels are.
+ *
+ * Returns: True if the header is valid and supported.
+ */
+bool ppm_layout(const unsigned char* data, unsigned long len, RawLayout* layout)
+{
+    unsigned long pos = 2;
+    unsigned long values[3];
+    size_t tokenLen;
+
+    for (int i = 0; i < 3; i++) {
+        const char* token = next_token(data, len, &pos, &tokenLen);
+        values[i] = parse_dimension(token, tokenLen);
+        if (!values[i]) {
+            return false;
+        }
+    }
+    layout->width = values[0];
+    layout->height = values[1];
+    layout->channels = RGB_CHANNELS;
+    layout->stride = layout->width * RGB_CHANNELS;
+    layout->offset = pos + 1; // A single whitespace ends the header
+
+    return values[2] == NETPBM_MAXVAL && isspace(data[pos]);
+}
+
+/* pam_layout()
+ *
+ * This function parses the header of a PAM ("P7") of 8 bit RGB or RGBA
+ * samples.
+ *
+ * data: The upload.
+ * len: Length of the upload.
+ * layout: Filled in with where the pixels are.
+ *
+ * Returns: True if the header is valid and supported.
+ */
+bool pam_layout(const unsigned char* data, unsigned long len, RawLayout* layout)
+{
+    const char* const fields[] = {"WIDTH", "HEIGHT", "DEPTH", "MAXVAL"};
+    unsigned long values[4] = {0};
+    unsigned long pos = 2;
+    size_t tokenLen;
+    const char* token;
+
+    while ((token = next_token(data, len, &pos, &tokenLen))) {
+        if (tokenLen == strlen("ENDHDR")
+                && !strncmp(token, "ENDHDR", tokenLen)) {
+            break;
+        }
+        for (int i = 0; i < 4; i++) {
+            if (tokenLen == strlen(fields[i])
+                    && !strncmp(token, fields[i], tokenLen)) {
+                const char* value = next_token(data, len, &pos, &tokenLen);
+                values[i] = parse_dimension(value, tokenLen);
+            }
+        }
+    }
+    layout->width = values[0];
+    layout->height = values[1];
+    layout->channels = values[2];
+    layout->stride = layout->width * layout->channels;
+    layout->offset = pos + 1; // ENDHDR ends with a newline
+
+    return token && data[pos] == '\n' && layout->width && layout->height
+            && (values[2] == RGB_CHANNELS || values[2] == RGBA_CHANNELS)
+            && values[3] == NETPBM_MAXVAL;
+}
+
+/* raw_layout()
+ *
+ * This function works out where the pixels of a raw image upload are: raw
+ * RGBA pixels described by the X-Image-Width, X-Image-Height and (optional)
+ * X-Image-Stride headers, or a binary PPM or PAM. The pixels must fit within
+ * the upload.
+ *
+ * headers: The request's headers.
+ * data: The upload.
+ * len: Length of the upload.
+ * layout: Filled in with where the pixels are.
+ *
+ * Returns: True if the upload is a valid raw image.
+ */
+bool raw_layout(HttpHeader** headers, const unsigned char* data,
+        unsigned long len, RawLayout* layout)
+{
+    if (is_raw_rgba(headers)) {
+        layout->width = header_dimension(headers, "X-Image-Width");
+        layout->height = header_dimension(headers, "X-Image-Height");
+        layout->channels = RGBA_CHANNELS;
+        layout->stride = layout->width * RGBA_CHANNELS;
+        layout->offset = 0;
+        if (get_header_value(headers, "X-Image-Stride")) {
+            layout->stride = header_dimension(headers, "X-Image-Stride");
+        }
+    } else if (len > 2 && !memcmp(data, "P6", 2) && isspace(data[2])) {
+        if (!ppm_layout(data, len, layout)) {
+            return false;
+        }
+    } else if (len > 2 && !memcmp(data, "P7", 2) && data[2] == '\n') {
+        if (!pam_layout(data, len, layout)) {
+            return false;
+        }
+    } else {
+        return false;
+    }
+
+    // Check the rows fit (without overflowing)
+    unsigned long rowSize = layout->width * layout->channels;
+    if (!layout->width || !layout->height || layout->stride < rowSize
+            || layout->offset > len || len - layout->offset < rowSize) {
+        return false;
+    }
+    unsigned long spare = len - layout->offset - rowSize;
+
+    return layout->height - 1 <= spare / layout->stride;
+}
+
+/* is_raw_image()
+ *
+ * This function checks whether an upload holds raw pixels that can be used
+ * directly rather than being decoded by FreeImage: anything declared to be raw
+ * RGBA, or a binary PPM or PAM with 8 bit RGB(A) samples. Other Netpbm images
+ * are left to FreeImage.
+ *
+ * headers: The request's headers.
+ * data: The upload.
+ * len: Length of the upload.
+ *
+ * Returns: True if the upload is a raw image.
+ */
+bool is_raw_image(
+        HttpHeader** headers, const unsigned char* data, unsigned long len)
+{
+    RawLayout layout;
+
+    return is_raw_rgba(headers) || raw_layout(headers, data, len, &layout);
+}
+
+/* reorder_pixel()
+ *
+ * This function stores a raw RGB(A) pixel in FreeImage's channel order.
+ *
+ * dst: Where to store the pixel (may be the same as 'src').
+ * src: The pixel in RGB(A) order.
+ * channels: Number of channels (3 or 4).
+ */
+void reorder_pixel(unsigned char* dst, const unsigned char* src, int channels)
+{
+    unsigned char red = src[0];
+    unsigned char green = src[1];
+    unsigned char blue = src[2];
+
+    if (channels == 4) {
+        dst[FI_RGBA_ALPHA] = src[3];
+    }
+    dst[FI_RGBA_RED] = red;
+    dst[FI_RGBA_GREEN] = green;
+    dst[FI_RGBA_BLUE] = blue;
+}
+
+/* load_raw_image()
+ *
+ * This function turns a raw image upload into a FIBITMAP. The pixels are
+ * reordered into FreeImage's channel order in place, and if the rows are
+ * suitably aligned for a FreeImage bitmap the bitmap is made around the
+ * upload itself, without copying it. The upload must then outlive the bitmap.
+ * FreeImage doesn't turn rows around for a bitmap made around existing
+ * pixels (it keeps them bottom-up), so the rows are turned upside down while
+ * the pixels are reordered.
+ *
+ * headers: The request's headers.
+ * data: The upload (which is modified).
+ * len: Length of the upload.
+ *
+ * Returns: The image, or NULL if the upload isn't a valid raw image.
+ */
+FIBITMAP* load_raw_image(
+        HttpHeader** headers, unsigned char* data, unsigned long len)
+{
+    RawLayout layout;
+    if (!raw_layout(headers, data, len, &layout)) {
+        return NULL;
+    }
+    unsigned char* pixels = data + layout.offset;
+    unsigned long rowSize = layout.width * layout.channels;
+
+    // Swap each row with its mirror image (reordering both)
+    for (unsigned long y = 0; y < (layout.height + 1) / 2; y++) {
+        unsigned char* top = pixels + y * layout.stride;
+        unsigned char* bottom
+                = pixels + (layout.height - 1 - y) * layout.stride;
+        for (unsigned long x = 0; x < rowSize; x += layout.channels) {
+            unsigned char pixel[4];
+            memcpy(pixel, top + x, layout.channels);
+            reorder_pixel(top + x, bottom + x, layout.channels);
+            reorder_pixel(bottom + x, pixel, layout.channels);
+        }
+    }
+
+    bool aligned = layout.stride % ROW_ALIGN == 0
+            && (uintptr_t)pixels % ROW_ALIGN == 0;
+    return FreeImage_ConvertFromRawBitsEx(!aligned, pixels, FIT_BITMAP,
+            layout.width, layout.height, layout.stride,
+            layout.channels * 8, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK,
+            FI_RGBA_BLUE_MASK, FALSE);
+}
+
+/* read_be()
+ *
+ * Returns: The 'size' byte big-endian number at 'data'.
+ */
+unsigned long read_be(const unsigned char* data, int size)
+{
+    unsigned long value = 0;
+
+    for (int i = 0; i < size; i++) {
+        value = (value << 8) | data[i];
+    }
+
+    return value;
+}
+
+/* read_le()
+ *
+ * Returns: The 'size' byte little-endian number at 'data'.
+ */
+unsigned long read_le(const unsigned char* data, int size)
+{
+    unsigned long value = 0;
+
+    for (int i = size - 1; i >= 0; i--) {
+        value = (value << 8) | data[i];
+    }
+
+    return value;
+}
+
+/* jpeg_size()
+ *
+ * This function finds the size of a JPEG image by skipping its segments up to
+ * the first start of frame marker.
+ *
+ * data: The upload.
+ * len: Length of the upload.
+ * width: Used to return the width of the image.
+ * height: Used to return the height of the image.
+ *
+ * Returns: True if a start of frame was found.
+ */
+bool jpeg_size(const unsigned char* data, unsigned long len,
+        unsigned long* width, unsigned long* height)
+{
+    unsigned long pos = 2;
+
+    while (pos + 9 <= len && data[pos] == 0xFF) {
+        unsigned char marker = data[pos + 1];
+        if (marker == 0xFF) { // Fill byte
+            pos++;
+            continue;
+        }
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4
+                && marker != 0xC8 && marker != 0xCC) {
+            *height = read_be(data + pos + 5, 2);
+            *width = read_be(data + pos + 7, 2);
+            return true;
+        }
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+            pos += 2; // Markers without a segment
+        } else {
+            pos += 2 + read_be(data + pos + 2, 2);
+        }
+    }
+
+    return false;
+}
+
+/* peek_image_size()
+ *
+ * This function finds the size of an uploaded image from its header alone,
+ * without decoding it. Raw images, PNG, JPEG, GIF and BMP are recognised.
+ *
+ * headers: The request's headers.
+ * data: The upload.
+ * len: Length of the upload.
+ * width: Used to return the width of the image.
+ * height: Used to return the height of the image.
+ *
+ * Returns: True if the size was found (and is not empty).
+ */
+bool peek_image_size(HttpHeader** headers, const unsigned char* data,
+        unsigned long len, unsigned long* width, unsigned long* height)
+{
+    RawLayout layout;
+    *width = 0;
+    *height = 0;
+
+    if (raw_layout(headers, data, len, &layout)) {
+        *width = layout.width;
+        *height = layout.height;
+    } else if (len >= 24 && !memcmp(data, "\x89PNG\r\n\x1a\n", 8)) {
+        *width = read_be(data + 16, 4);
+        *height = read_be(data + 20, 4);
+    } else if (len >= 4 && data[0] == 0xFF && data[1] == 0xD8) {
+        jpeg_size(data, len, width, height);
+    } else if (len >= 10 && (!memcmp(data, "GIF87a", 6)
+                       || !memcmp(data, "GIF89a", 6))) {
+        *width = read_le(data + 6, 2);
+        *height = read_le(data + 8, 2);
+    } else if (len >= 26 && !memcmp(data, "BM", 2)) {
+        if (read_le(data + 14, 4) == 12) { // Old OS/2 header
+            *width = read_le(data + 18, 2);
+            *height = read_le(data + 20, 2);
+        } else {
+            *width = read_le(data + 18, 4);
+            *height = labs((int32_t)read_le(data + 22, 4));
+        }
+    }
+
+    return *width && *height;
+}
@@ -0,0 +1,16 @@
+#ifndef DECODE_H
+#define DECODE_H
+
+#include <stdbool.h>
+#include <FreeImage.h>
+#include <csse2310a4.h>
+
+// Function Prototypes
+bool is_raw_image(
+        HttpHeader** headers, const unsigned char* data, unsigned long len);
+FIBITMAP* load_raw_image(
+        HttpHeader** headers, unsigned char* data, unsigned long len);
+bool peek_image_size(HttpHeader** headers, const unsigned char* data,
+        unsigned long len, unsigned long* width, unsigned long* height);
+
+#endif
@@ -0,0 +1,625 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "encode.h"
+#include "bufferpool.h"
+
+// Named PNG compression levels and the FreeImage save flags they stand for
+const char* const pngLevelNames[] = {"fast", "default", "max", "none"};
+const int pngLevelFlags[] = {PNG_Z_BEST_SPEED, PNG_Z_DEFAULT_COMPRESSION,
+        PNG_Z_BEST_COMPRESSION, PNG_Z_NO_COMPRESSION};
+
+// Encoding values
+typedef enum {
+    PNG_LEVEL_NAMES = 4,
+    MAX_ZLIB_LEVEL = 9,
+    RGBA_CHANNELS = 4,
+    RGB_CHANNELS = 3,
+    NETPBM_HEADER_SIZE = 128,
+    QOI_HEADER_SIZE = 14,
+    QOI_END_SIZE = 8,
+    QOI_INDEX_SIZE = 64,
+    QOI_MAX_RUN = 62
+} EncodeValues;
+
+// QOI chunk tags
+typedef enum {
+    QOI_OP_INDEX = 0x00,
+    QOI_OP_DIFF = 0x40,
+    QOI_OP_LUMA = 0x80,
+    QOI_OP_RUN = 0xc0,
+    QOI_OP_RGB = 0xfe,
+    QOI_OP_RGBA = 0xff
+} QoiOp;
+
+/* parse_png_level()
+ *
+ * This function parses a PNG compression level: either a zlib level from 0
+ * (no compression) to 9 (smallest output), or one of the names "fast" (level
+ * 1), "default" (level 6), "max" (level 9) and "none" (level 0).
+ *
+ * value: The level as given by the client or on the command line.
+ *
+ * Returns: The FreeImage save flags for the level, or -1 if it is invalid.
+ */
+int parse_png_level(const char* value)
+{
+    for (int i = 0; i < PNG_LEVEL_NAMES; i++) {
+        if (!strcmp(value, pngLevelNames[i])) {
+            return pngLevelFlags[i];
+        }
+    }
+
+    if (strlen(value) != 1 || !isdigit(value[0])) {
+        return -1;
+    }
+    int level = value[0] - '0';
+    if (level > MAX_ZLIB_LEVEL) {
+        return -1;
+    }
+
+    return level ? level : PNG_Z_NO_COMPRESSION;
+}
+
+/* save_to_memory()
+ *
+ * This function encodes an image in one of the formats FreeImage can write.
+ *
+ * image: The image to encode.
+ * format: The FreeImage format to encode in.
+ * flags: FreeImage save flags for the format.
+ * size: Used to return the size of the encoded image.
+ *
+ * Returns: The encoding (in a buffer from buffer_alloc()), or NULL if encoding
+ *     failed.
+ */
+unsigned char* save_to_memory(FIBITMAP* image, FREE_IMAGE_FORMAT format,
+        int flags, unsigned long* size)
+{
+    FIMEMORY* stream = FreeImage_OpenMemory(NULL, 0);
+    unsigned char* output = NULL;
+    BYTE* data;
+    DWORD length;
+
+    if (FreeImage_SaveToMemory(format, image, stream, flags)
+            && FreeImage_AcquireMemory(stream, &data, &length)) {
+        output = buffer_alloc(length);
+        memcpy(output, data, length);
+        *size = length;
+    }
+    FreeImage_CloseMemory(stream);
+
+    return output;
+}
+
+/* encode_png()
+ *
+ * This function encodes an image as a PNG with the given zlib compression.
+ * Lower levels encode much faster at the cost of larger output.
+ *
+ * image: The image to encode.
+ * level: FreeImage PNG save flags, as returned by parse_png_level() (or
+ *     PNG_DEFAULT).
+ * size: Used to return the size of the encoded image.
+ *
+ * Returns: The dynamically allocated PNG, or NULL if encoding failed.
+ */
+unsigned char* encode_png(FIBITMAP* image, int level, unsigned long* size)
+{
+    return save_to_memory(image, FIF_PNG, level, size);
+}
+
+/* encode_bmp()
+ *
+ * This function encodes an image as an uncompressed BMP.
+ *
+ * image: The image to encode.
+ * level: Unused.
+ * size: Used to return the size of the encoded image.
+ *
+ * Returns: The dynamically allocated BMP, or NULL if encoding failed.
+ */
+unsigned char* encode_bmp(FIBITMAP* image, int level __attribute__((unused)),
+        unsigned long* size)
+{
+    return save_to_memory(image, FIF_BMP, BMP_DEFAULT, size);
+}
+
+/* Reads the rows of an image top down as 8 bit RGB or RGBA pixels. Images
+ * that aren't already 24 or 32 bit are converted to 32 bits first.
+ */
+typedef struct {
+    FIBITMAP* image;
+    FIBITMAP* converted;
+    unsigned width;
+    unsigned height;
+    int channels;
+} PixelReader;
+
+/* open_pixels()
+ *
+ * This function prepares to read the pixels of an image.
+ *
+ * reader: The PixelReader to set up.
+ * image: The image to read.
+ *
+ * Returns: True if the image can be read, false if it couldn't be converted.
+ */
+bool open_pixels(PixelReader* reader, FIBITMAP* image)
+{
+    unsigned bpp = FreeImage_GetBPP(image);
+
+    reader->converted = NULL;
+    if (FreeImage_GetImageType(image) != FIT_BITMAP
+            || (bpp != RGB_CHANNELS * 8 && bpp != RGBA_CHANNELS * 8)) {
+        reader->converted = FreeImage_ConvertTo32Bits(image);
+        if (!reader->converted) {
+            return false;
+        }
+        image = reader->converted;
+        bpp = RGBA_CHANNELS * 8;
+    }
+    reader->image = image;
+    reader->width = FreeImage_GetWidth(image);
+    reader->height = FreeImage_GetHeight(image);
+    reader->channels = bpp / 8;
+
+    return true;
+}
+
+/* read_pixels()
+ *
+ * This function copies one row of an image as RGB or RGBA bytes (RGBA if
+ * 'channels' is 4, adding opaque alpha to images without any).
+ *
+ * reader: The PixelReader.
+ * row: The row to read, counting from the top of the image.
+ * out: Buffer for width * channels bytes.
+ * channels: Number of channels to write (3 or 4).
+ */
+void read_pixels(
+        PixelReader* reader, unsigned row, unsigned char* out, int channels)
+{
+    const BYTE* in
+            = FreeImage_GetScanLine(reader->image, reader->height - 1 - row);
+
+    for (unsigned x = 0; x < reader->width; x++, in += reader->channels) {
+        out[0] = in[FI_RGBA_RED];
+        out[1] = in[FI_RGBA_GREEN];
+        out[2] = in[FI_RGBA_BLUE];
+        if (channels == RGBA_CHANNELS) {
+            out[3] = (reader->channels == RGBA_CHANNELS) ? in[FI_RGBA_ALPHA]
+                                                         : 0xff;
+        }
+        out += channels;
+    }
+}
+
+/* close_pixels()
+ *
+ * This function releases anything used to read the pixels of an image.
+ *
+ * reader: The PixelReader.
+ */
+void close_pixels(PixelReader* reader)
+{
+    if (reader->converted) {
+        FreeImage_Unload(reader->converted);
+    }
+}
+
+/* encode_pixels()
+ *
+ * This function encodes an image as a header followed by its rows of 8 bit
+ * pixels, top down and tightly packed. The header is printf()ed with the
+ * width, height, number of channels and PAM tuple type as its arguments (in
+ * that order).
+ *
+ * image: The image to encode.
+ * header: Format of the header.
+ * channels: Number of channels per pixel (3 for RGB, 4 for RGBA, or 0 for
+ *     RGBA only if the image has alpha).
+ * size: Used to return the size of the encoded image.
+ *
+ * Returns: The encoding (in a buffer from buffer_alloc()), or NULL if encoding
+ *     failed.
+ */
+unsigned char* encode_pixels(FIBITMAP* image, const char* header,
+        int channels, unsigned long* size)
+{
+    PixelReader reader;
+    if (!open_pixels(&reader, image)) {
+        return NULL;
+    }
+    if (!channels) {
+        channels = reader.channels;
+    }
+
+    char head[NETPBM_HEADER_SIZE];
+    int headLen = snprintf(head, sizeof(head), header, reader.width,
+            reader.height, channels,
+            (channels == RGBA_CHANNELS) ? "RGB_ALPHA" : "RGB");
+    size_t rowSize = (size_t)reader.width * channels;
+    *size = headLen + rowSize * reader.height;
+
+    unsigned char* output = buffer_alloc(*size);
+    memcpy(output, head, headLen);
+    for (unsigned y = 0; y < reader.height; y++) {
+        read_pixels(&reader, y, output + headLen + rowSize * y, channels);
+    }
+    close_pixels(&reader);
+
+    return output;
+}
+
+/* encode_pam()
+ *
+ * This function encodes an image as a (binary) PAM: RGB, or RGBA if the image
+ * has alpha.
+ *
+ * image: The image to encode.
+ * level: Unused.
+ * size: Used to return the size of the encoded image.
+ *
+ * Returns: The dynamically allocated PAM, or NULL if encoding failed.
+ */
+unsigned char* encode_pam(FIBITMAP* image, int level __attribute__((unused)),
+        unsigned long* size)
+{
+    return encode_pixels(image,
+            "P7\nWIDTH %u\nHEIGHT %u\nDEPTH %d\nMAXVAL 255\n"
+            "TUPLTYPE %s\nENDHDR\n",
+            0, size);
+}
+
+/* encode_ppm()
+ *
+ * This function encodes an image as a binary PPM (which has no alpha).
+ *
+ * image: The image to encode.
+ * level: Unused.
+ * size: Used to return the size of the encoded image.
+ *
+ * Returns: The dynamically allocated PPM, or NULL if encoding failed.
+ */
+unsigned char* encode_ppm(FIBITMAP* image, int level __attribute__((unused)),
+        unsigned long* size)
+{
+    return encode_pixels(image, "P6\n%u %u\n255\n", RGB_CHANNELS, size);
+}
+
+/* encode_raw()
+ *
+ * This function encodes an image as nothing but its RGBA pixels, top down with
+ * rows of width * 4 bytes.
+ *
+ * image: The image to encode.
+ * level: Unused.
+ * size: Used to return the size of the encoded image.
+ *
+ * Returns: The dynamically allocated pixels, or NULL if encoding failed.
+ */
+unsigned char* encode_raw(FIBITMAP* image, int level __attribute__((unused)),
+        unsigned long* size)
+{
+    return encode_pixels(image, "", RGBA_CHANNELS, size);
+}
+
+/* put_be32()
+ *
+ * This function writes a 32 bit value in big endian order.
+ *
+ * out: Where to write the value.
+ * value: The value.
+ */
+void put_be32(unsigned char* out, unsigned value)
+{
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+/* qoi_pixel()
+ *
+ * This function encodes one pixel (given it differs from the previous one) as
+ * the smallest QOI chunk that can represent it.
+ *
+ * px: The RGBA pixel.
+ * prev: The previous RGBA pixel.
+ * index: The QOI array of previously seen pixels.
+ * out: Where to write the chunk.
+ *
+ * Returns: The size of the chunk.
+ */
+int qoi_pixel(const unsigned char* px, const unsigned char* prev,
+        unsigned char (*index)[RGBA_CHANNELS], unsigned char* out)
+{
+    int slot = (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11)
+            % QOI_INDEX_SIZE;
+    if (!memcmp(index[slot], px, RGBA_CHANNELS)) {
+        out[0] = QOI_OP_INDEX | slot;
+        return 1;
+    }
+    memcpy(index[slot], px, RGBA_CHANNELS);
+
+    if (px[3] != prev[3]) {
+        out[0] = QOI_OP_RGBA;
+        memcpy(out + 1, px, RGBA_CHANNELS);
+        return 1 + RGBA_CHANNELS;
+    }
+
+    // Channel differences wrap around (so 0 - 255 is a difference of 1)
+    signed char dr = px[0] - prev[0];
+    signed char dg = px[1] - prev[1];
+    signed char db = px[2] - prev[2];
+    int drDg = dr - dg;
+    int dbDg = db - dg;
+    if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+        out[0] = QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+        return 1;
+    }
+    if (dg >= -32 && dg <= 31 && drDg >= -8 && drDg <= 7 && dbDg >= -8
+            && dbDg <= 7) {
+        out[0] = QOI_OP_LUMA | (dg + 32);
+        out[1] = (drDg + 8) << 4 | (dbDg + 8);
+        return 2;
+    }
+    out[0] = QOI_OP_RGB;
+    memcpy(out + 1, px, RGB_CHANNELS);
+
+    return 1 + RGB_CHANNELS;
+}
+
+/* encode_qoi()
+ *
+ * This function encodes an image as a QOI ("Quite OK Image"): a lossless
+ * format that encodes many times faster than PNG at a similar size.
+ *
+ * image: The image to encode.
+ * level: Unused.
+ * size: Used to return the size of the encoded image.
+ *
+ * Returns: The dynamically allocated QOI, or NULL if encoding failed.
+ */
+unsigned char* encode_qoi(FIBITMAP* image, int level __attribute__((unused)),
+        unsigned long* size)
+{
+    PixelReader reader;
+    if (!open_pixels(&reader, image)) {
+        return NULL;
+    }
+
+    // Worst case every pixel needs a whole QOI_OP_RGBA chunk
+    size_t pixels = (size_t)reader.width * reader.height;
+    unsigned char* output = buffer_alloc(QOI_HEADER_SIZE
+            + pixels * (RGBA_CHANNELS + 1) + QOI_END_SIZE);
+    memcpy(output, "qoif", 4);
+    put_be32(output + 4, reader.width);
+    put_be32(output + 8, reader.height);
+    output[12] = reader.channels;
+    output[13] = 0; // sRGB with linear alpha
+    size_t len = QOI_HEADER_SIZE;
+
+    unsigned char index[QOI_INDEX_SIZE][RGBA_CHANNELS] = {{0}};
+    unsigned char* row = malloc((size_t)reader.width * RGBA_CHANNELS);
+    unsigned char prev[RGBA_CHANNELS] = {0, 0, 0, 0xff};
+    int run = 0;
+    for (unsigned y = 0; y < reader.height; y++) {
+        read_pixels(&reader, y, row, RGBA_CHANNELS);
+        for (unsigned x = 0; x < reader.width; x++) {
+            const unsigned char* px = row + x * RGBA_CHANNELS;
+            if (!memcmp(px, prev, RGBA_CHANNELS)) {
+                if (++run == QOI_MAX_RUN) {
+                    output[len++] = QOI_OP_RUN | (run - 1);
+                    run = 0;
+                }
+                continue;
+            }
+            if (run) {
+                output[len++] = QOI_OP_RUN | (run - 1);
+                run = 0;
+            }
+            len += qoi_pixel(px, prev, index, output + len);
+            memcpy(prev, px, RGBA_CHANNELS);
+        }
+    }
+    if (run) {
+        output[len++] = QOI_OP_RUN | (run - 1);
+    }
+    free(row);
+    close_pixels(&reader);
+
+    memcpy(output + len, "\0\0\0\0\0\0\0\1", QOI_END_SIZE);
+    *size = len + QOI_END_SIZE;
+
+    return output;
+}
+
+// The output formats, in order of preference when a client accepts several
+// equally. The first is the default.
+const ImageEncoder imageEncoders[] = {
+        {"png", "image/png", encode_png, false},
+        {"qoi", "image/qoi", encode_qoi, false},
+        {"bmp", "image/bmp", encode_bmp, false},
+        {"pam", "image/x-portable-arbitrarymap", encode_pam, false},
+        {"ppm", "image/x-portable-pixmap", encode_ppm, false},
+        {"raw", "application/x-raw-rgba", encode_raw, true}};
+const int imageEncoderCount = sizeof(imageEncoders) / sizeof(ImageEncoder);
+
+/* default_encoder()
+ *
+ * Returns: The encoder used when a client doesn't say what it accepts (PNG).
+ */
+const ImageEncoder* default_encoder(void)
+{
+    return &imageEncoders[0];
+}
+
+/* range_specificity()
+ *
+ * This function checks whether a media range of an Accept header (any type,
+ * any subtype of one type or one exact type) covers a media type.
+ *
+ * range: The media range.
+ * rangeLen: Length of the media range.
+ * type: The media type.
+ *
+ * Returns: How specific the range is (0 to 2), or -1 if it doesn't match.
+ */
+int range_specificity(const char* range, size_t rangeLen, const char* type)
+{
+    size_t majorLen = strcspn(type, "/");
+
+    if (rangeLen == strlen(type) && !strncasecmp(range, type, rangeLen)) {
+        return 2;
+    }
+    if (rangeLen == majorLen + 2 && !strncasecmp(range, type, majorLen + 1)
+            && range[majorLen + 1] == '*') {
+        return 1;
+    }
+    if (rangeLen == 3 && !strncmp(range, "*/*", 3)) {
+        return 0;
+    }
+
+    return -1;
+}
+
+/* range_quality()
+ *
+ * This function finds the "q" parameter among the parameters of a media range.
+ *
+ * params: The parameters (from the ';' after the media range).
+ * end: The end of the parameters.
+ *
+ * Returns: The quality (between 0 and 1), which defaults to 1.
+ */
+double range_quality(const char* params, const char* end)
+{
+    double quality = 1;
+
+    for (const char* p = params; p < end; p++) {
+        if (*p != ';') {
+            continue;
+        }
+        while (p + 1 < end && isspace(p[1])) {
+            p++;
+        }
+        if (p + 2 < end && tolower(p[1]) == 'q' && p[2] == '=') {
+            quality = strtod(p + 3, NULL);
+            quality = (quality < 0) ? 0 : (quality > 1) ? 1 : quality;
+        }
+    }
+
+    return quality;
+}
+
+/* accept_quality()
+ *
+ * This function works out how acceptable a media type is according to an
+ * Accept header: the quality of the most specific media range covering it.
+ *
+ * accept: Value of the Accept header.
+ * type: The media type.
+ *
+ * Returns: The quality (0 if the type isn't acceptable).
+ */
+double accept_quality(const char* accept, const char* type)
+{
+    double quality = 0;
+    int best = -1;
+
+    while (*accept) {
+        size_t len = strcspn(accept, ",");
+        const char* end = accept + len;
+        const char* range = accept;
+        while (range < end && isspace(*range)) {
+            range++;
+        }
+        size_t rangeLen = strcspn(range, ";,");
+        while (rangeLen && isspace(range[rangeLen - 1])) {
+            rangeLen--;
+        }
+
+        int specificity = range_specificity(range, rangeLen, type);
+        if (specificity > best) {
+            best = specificity;
+            quality = range_quality(range + rangeLen, end);
+        }
+        accept = *end ? end + 1 : end;
+    }
+
+    return quality;
+}
+
+/* negotiate_encoder()
+ *
+ * This function chooses the output format for a request from its Accept
+ * header: the most acceptable format, preferring earlier formats among equally
+ * acceptable ones.
+ *
+ * accept: Value of the Accept header (NULL if there is none).
+ *
+ * Returns: The chosen encoder, or NULL if the client accepts none of the
+ *     formats.
+ */
+const ImageEncoder* negotiate_encoder(const char* accept)
+{
+    if (!accept || !*accept) {
+        return default_encoder();
+    }
+
+    const ImageEncoder* chosen = NULL;
+    double best = 0;
+    for (int i = 0; i < imageEncoderCount; i++) {
+        double quality = accept_quality(accept, imageEncoders[i].type);
+        if (quality > best) {
+            best = quality;
+            chosen = &imageEncoders[i];
+        }
+    }
+
+    return chosen;
+}
+
+/* encode_image()
+ *
+ * This function encodes an image with an encoder.
+ *
+ * encoder: The ImageEncoder for the output format.
+ * image: The image to encode.
+ * level: FreeImage PNG save flags (for zlib compressed formats).
+ *
+ * Returns: The dynamically allocated EncodedImage (with NULL data if encoding
+ *     failed), to be freed with free_encoded_image().
+ */
+EncodedImage* encode_image(
+        const ImageEncoder* encoder, FIBITMAP* image, int level)
+{
+    EncodedImage* encoded = calloc(1, sizeof(EncodedImage));
+    encoded->data = encoder->encode(image, level, &encoded->size);
+    if (!encoded->data) {
+        encoded->size = 0;
+    }
+    encoded->width = FreeImage_GetWidth(image);
+    encoded->height = FreeImage_GetHeight(image);
+
+    return encoded;
+}
+
+/* free_encoded_image()
+ *
+ * This function frees an EncodedImage (giving its data back to the buffer
+ * pool).
+ *
+ * encoded: Expected to be a pointer to the EncodedImage (may be NULL).
+ */
+void free_encoded_image(void* encoded)
+{
+    if (encoded) {
+        buffer_free(((EncodedImage*)encoded)->data);
+        free(encoded);
+    }
+}
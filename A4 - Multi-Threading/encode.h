@@ -0,0 +1,37 @@
+#ifndef ENCODE_H
+#define ENCODE_H
+
+#include <stdbool.h>
+#include <FreeImage.h>
+
+/* An encoded result image, along with the dimensions of the image */
+typedef struct {
+    unsigned char* data;
+    unsigned long size;
+    unsigned width;
+    unsigned height;
+} EncodedImage;
+
+/* An output format that results can be encoded in. 'encode' returns the
+ * encoding of an image in a buffer from buffer_alloc() (or NULL if encoding
+ * failed); 'level' only affects zlib compressed formats. Formats that are
+ * nothing but pixels have 'rawPixels' set, as their dimensions have to be
+ * sent alongside them.
+ */
+typedef struct {
+    const char* name;
+    const char* type;
+    unsigned char* (*encode)(FIBITMAP* image, int level, unsigned long* size);
+    bool rawPixels;
+} ImageEncoder;
+
+// Function Prototypes
+int parse_png_level(const char* value);
+unsigned char* encode_png(FIBITMAP* image, int level, unsigned long* size);
+const ImageEncoder* default_encoder(void);
+const ImageEncoder* negotiate_encoder(const char* accept);
+EncodedImage* encode_image(
+        const ImageEncoder* encoder, FIBITMAP* image, int level);
+void free_encoded_image(void* encoded);
+
+#endif
@@ -0,0 +1,128 @@
+#include <string.h>
+#include "hash.h"
+
+// Primes used by XXH64
+const uint64_t hashPrimes[5] = {11400714785074694791ULL,
+        14029467366897019727ULL, 1609587929392839161ULL,
+        9650029242287828579ULL, 2870177450012600261ULL};
+
+// Hash values
+typedef enum {
+    STRIPE_SIZE = 32,
+    LANE_SIZE = 8
+} HashValues;
+
+/* rotate_left()
+ *
+ * Returns: 'value' rotated left by 'bits' bits.
+ */
+uint64_t rotate_left(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+/* read64()
+ *
+ * Returns: The (unaligned) 64 bit value at 'data'.
+ */
+uint64_t read64(const unsigned char* data)
+{
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+
+    return value;
+}
+
+/* hash_round()
+ *
+ * This function mixes one 64 bit lane of input into an accumulator.
+ *
+ * acc: The accumulator.
+ * input: The input lane.
+ *
+ * Returns: The new accumulator.
+ */
+uint64_t hash_round(uint64_t acc, uint64_t input)
+{
+    acc += input * hashPrimes[1];
+
+    return rotate_left(acc, 31) * hashPrimes[0];
+}
+
+/* merge_round()
+ *
+ * This function folds one of the four stripe accumulators into the hash.
+ *
+ * hash: The hash so far.
+ * acc: The accumulator to fold in.
+ *
+ * Returns: The new hash.
+ */
+uint64_t merge_round(uint64_t hash, uint64_t acc)
+{
+    hash ^= hash_round(0, acc);
+
+    return hash * hashPrimes[0] + hashPrimes[3];
+}
+
+/* hash64()
+ *
+ * This function calculates the XXH64 hash of a block of memory. It is fast
+ * (several GB/s) and well distributed, but not cryptographic.
+ *
+ * data: The data to hash.
+ * len: Number of bytes of data.
+ * seed: Seed for the hash (different seeds give unrelated hashes).
+ *
+ * Returns: The 64 bit hash.
+ */
+uint64_t hash64(const void* data, size_t len, uint64_t seed)
+{
+    const unsigned char* p = data;
+    const unsigned char* end = p + len;
+    uint64_t hash;
+
+    if (len >= STRIPE_SIZE) {
+        uint64_t acc[4] = {seed + hashPrimes[0] + hashPrimes[1],
+                seed + hashPrimes[1], seed, seed - hashPrimes[0]};
+        for (; end - p >= STRIPE_SIZE; p += STRIPE_SIZE) {
+            for (int i = 0; i < 4; i++) {
+                acc[i] = hash_round(acc[i], read64(p + i * LANE_SIZE));
+            }
+        }
+        hash = rotate_left(acc[0], 1) + rotate_left(acc[1], 7)
+                + rotate_left(acc[2], 12) + rotate_left(acc[3], 18);
+        for (int i = 0; i < 4; i++) {
+            hash = merge_round(hash, acc[i]);
+        }
+    } else {
+        hash = seed + hashPrimes[4];
+    }
+    hash += len;
+
+    // Mix in whatever is left over
+    for (; end - p >= LANE_SIZE; p += LANE_SIZE) {
+        hash ^= hash_round(0, read64(p));
+        hash = rotate_left(hash, 27) * hashPrimes[0] + hashPrimes[3];
+    }
+    if (end - p >= 4) {
+        uint32_t word;
+        memcpy(&word, p, sizeof(word));
+        hash ^= word * hashPrimes[0];
+        hash = rotate_left(hash, 23) * hashPrimes[1] + hashPrimes[2];
+        p += 4;
+    }
+    for (; p < end; p++) {
+        hash ^= *p * hashPrimes[4];
+        hash = rotate_left(hash, 11) * hashPrimes[0];
+    }
+
+    // Final avalanche
+    hash ^= hash >> 33;
+    hash *= hashPrimes[1];
+    hash ^= hash >> 29;
+    hash *= hashPrimes[2];
+    hash ^= hash >> 32;
+
+    return hash;
+}
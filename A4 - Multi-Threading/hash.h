@@ -0,0 +1,10 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Function Prototypes
+uint64_t hash64(const void* data, size_t len, uint64_t seed);
+
+#endif
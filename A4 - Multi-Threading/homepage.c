@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "homepage.h"
+#include "hash.h"
+#include "metrics.h"
+
+// Home page values
+typedef enum {
+    HOME_PAGE_CHECK_USEC = 1000000
+} HomePageValues;
+
+/* drop_version()
+ *
+ * This function releases one reference to a version of the home page,
+ * freeing it once there are none left. The page's lock must be held.
+ *
+ * version: The HomePageVersion to release.
+ */
+void drop_version(HomePageVersion* version)
+{
+    if (--version->refs == 0) {
+        free(version->data);
+        free(version);
+    }
+}
+
+/* load_version()
+ *
+ * This function reads the whole of an open home page file in one go and
+ * calculates its ETag.
+ *
+ * fd: The open file.
+ * size: Size of the file in bytes.
+ *
+ * Returns: The new HomePageVersion (with one reference), or NULL if the file
+ *     couldn't be read.
+ */
+HomePageVersion* load_version(int fd, size_t size)
+{
+    HomePageVersion* version = malloc(sizeof(HomePageVersion));
+    version->data = malloc(size + 1);
+    version->size = 0;
+    version->refs = 1;
+
+    while (version->size < size) {
+        ssize_t got = read(fd, version->data + version->size,
+                size - version->size);
+        if (got <= 0) {
+            free(version->data);
+            free(version);
+            return NULL;
+        }
+        version->size += got;
+    }
+    snprintf(version->etag, ETAG_SIZE, "\"%016llx\"",
+            (unsigned long long)hash64(version->data, version->size, 0));
+
+    return version;
+}
+
+/* refresh_page()
+ *
+ * This function checks whether the home page file has changed since it was
+ * last loaded and loads it again if it has. If the file can't be read the
+ * last version loaded (if any) is kept. The page's lock must be held.
+ *
+ * page: A pointer to the HomePage.
+ */
+void refresh_page(HomePage* page)
+{
+    int fd = open(page->path, O_RDONLY);
+    struct stat info;
+    if (fd == -1 || fstat(fd, &info)) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+
+    if (!page->current || info.st_size != page->size
+            || info.st_ino != page->inode
+            || info.st_mtim.tv_sec != page->mtime.tv_sec
+            || info.st_mtim.tv_nsec != page->mtime.tv_nsec) {
+        HomePageVersion* version = load_version(fd, info.st_size);
+        if (version) {
+            if (page->current) {
+                drop_version(page->current);
+            }
+            page->current = version;
+            page->mtime = info.st_mtim;
+            page->inode = info.st_ino;
+            page->size = info.st_size;
+        }
+    }
+    close(fd);
+}
+
+/* home_page_create()
+ *
+ * This function creates a HomePage and loads it for the first time.
+ *
+ * path: Path of the home page file.
+ *
+ * Returns: A pointer to the newly allocated HomePage.
+ */
+HomePage* home_page_create(const char* path)
+{
+    HomePage* page = calloc(1, sizeof(HomePage));
+    page->path = strdup(path);
+    pthread_mutex_init(&page->lock, NULL);
+    refresh_page(page);
+    page->checkedAt = now_usec();
+
+    return page;
+}
+
+/* home_page_get()
+ *
+ * This function gets the current version of the home page, first reloading
+ * it if the file has changed (checking no more than once a second).
+ *
+ * page: A pointer to the HomePage.
+ *
+ * Returns: The current version (to be given back with home_page_release()),
+ *     or NULL if the page has never been read successfully.
+ */
+HomePageVersion* home_page_get(HomePage* page)
+{
+    unsigned long now = now_usec();
+
+    pthread_mutex_lock(&page->lock);
+    if (now - page->checkedAt >= HOME_PAGE_CHECK_USEC) {
+        refresh_page(page);
+        page->checkedAt = now;
+    }
+    HomePageVersion* version = page->current;
+    if (version) {
+        version->refs++;
+    }
+    pthread_mutex_unlock(&page->lock);
+
+    return version;
+}
+
+/* home_page_release()
+ *
+ * This function gives back a version of the home page from home_page_get().
+ *
+ * page: A pointer to the HomePage.
+ * version: The HomePageVersion to give back.
+ */
+void home_page_release(HomePage* page, HomePageVersion* version)
+{
+    pthread_mutex_lock(&page->lock);
+    drop_version(version);
+    pthread_mutex_unlock(&page->lock);
+}
+
+/* etag_matches()
+ *
+ * This function checks an If-None-Match header against an ETag. The header is
+ * either "*" or a comma separated list of entity tags, which are compared
+ * weakly (ignoring any "W/" prefix) as RFC 9110 requires for If-None-Match.
+ *
+ * ifNoneMatch: Value of the If-None-Match header.
+ * etag: The (quoted) ETag of the current representation.
+ *
+ * Returns: True if the header matches the ETag, otherwise false.
+ */
+bool etag_matches(const char* ifNoneMatch, const char* etag)
+{
+    size_t etagLen = strlen(etag);
+
+    while (*ifNoneMatch) {
+        ifNoneMatch += strspn(ifNoneMatch, " \t,");
+        size_t tagLen = strcspn(ifNoneMatch, ",");
+        while (tagLen && strchr(" \t", ifNoneMatch[tagLen - 1])) {
+            tagLen--;
+        }
+        if (tagLen == 1 && *ifNoneMatch == '*') {
+            return true;
+        }
+        const char* tag = ifNoneMatch;
+        if (tagLen > 2 && !strncmp(tag, "W/", 2)) {
+            tag += 2;
+            tagLen -= 2;
+        }
+        if (tagLen == etagLen && !strncmp(tag, etag, etagLen)) {
+            return true;
+        }
+        ifNoneMatch += strcspn(ifNoneMatch, ",");
+    }
+
+    return false;
+}
@@ -0,0 +1,43 @@
+#ifndef HOMEPAGE_H
+#define HOMEPAGE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/types.h>
+
+// Room for a quoted 64 bit hash
+#define ETAG_SIZE 24
+
+/* One loaded version of the home page along with its (strong) ETag. Versions
+ * are reference counted so a reload never frees a page still being sent.
+ */
+typedef struct {
+    unsigned char* data;
+    size_t size;
+    char etag[ETAG_SIZE];
+    unsigned refs;
+} HomePageVersion;
+
+/* The home page, loaded once and kept in memory. The file is looked at again
+ * at most once a second and only read again if its size, inode or
+ * modification time has changed.
+ */
+typedef struct {
+    char* path;
+    pthread_mutex_t lock;
+    HomePageVersion* current;
+    struct timespec mtime;
+    ino_t inode;
+    off_t size;
+    unsigned long checkedAt;
+} HomePage;
+
+// Function Prototypes
+HomePage* home_page_create(const char* path);
+HomePageVersion* home_page_get(HomePage* page);
+void home_page_release(HomePage* page, HomePageVersion* version);
+bool etag_matches(const char* ifNoneMatch, const char* etag);
+
+#endif
@@ -0,0 +1,655 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "httprequest.h"
+#include "bufferpool.h"
+#include "common.h"
+
+// HTTP parsing limits
+typedef enum {
+    MAX_HEADER_SIZE = 65536,
+    MAX_HEADER_COUNT = 100,
+    MAX_CHUNK_LINE = 1024
+} ParserLimits;
+
+/* http_parser_init()
+ *
+ * This function initialises a HttpParser so that it is ready to receive the
+ * first byte of a new request.
+ *
+ * parser: A pointer to an instance of the HttpParser struct.
+ * maxBody: Largest request body (in bytes) the parser will accept.
+ */
+void http_parser_init(HttpParser* parser, unsigned long maxBody)
+{
+    memset(parser, 0, sizeof(HttpParser));
+    parser->maxBody = maxBody;
+}
+
+/* http_parser_reset()
+ *
+ * This function discards any partially parsed request held by the parser and
+ * initialises it again.
+ *
+ * parser: A pointer to an instance of the HttpParser struct.
+ */
+void http_parser_reset(HttpParser* parser)
+{
+    free_http_request(&parser->request);
+    http_parser_init(parser, parser->maxBody);
+}
+
+/* http_parser_discard_all()
+ *
+ * This function makes the parser throw away all further input without
+ * looking at it, as it does after a request whose body was too large to be
+ * worth draining.
+ *
+ * parser: A pointer to an instance of the HttpParser struct.
+ */
+void http_parser_discard_all(HttpParser* parser)
+{
+    parser->state = DISCARDING_BODY;
+    parser->discardAll = true;
+}
+
+/* find_header_end()
+ *
+ * This function searches 'buffer' for the blank line that terminates the
+ * request line and headers, starting a few bytes before 'from' so that a
+ * terminator split across two reads is still found.
+ *
+ * buffer: Received bytes of the current request.
+ * length: Number of bytes in 'buffer'.
+ * from: Number of bytes that have already been searched.
+ *
+ * Returns: The offset just past the blank line, or 0 if it was not found.
+ */
+size_t find_header_end(const unsigned char* buffer, size_t length, size_t from)
+{
+    size_t i = (from > 3) ? from - 3 : 0;
+
+    for (; i + 3 < length; i++) {
+        if (buffer[i] == '\r' && buffer[i + 1] == '\n' && buffer[i + 2] == '\r'
+                && buffer[i + 3] == '\n') {
+            return i + 4;
+        }
+    }
+
+    return 0;
+}
+
+/* find_line_end()
+ *
+ * This function searches 'buffer' for the CRLF that ends a line.
+ *
+ * buffer: Received bytes starting at the beginning of the line.
+ * length: Number of bytes in 'buffer'.
+ * lineLen: Set to the length of the line (without the CRLF) if it was found.
+ *
+ * Returns: 1 if the whole line has been received, otherwise 0.
+ */
+int find_line_end(const unsigned char* buffer, size_t length, size_t* lineLen)
+{
+    for (size_t i = 0; i + 1 < length; i++) {
+        if (buffer[i] == '\r' && buffer[i + 1] == '\n') {
+            *lineLen = i;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* parse_request_line()
+ *
+ * This function parses a request line of the form "METHOD ADDRESS HTTP/x.y"
+ * and points the method, address and query string (empty if there is none)
+ * of 'request' into it.
+ *
+ * line: The NUL terminated request line (without the trailing CRLF).
+ * request: A pointer to the HttpRequest being filled in.
+ *
+ * Returns: 1 if the line was valid, otherwise 0.
+ */
+int parse_request_line(char* line, HttpRequest* request)
+{
+    char* address = strchr(line, ' ');
+    if (!address || address == line) {
+        return 0;
+    }
+    *address++ = '\0';
+
+    char* version = strchr(address, ' ');
+    if (!version || version == address || strncmp(version + 1, "HTTP/", 5)) {
+        return 0;
+    }
+    *version = '\0';
+
+    char* query = strchr(address, '?');
+    if (query) {
+        *query++ = '\0';
+    }
+
+    request->method = line;
+    request->address = address;
+    request->query = query ? query : address + strlen(address);
+    return 1;
+}
+
+/* parse_header_line()
+ *
+ * This function parses a single "Name: value" header line into 'header',
+ * whose name and value point into the line. Optional whitespace around the
+ * value is removed.
+ *
+ * line: The NUL terminated header line (without the trailing CRLF).
+ * header: The HttpHeader to fill in.
+ *
+ * Returns: 1 if the line was valid, otherwise 0.
+ */
+int parse_header_line(char* line, HttpHeader* header)
+{
+    char* value = strchr(line, ':');
+    if (!value || value == line) {
+        return 0;
+    }
+    *value++ = '\0';
+
+    // Trim optional whitespace
+    while (*value == ' ' || *value == '\t') {
+        value++;
+    }
+    size_t valueLen = strlen(value);
+    while (valueLen && (value[valueLen - 1] == ' '
+                               || value[valueLen - 1] == '\t')) {
+        value[--valueLen] = '\0';
+    }
+
+    header->name = line;
+    header->value = value;
+    return 1;
+}
+
+/* parse_header_block()
+ *
+ * This function parses the request line and all header lines of a request
+ * whose blank line terminator has been received. The block is copied into the
+ * request's arena once and parsed in place, so the method, address, query
+ * string and headers all point into that copy. The Content-Length header (if
+ * any) is recorded within the parser, which is then made ready to read a body
+ * of that length or, if the body is sent chunked, its first chunk.
+ *
+ * parser: A pointer to an instance of the HttpParser struct.
+ * buffer: Received bytes of the current request.
+ * headerLen: Length of the request line and headers including the blank line.
+ *
+ * Returns: 1 if the headers were valid, otherwise 0.
+ */
+int parse_header_block(
+        HttpParser* parser, const unsigned char* buffer, size_t headerLen)
+{
+    HttpRequest* request = &parser->request;
+    char* block = arena_strndup(
+            &request->arena, (const char*)buffer, headerLen - 4);
+
+    // Every line but the request line is a header
+    int count = 0;
+    for (char* end = strstr(block, "\r\n"); end;
+            end = strstr(end + 2, "\r\n")) {
+        count++;
+    }
+    if (count > MAX_HEADER_COUNT) {
+        return 0;
+    }
+    HttpHeader* headers
+            = arena_alloc(&request->arena, sizeof(HttpHeader) * count);
+    request->headers = arena_alloc(
+            &request->arena, sizeof(HttpHeader*) * (count + 1));
+    memset(request->headers, 0, sizeof(HttpHeader*) * (count + 1));
+    int valid = 1;
+
+    char* next = block;
+    for (int lineNum = 0; valid && next; lineNum++) {
+        char* line = next;
+        char* end = strstr(line, "\r\n");
+        next = end ? end + 2 : NULL;
+        if (end) {
+            *end = '\0';
+        }
+        if (lineNum == 0) {
+            valid = parse_request_line(line, request);
+        } else {
+            request->headers[lineNum - 1] = &headers[lineNum - 1];
+            valid = parse_header_line(line, &headers[lineNum - 1]);
+        }
+    }
+
+    // Record the body length
+    char* lengthStr = NULL;
+    if (valid) {
+        lengthStr = get_header_value(request->headers, "Content-Length");
+    }
+    if (lengthStr) {
+        valid = !is_empty(lengthStr)
+                && strspn(lengthStr, "0123456789") == strlen(lengthStr);
+        parser->contentLength = valid ? strtoul(lengthStr, NULL, 10) : 0;
+    }
+
+    // A chunked body takes precedence over any Content-Length
+    char* encoding = NULL;
+    if (valid) {
+        encoding = get_header_value(request->headers, "Transfer-Encoding");
+    }
+    if (encoding) {
+        valid = !strcasecmp(encoding, "chunked");
+        parser->contentLength = 0;
+    }
+    parser->state = encoding ? READING_CHUNK_SIZE : READING_BODY;
+
+    return valid;
+}
+
+/* body_too_large()
+ *
+ * This function completes the current request without its body once the body
+ * is known to be larger than the parser accepts. The request's length is set
+ * to the size of the body as far as it is known, and the parser is told to
+ * throw away the rest of the body (so the connection can be kept open) - or
+ * all further input if the rest is more than twice the largest body accepted
+ * or its size isn't known.
+ *
+ * parser: A pointer to an instance of the HttpParser struct.
+ * length: Size of the body as far as it is known.
+ * remaining: Number of bytes of the body still to come (0 if unknown).
+ *
+ * Returns: PARSE_COMPLETE.
+ */
+ParseStatus body_too_large(
+        HttpParser* parser, unsigned long length, unsigned long remaining)
+{
+    HttpRequest* request = &parser->request;
+    buffer_free(request->body);
+    request->body = NULL;
+    request->len = length;
+
+    if (remaining && remaining / 2 <= parser->maxBody) {
+        parser->discard = remaining;
+    } else {
+        parser->discardAll = true;
+    }
+
+    return PARSE_COMPLETE;
+}
+
+/* read_headers()
+ *
+ * This function waits for the request line and headers of a request and
+ * parses them once they have all arrived. A body known to be too large is
+ * rejected straight away, otherwise room for it is allocated.
+ *
+ * parser: A pointer to an instance of the HttpParser struct.
+ * buffer: Received bytes, starting at the beginning of the request.
+ * length: Number of bytes in 'buffer'.
+ * used: Set to the number of bytes used.
+ *
+ * Returns: The ParseStatus of the request.
+ */
+ParseStatus read_headers(HttpParser* parser, const unsigned char* buffer,
+        size_t length, size_t* used)
+{
+    size_t headerEnd = find_header_end(buffer, length, parser->scanned);
+    parser->scanned = length;
+    if (!headerEnd) {
+        return (length > MAX_HEADER_SIZE) ? PARSE_ERROR : PARSE_INCOMPLETE;
+    }
+    if (!parse_header_block(parser, buffer, headerEnd)) {
+        return PARSE_ERROR;
+    }
+    *used = headerEnd;
+    parser->scanned = 0;
+
+    if (parser->state == READING_CHUNK_SIZE) {
+        return PARSE_INCOMPLETE;
+    }
+    if (parser->contentLength > parser->maxBody) { // Don't wait for it
+        return body_too_large(
+                parser, parser->contentLength, parser->contentLength);
+    }
+    parser->request.body = buffer_alloc(parser->contentLength + 1);
+
+    return parser->contentLength ? PARSE_INCOMPLETE : PARSE_COMPLETE;
+}
+
+/* read_body()
+ *
+ * This function copies received bytes of a body of known length into the
+ * request.
+ *
+ * parser: A pointer to an instance of the HttpParser struct.
+ * buffer: Received bytes of the body.
+ * length: Number of bytes in 'buffer'.
+ * used: Set to the number of bytes used.
+ *
+ * Returns: PARSE_COMPLETE once the whole body has arrived, otherwise
+ *     PARSE_INCOMPLETE.
+ */
+ParseStatus read_body(HttpParser* parser, const unsigned char* buffer,
+        size_t length, size_t* used)
+{
+    HttpRequest* request = &parser->request;
+    unsigned long wanted = parser->contentLength - request->len;
+    size_t take = (length < wanted) ? length : wanted;
+
+    memcpy(request->body + request->len, buffer, take);
+    request->len += take;
+    *used = take;
+
+    return (request->len == parser->contentLength) ? PARSE_COMPLETE
+                                                    : PARSE_INCOMPLETE;
+}
+
+/* read_chunk_size()
+ *
+ * This function parses the line giving the size of the next chunk of a
+ * chunked body (ignoring any chunk extensions) and makes room for the chunk.
+ * A zero size marks the end of the body.
+ *
+ * parser: A pointer to an instance of the HttpParser struct.
+ * buffer: Received bytes, starting at the beginning of the line.
+ * length: Number of bytes in 'buffer'.
+ * used: Set to the number of bytes used.
+ *
+ * Returns: The ParseStatus of the request.
+ */
+ParseStatus read_chunk_size(HttpParser* parser, const unsigned char* buffer,
+        size_t length, size_t* used)
+{
+    HttpRequest* request = &parser->request;
+    size_t lineLen;
+
+    if (!find_line_end(buffer, length, &lineLen)) {
+        return (length > MAX_CHUNK_LINE) ? PARSE_ERROR : PARSE_INCOMPLETE;
+    }
+    *used = lineLen + 2;
+
+    // Sizes beyond the limit are only tracked as far as needed to reject them
+    unsigned long size = 0;
+    size_t digits = 0;
+    for (; digits < lineLen && isxdigit(buffer[digits]); digits++) {
+        int c = tolower(buffer[digits]);
+        if (size <= parser->maxBody) {
+            size = size * 16 + (isdigit(c) ? c - '0' : c - 'a' + 10);
+        }
+    }
+    if (!digits
+            || (digits < lineLen && !strchr("; \t", buffer[digits]))) {
+        return PARSE_ERROR;
+    }
+
+    if (!size) {
+        parser->state = READING_TRAILERS;
+        return PARSE_INCOMPLETE;
+    }
+    if (size > parser->maxBody - request->len) {
+        return body_too_large(parser, request->len + size, 0);
+    }
+
+    // Grow the body geometrically (but never beyond the limit)
+    unsigned long needed = request->len + size + 1;
+    if (needed > parser->bodyCap) {
+        unsigned long cap = parser->bodyCap * 2;
+        cap = (cap < needed) ? needed : cap;
+        cap = (cap > parser->maxBody + 1) ? parser->maxBody + 1 : cap;
+        request->body = buffer_grow(request->body, request->len, cap);
+        parser->bodyCap = buffer_capacity(request->body);
+    }
+    parser->chunkLeft = size;
+    parser->state = READING_CHUNK_DATA;
+
+    return PARSE_INCOMPLETE;
+}
+
+/* read_chunk_data()
+ *
+ * This function copies received bytes of the current chunk into the request.
+ *
+ * parser: A pointer to an instance of the HttpParser struct.
+ * buffer: Received bytes of the chunk.
+ * length: Number of bytes in 'buffer'.
+ * used: Set to the number of bytes used.
+ *
+ * Returns: PARSE_INCOMPLETE.
+ */
+ParseStatus read_chunk_data(HttpParser* parser, const unsigned char* buffer,
+        size_t length, size_t* used)
+{
+    HttpRequest* request = &parser->request;
+    size_t take = (length < parser->chunkLeft) ? length : parser->chunkLeft;
+
+    memcpy(request->body + request->len, buffer, take);
+    request->len += take;
+    parser->chunkLeft -= take;
+    *used = take;
+    if (!parser->chunkLeft) {
+        parser->state = READING_CHUNK_END;
+    }
+
+    return PARSE_INCOMPLETE;
+}
+
+/* read_chunk_end()
+ *
+ * This function checks for the CRLF that follows the data of each chunk.
+ *
+ * parser: A pointer to an instance of the HttpParser struct.
+ * buffer: Received bytes following the chunk data.
+ * length: Number of bytes in 'buffer'.
+ * used: Set to the number of bytes used.
+ *
+ * Returns: PARSE_ERROR if the CRLF is missing, otherwise PARSE_INCOMPLETE.
+ */
+ParseStatus read_chunk_end(HttpParser* parser, const unsigned char* buffer,
+        size_t length, size_t* used)
+{
+    if (length < 2) {
+        return PARSE_INCOMPLETE;
+    }
+    if (buffer[0] != '\r' || buffer[1] != '\n') {
+        return PARSE_ERROR;
+    }
+    *used = 2;
+    parser->state = READING_CHUNK_SIZE;
+
+    return PARSE_INCOMPLETE;
+}
+
+/* read_trailers()
+ *
+ * This function skips the (ignored) trailer lines after the last chunk of a
+ * chunked body, up to and including the blank line that ends the request.
+ *
+ * parser: A pointer to an instance of the HttpParser struct.
+ * buffer: Received bytes, starting at the beginning of a trailer line.
+ * length: Number of bytes in 'buffer'.
+ * used: Set to the number of bytes used.
+ *
+ * Returns: The ParseStatus of the request.
+ */
+ParseStatus read_trailers(HttpParser* parser, const unsigned char* buffer,
+        size_t length, size_t* used)
+{
+    HttpRequest* request = &parser->request;
+    size_t lineLen;
+
+    if (!find_line_end(buffer, length, &lineLen)) {
+        return (parser->scanned + length > MAX_HEADER_SIZE) ? PARSE_ERROR
+                                                             : PARSE_INCOMPLETE;
+    }
+    *used = lineLen + 2;
+    parser->scanned += lineLen + 2;
+    if (lineLen) {
+        return PARSE_INCOMPLETE;
+    }
+
+    if (!request->body) { // There were no chunks
+        request->body = buffer_alloc(1);
+    }
+    return PARSE_COMPLETE;
+}
+
+/* discard_body()
+ *
+ * This function throws away received bytes of a body that was too large.
+ *
+ * parser: A pointer to an instance of the HttpParser struct.
+ * buffer: Received bytes (unused).
+ * length: Number of bytes in 'buffer'.
+ * used: Set to the number of bytes thrown away.
+ *
+ * Returns: PARSE_INCOMPLETE.
+ */
+ParseStatus discard_body(HttpParser* parser,
+        const unsigned char* buffer __attribute__((unused)), size_t length,
+        size_t* used)
+{
+    if (parser->discardAll) {
+        *used = length;
+        return PARSE_INCOMPLETE;
+    }
+
+    *used = (length < parser->discard) ? length : parser->discard;
+    parser->discard -= *used;
+    if (!parser->discard) {
+        parser->state = READING_HEADERS;
+    }
+
+    return PARSE_INCOMPLETE;
+}
+
+// Functions handling each ParserState (in the order of the enum)
+ParseStatus (*const parserSteps[])(HttpParser*, const unsigned char*, size_t,
+        size_t*) = {read_headers, read_body, read_chunk_size, read_chunk_data,
+        read_chunk_end, read_trailers, discard_body};
+
+/* http_parser_feed()
+ *
+ * This function examines the bytes received so far on a connection. Bytes are
+ * used up as the request is parsed: the request line and headers once they
+ * have all arrived, and the body as it arrives. The caller must remove the
+ * used bytes from its input before feeding the parser again. Once the whole
+ * request has been received it is moved into 'request' and the parser is made
+ * ready for the next request on the same connection. A request whose body is
+ * too large is completed with a NULL body, its length being the size of the
+ * body as far as it is known.
+ *
+ * parser: A pointer to an instance of the HttpParser struct.
+ * buffer: All received bytes that have not yet been used.
+ * length: Number of bytes in 'buffer'.
+ * consumed: Set to the number of bytes used.
+ * request: Filled in with the completed request.
+ *
+ * Returns: PARSE_COMPLETE when a request was completed, PARSE_INCOMPLETE when
+ *     more bytes are needed and PARSE_ERROR if the request is malformed.
+ */
+ParseStatus http_parser_feed(HttpParser* parser, const unsigned char* buffer,
+        size_t length, size_t* consumed, HttpRequest* request)
+{
+    ParseStatus status = PARSE_INCOMPLETE;
+    *consumed = 0;
+
+    // Keep going until a request is complete or no progress can be made
+    while (status == PARSE_INCOMPLETE) {
+        ParserState state = parser->state;
+        size_t used = 0;
+        status = parserSteps[state](
+                parser, buffer + *consumed, length - *consumed, &used);
+        *consumed += used;
+        if (status == PARSE_INCOMPLETE && !used && parser->state == state) {
+            return PARSE_INCOMPLETE;
+        }
+    }
+
+    if (status == PARSE_COMPLETE) {
+        *request = parser->request;
+        memset(&parser->request, 0, sizeof(HttpRequest));
+        parser->scanned = 0;
+        parser->bodyCap = 0;
+        parser->state = (parser->discard || parser->discardAll)
+                ? DISCARDING_BODY
+                : READING_HEADERS;
+    }
+
+    return status;
+}
+
+/* get_header_value()
+ *
+ * This function finds the value of the header called 'name' (compared case
+ * insensitively) within a NULL terminated array of headers.
+ *
+ * headers: NULL terminated array of HttpHeader pointers (may be NULL).
+ * name: Name of the header to find.
+ *
+ * Returns: The value of the first matching header, or NULL if not present.
+ */
+char* get_header_value(HttpHeader** headers, const char* name)
+{
+    for (int i = 0; headers && headers[i]; i++) {
+        if (!strcasecmp(headers[i]->name, name)) {
+            return headers[i]->value;
+        }
+    }
+
+    return NULL;
+}
+
+/* get_query_param()
+ *
+ * This function finds the value of the parameter called 'name' within a query
+ * string of the form "name=value&flag&...". A parameter given without a value
+ * has the value "".
+ *
+ * query: The query string (without the leading '?').
+ * name: Name of the parameter to find.
+ *
+ * Returns: A dynamically allocated copy of the value of the first matching
+ *     parameter, or NULL if not present.
+ */
+char* get_query_param(const char* query, const char* name)
+{
+    size_t nameLen = strlen(name);
+
+    while (query && *query) {
+        size_t paramLen = strcspn(query, "&");
+        if (paramLen >= nameLen && !strncmp(query, name, nameLen)
+                && (paramLen == nameLen || query[nameLen] == '=')) {
+            const char* value = query + nameLen;
+            if (*value == '=') {
+                value++;
+            }
+            return strndup(value, query + paramLen - value);
+        }
+        query += paramLen;
+        if (*query) { // Skip the '&'
+            query++;
+        }
+    }
+
+    return NULL;
+}
+
+/* free_http_request()
+ *
+ * This function frees all the necessary dynamically allocated memory for a
+ * HTTP request: its body buffer and everything allocated from its arena.
+ *
+ * request: A pointer to an instance of the HttpRequest struct.
+ */
+void free_http_request(HttpRequest* request)
+{
+    buffer_free(request->body);
+    arena_release(&request->arena);
+    memset(request, 0, sizeof(HttpRequest));
+}
@@ -0,0 +1,74 @@
+#ifndef HTTPREQUEST_H
+#define HTTPREQUEST_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <csse2310a4.h>
+#include "arena.h"
+
+/* A single fully received HTTP request, released with free_http_request().
+ * The method, address, query string (anything after a '?' in the request
+ * target) and headers are allocated from the request's arena, as is anything
+ * else that lives only as long as the request. The body is a buffer from the
+ * buffer pool.
+ */
+typedef struct {
+    char* method;
+    char* address;
+    char* query;
+    HttpHeader** headers;
+    unsigned char* body;
+    unsigned long len;
+    Arena arena;
+} HttpRequest;
+
+// What a HttpParser is waiting to receive
+typedef enum {
+    READING_HEADERS,
+    READING_BODY,
+    READING_CHUNK_SIZE,
+    READING_CHUNK_DATA,
+    READING_CHUNK_END,
+    READING_TRAILERS,
+    DISCARDING_BODY
+} ParserState;
+
+/* Incremental HTTP request parser state. The parser is repeatedly fed the
+ * bytes received so far for the current request and remembers how much of
+ * them it has already examined, so each byte is only scanned once. Bodies
+ * (given by Content-Length or sent chunked) are copied out of the input as
+ * they arrive and may be at most 'maxBody' bytes. A request with a larger body
+ * is completed without its body as soon as that is known, and the rest of the
+ * body is then thrown away: 'discard' more bytes, or all further input if
+ * 'discardAll' is set (when there is too much to be worth draining).
+ */
+typedef struct {
+    ParserState state;
+    size_t scanned;
+    unsigned long maxBody;
+    unsigned long contentLength;
+    unsigned long bodyCap;
+    unsigned long chunkLeft;
+    unsigned long discard;
+    bool discardAll;
+    HttpRequest request;
+} HttpParser;
+
+// Result of feeding bytes to a HttpParser
+typedef enum {
+    PARSE_ERROR = -1,
+    PARSE_INCOMPLETE = 0,
+    PARSE_COMPLETE = 1
+} ParseStatus;
+
+// Function Prototypes
+void http_parser_init(HttpParser* parser, unsigned long maxBody);
+void http_parser_reset(HttpParser* parser);
+void http_parser_discard_all(HttpParser* parser);
+ParseStatus http_parser_feed(HttpParser* parser, const unsigned char* buffer,
+        size_t length, size_t* consumed, HttpRequest* request);
+char* get_header_value(HttpHeader** headers, const char* name);
+char* get_query_param(const char* query, const char* name);
+void free_http_request(HttpRequest* request);
+
+#endif
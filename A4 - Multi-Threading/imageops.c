@@ -0,0 +1,911 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <math.h>
+#include <csse2310a4.h>
+#include "imageops.h"
+#include "rescale.h"
+#include "taskpool.h"
+
+// Image operation values
+typedef enum {
+    ROTATE_TILE = 64,
+    QUARTER_TURN = 90,
+    TURNS_PER_CIRCLE = 4,
+    ROTATE_PASSES = 3
+} ImageOpValues;
+
+/* A reorientation being split into bands of rows */
+typedef struct {
+    FIBITMAP* src;
+    FIBITMAP* dst;
+    Orientation orientation;
+} OrientJob;
+
+// A downscale moved in front of a rotation keeps this many times more pixels
+// (in each direction) than the final size, so the final scale still has
+// detail to work with
+const double prescaleMargin = 2.0;
+
+/* right_angle_turns()
+ *
+ * This function checks whether a rotation is a multiple of 90 degrees.
+ * Negative rotations are turned into the equivalent positive number of turns
+ * (e.g. -270 is the same as 90).
+ *
+ * degrees: Rotation in degrees (counter-clockwise, as for FreeImage_Rotate).
+ *
+ * Returns: The number of counter-clockwise quarter turns (0 to 3) if
+ *     'degrees' is a right angle, otherwise -1.
+ */
+int right_angle_turns(int degrees)
+{
+    if (degrees % QUARTER_TURN) {
+        return -1;
+    }
+
+    int turns = (degrees / QUARTER_TURN) % TURNS_PER_CIRCLE;
+
+    return (turns + TURNS_PER_CIRCLE) % TURNS_PER_CIRCLE;
+}
+
+/* copy_pixel()
+ *
+ * This function copies a single pixel of 'bytes' bytes. Common pixel sizes
+ * are copied with fixed size moves rather than a call to memcpy().
+ *
+ * dst: Where to copy the pixel to.
+ * src: The pixel to be copied.
+ * bytes: Size of a pixel in bytes.
+ */
+void copy_pixel(BYTE* dst, const BYTE* src, unsigned bytes)
+{
+    switch (bytes) {
+    case 1:
+        *dst = *src;
+        break;
+    case 2:
+        memcpy(dst, src, 2);
+        break;
+    case 3:
+        memcpy(dst, src, 3);
+        break;
+    case 4:
+        memcpy(dst, src, 4);
+        break;
+    case 6:
+        memcpy(dst, src, 6);
+        break;
+    case 8:
+        memcpy(dst, src, 8);
+        break;
+    default:
+        memcpy(dst, src, bytes);
+    }
+}
+
+/* get_packed_pixel()
+ *
+ * This function reads a pixel from a scanline of a 1 or 4 bpp image (pixels
+ * are packed most significant bits first).
+ *
+ * line: The scanline to read from.
+ * x: Column of the pixel.
+ * bpp: Bits per pixel.
+ *
+ * Returns: The palette index of the pixel.
+ */
+unsigned get_packed_pixel(const BYTE* line, unsigned x, unsigned bpp)
+{
+    unsigned bit = x * bpp;
+    unsigned shift = 8 - bpp - (bit & 7);
+
+    return (line[bit >> 3] >> shift) & ((1 << bpp) - 1);
+}
+
+/* set_packed_pixel()
+ *
+ * This function writes a pixel to a scanline of a 1 or 4 bpp image.
+ *
+ * line: The scanline to write to.
+ * x: Column of the pixel.
+ * bpp: Bits per pixel.
+ * value: Palette index to store.
+ */
+void set_packed_pixel(BYTE* line, unsigned x, unsigned bpp, unsigned value)
+{
+    unsigned bit = x * bpp;
+    unsigned shift = 8 - bpp - (bit & 7);
+    BYTE mask = ((1 << bpp) - 1) << shift;
+
+    line[bit >> 3] = (line[bit >> 3] & ~mask) | (value << shift);
+}
+
+/* compose_orientation()
+ *
+ * This function combines two orientations into the single orientation that
+ * has the same effect as applying 'first' and then 'then'.
+ *
+ * first: The orientation applied first.
+ * then: The orientation applied second.
+ *
+ * Returns: The combined orientation.
+ */
+Orientation compose_orientation(Orientation first, Orientation then)
+{
+    Orientation result = first;
+
+    // Flipping after a rotation is the same as flipping before the opposite
+    // rotation
+    if (then.flipped) {
+        result.turns = (TURNS_PER_CIRCLE - result.turns) % TURNS_PER_CIRCLE;
+        result.flipped = !result.flipped;
+    }
+    result.turns = (result.turns + then.turns) % TURNS_PER_CIRCLE;
+
+    return result;
+}
+
+/* source_position()
+ *
+ * This function finds which source pixel lands on pixel (x, y) of the
+ * reoriented image. Coordinates are in FreeImage's storage order (row 0 is the
+ * bottom row), which gives the same result as FreeImage_Rotate() and the
+ * FreeImage flip functions.
+ *
+ * orientation: The orientation being applied.
+ * width: Width of the source image.
+ * height: Height of the source image.
+ * x: Column of the reoriented pixel.
+ * y: Row of the reoriented pixel.
+ * srcX: Used to return the column of the source pixel.
+ * srcY: Used to return the row of the source pixel.
+ */
+void source_position(Orientation orientation, unsigned width, unsigned height,
+        unsigned x, unsigned y, unsigned* srcX, unsigned* srcY)
+{
+    if (orientation.turns == 0) {
+        *srcX = x;
+        *srcY = y;
+    } else if (orientation.turns == 1) {
+        *srcX = y;
+        *srcY = height - 1 - x;
+    } else if (orientation.turns == 2) {
+        *srcX = width - 1 - x;
+        *srcY = height - 1 - y;
+    } else {
+        *srcX = width - 1 - y;
+        *srcY = x;
+    }
+
+    // The flip happens first, so undo it last
+    if (orientation.flipped) {
+        *srcX = width - 1 - *srcX;
+    }
+}
+
+/* source_step()
+ *
+ * This function finds how far apart (in bytes) the source pixels of two
+ * neighbouring pixels of a reoriented row are.
+ *
+ * src: The source image.
+ * orientation: The orientation being applied.
+ *
+ * Returns: The distance between the source pixels of (x, y) and (x + 1, y).
+ */
+ptrdiff_t source_step(FIBITMAP* src, Orientation orientation)
+{
+    ptrdiff_t bytes = FreeImage_GetBPP(src) / 8;
+    ptrdiff_t pitch = FreeImage_GetPitch(src);
+    ptrdiff_t steps[TURNS_PER_CIRCLE] = {bytes, -pitch, -bytes, pitch};
+    ptrdiff_t step = steps[orientation.turns];
+
+    // Flipping reverses the direction of a step along a row
+    if (orientation.flipped && (orientation.turns % 2 == 0)) {
+        step = -step;
+    }
+
+    return step;
+}
+
+/* orient_packed_tile()
+ *
+ * This function reorients one tile of a 1 or 4 bpp image pixel by pixel.
+ *
+ * src: The source image.
+ * dst: The reoriented image.
+ * orientation: The orientation being applied.
+ * x0, y0: Bottom left corner of the tile within 'dst'.
+ * x1, y1: Top right corner (exclusive) of the tile within 'dst'.
+ */
+void orient_packed_tile(FIBITMAP* src, FIBITMAP* dst, Orientation orientation,
+        unsigned x0, unsigned y0, unsigned x1, unsigned y1)
+{
+    unsigned bpp = FreeImage_GetBPP(src);
+    unsigned width = FreeImage_GetWidth(src);
+    unsigned height = FreeImage_GetHeight(src);
+
+    for (unsigned y = y0; y < y1; y++) {
+        BYTE* dstLine = FreeImage_GetScanLine(dst, y);
+        for (unsigned x = x0; x < x1; x++) {
+            unsigned srcX;
+            unsigned srcY;
+            source_position(orientation, width, height, x, y, &srcX, &srcY);
+            set_packed_pixel(dstLine, x, bpp,
+                    get_packed_pixel(
+                            FreeImage_GetScanLine(src, srcY), srcX, bpp));
+        }
+    }
+}
+
+/* orient_tile()
+ *
+ * This function reorients one tile of an image with whole byte pixels. Each
+ * row of the tile is read from the source with a constant stride (a column of
+ * the source for quarter turns), and the tile is small enough for the source
+ * rows it touches to stay in cache while it is written.
+ *
+ * src: The source image.
+ * dst: The reoriented image.
+ * orientation: The orientation being applied.
+ * x0, y0: Bottom left corner of the tile within 'dst'.
+ * x1, y1: Top right corner (exclusive) of the tile within 'dst'.
+ */
+void orient_tile(FIBITMAP* src, FIBITMAP* dst, Orientation orientation,
+        unsigned x0, unsigned y0, unsigned x1, unsigned y1)
+{
+    unsigned bytes = FreeImage_GetBPP(src) / 8;
+    ptrdiff_t step = source_step(src, orientation);
+
+    for (unsigned y = y0; y < y1; y++) {
+        unsigned srcX;
+        unsigned srcY;
+        source_position(orientation, FreeImage_GetWidth(src),
+                FreeImage_GetHeight(src), x0, y, &srcX, &srcY);
+        const BYTE* in = FreeImage_GetScanLine(src, srcY) + srcX * bytes;
+        BYTE* out = FreeImage_GetScanLine(dst, y) + x0 * bytes;
+        for (unsigned x = x0; x < x1; x++) {
+            copy_pixel(out, in, bytes);
+            out += bytes;
+            in += step;
+        }
+    }
+}
+
+/* orient_rows()
+ *
+ * This function fills rows [firstRow, lastRow) of 'dst' with 'src' in the
+ * given orientation. The rows are processed in square tiles so that the
+ * strided reads of a quarter turn are served from cache.
+ *
+ * src: The source image.
+ * dst: The reoriented image (already allocated with the right dimensions).
+ * orientation: The orientation being applied.
+ * firstRow: First row of 'dst' to fill.
+ * lastRow: Row of 'dst' to stop at (exclusive).
+ */
+void orient_rows(FIBITMAP* src, FIBITMAP* dst, Orientation orientation,
+        unsigned firstRow, unsigned lastRow)
+{
+    unsigned width = FreeImage_GetWidth(dst);
+    bool packed = FreeImage_GetBPP(src) < 8;
+
+    for (unsigned y0 = firstRow; y0 < lastRow; y0 += ROTATE_TILE) {
+        unsigned y1 = (lastRow - y0 > ROTATE_TILE) ? y0 + ROTATE_TILE : lastRow;
+        for (unsigned x0 = 0; x0 < width; x0 += ROTATE_TILE) {
+            unsigned x1 = (width - x0 > ROTATE_TILE) ? x0 + ROTATE_TILE : width;
+            if (packed) {
+                orient_packed_tile(src, dst, orientation, x0, y0, x1, y1);
+            } else {
+                orient_tile(src, dst, orientation, x0, y0, x1, y1);
+            }
+        }
+    }
+}
+
+/* orient_band()
+ *
+ * This is the TaskFunction for reorienting a band of rows in parallel.
+ *
+ * arg: Expected to be a pointer to the OrientJob.
+ * firstRow: First row of the reoriented image to fill.
+ * lastRow: Row to stop at (exclusive).
+ */
+void orient_band(void* arg, unsigned firstRow, unsigned lastRow)
+{
+    OrientJob* job = (OrientJob*)arg;
+
+    orient_rows(job->src, job->dst, job->orientation, firstRow, lastRow);
+}
+
+/* orient_image()
+ *
+ * This function losslessly reorients an image in a single pass. For a right
+ * angle rotation the result is identical to FreeImage_Rotate() (including the
+ * palette, transparency table and metadata) but pixels are only copied rather
+ * than interpolated, and images of any bit depth are supported. Large images
+ * are split into bands of tiles that are reoriented in parallel. If the work
+ * is cancelled the remaining bands are skipped.
+ *
+ * imageMap: The image to be reoriented (left unchanged).
+ * orientation: The orientation to apply.
+ * tasks: The TaskPool to split the work across (may be NULL).
+ * cancel: A pointer to the CancelToken of the work (may be NULL).
+ *
+ * Returns: A newly allocated reoriented image (incomplete if the work was
+ *     cancelled), or NULL if allocation failed.
+ */
+FIBITMAP* orient_image(FIBITMAP* imageMap, Orientation orientation,
+        TaskPool* tasks, const CancelToken* cancel)
+{
+    if (!orientation.turns && !orientation.flipped) {
+        return FreeImage_Clone(imageMap);
+    }
+
+    unsigned width = FreeImage_GetWidth(imageMap);
+    unsigned height = FreeImage_GetHeight(imageMap);
+    bool sideways = orientation.turns % 2;
+    FIBITMAP* oriented = FreeImage_AllocateT(FreeImage_GetImageType(imageMap),
+            sideways ? height : width, sideways ? width : height,
+            FreeImage_GetBPP(imageMap), FreeImage_GetRedMask(imageMap),
+            FreeImage_GetGreenMask(imageMap), FreeImage_GetBlueMask(imageMap));
+    if (!oriented) {
+        return NULL;
+    }
+
+    // Keep the palette and transparency of palettised images
+    if (FreeImage_GetPalette(imageMap)) {
+        memcpy(FreeImage_GetPalette(oriented), FreeImage_GetPalette(imageMap),
+                FreeImage_GetColorsUsed(imageMap) * sizeof(RGBQUAD));
+    }
+    FreeImage_SetTransparencyTable(oriented,
+            FreeImage_GetTransparencyTable(imageMap),
+            FreeImage_GetTransparencyCount(imageMap));
+    FreeImage_CloneMetadata(oriented, imageMap);
+
+    OrientJob job = {imageMap, oriented, orientation};
+    taskpool_run(tasks, orient_band, &job, FreeImage_GetHeight(oriented),
+            ROTATE_TILE, (unsigned long)width * height, cancel);
+
+    return oriented;
+}
+
+/* parse_operation()
+ *
+ * This function converts a single (already validated) requested operation
+ * into an ImageOp. Right angle rotations and flips become orientations.
+ *
+ * args: Array of strings in the format of [operation, arg, arg2, ...].
+ *
+ * Returns: The ImageOp for the operation.
+ */
+ImageOp parse_operation(char** args)
+{
+    ImageOp op;
+    memset(&op, 0, sizeof(ImageOp));
+
+    if (!strcmp(args[0], "rotate")) {
+        op.degrees = atoi(args[1]);
+        op.orientation.turns = right_angle_turns(op.degrees);
+        op.type = (op.orientation.turns >= 0) ? ORIENT_OP : ROTATE_OP;
+    } else if (!strcmp(args[0], "flip")) {
+        // A vertical flip is a horizontal flip followed by a half turn
+        op.type = ORIENT_OP;
+        op.orientation.flipped = true;
+        op.orientation.turns = strcmp(args[1], "h") ? 2 : 0;
+    } else {
+        op.type = SCALE_OP;
+        op.width = atoi(args[1]);
+        op.height = atoi(args[2]);
+    }
+
+    return op;
+}
+
+/* only_rotates()
+ *
+ * This function checks whether an operation does nothing but rotate the
+ * image.
+ *
+ * op: A pointer to the ImageOp.
+ *
+ * Returns: True if the operation is a rotation of any angle, otherwise false.
+ */
+bool only_rotates(const ImageOp* op)
+{
+    return op->type == ROTATE_OP
+            || (op->type == ORIENT_OP && !op->orientation.flipped);
+}
+
+/* rotation_degrees()
+ *
+ * This function finds the rotation performed by an operation that only
+ * rotates the image (see only_rotates()).
+ *
+ * op: A pointer to the ImageOp.
+ *
+ * Returns: The counter-clockwise rotation in degrees.
+ */
+int rotation_degrees(const ImageOp* op)
+{
+    if (op->type == ROTATE_OP) {
+        return op->degrees;
+    }
+
+    return op->orientation.turns * QUARTER_TURN;
+}
+
+/* add_operation()
+ *
+ * This function appends an operation to a plan, folding it into the last
+ * operation of the plan where possible: orientations are combined into one
+ * orientation and (unless exact FreeImage results are required) rotations
+ * into a single angle.
+ *
+ * plan: A pointer to the OpPlan being built.
+ * op: The operation to be added.
+ * exact: Whether the result must be exactly what FreeImage would give.
+ */
+void add_operation(OpPlan* plan, ImageOp op, bool exact)
+{
+    ImageOp* last = plan->count ? &plan->ops[plan->count - 1] : NULL;
+
+    if (last && last->type == ORIENT_OP && op.type == ORIENT_OP) {
+        last->orientation
+                = compose_orientation(last->orientation, op.orientation);
+    } else if (last && !exact
+            && (last->type == ROTATE_OP || op.type == ROTATE_OP)
+            && only_rotates(last) && only_rotates(&op)) {
+        int degrees = (rotation_degrees(last) + rotation_degrees(&op))
+                % (QUARTER_TURN * TURNS_PER_CIRCLE);
+        plan->count--;
+        if (right_angle_turns(degrees) >= 0) {
+            op.type = ORIENT_OP;
+            op.orientation.turns = right_angle_turns(degrees);
+            op.orientation.flipped = false;
+        } else {
+            op.type = ROTATE_OP;
+            op.degrees = degrees;
+        }
+        add_operation(plan, op, exact);
+    } else {
+        plan->ops[plan->count++] = op;
+    }
+}
+
+/* plan_operations()
+ *
+ * This function builds the plan of operations for a request. Runs of flips
+ * and right angle rotations are folded into one orientation (one of 8) and
+ * runs of rotations into one rotation, so each run is performed in a single
+ * pass. Operations that do nothing are left out. Folding flips and right
+ * angle rotations gives exactly the same image, folding other rotations only
+ * approximately, so that is not done when 'exact' is set.
+ *
+ * operations: NULL terminated array of validated operation strings in the
+ *     format of operation,arg,... (these are modified by this function).
+ * exact: Whether the result must be exactly what FreeImage would give.
+ *
+ * Returns: The plan. It must be released using free_plan().
+ */
+OpPlan plan_operations(char** operations, bool exact)
+{
+    OpPlan plan = {NULL, 0, 0};
+    while (operations[plan.requested]) {
+        plan.requested++;
+    }
+    plan.ops = malloc(sizeof(ImageOp) * (plan.requested + 1));
+
+    for (int i = 0; i < plan.requested; i++) {
+        char** args = split_by_char(operations[i], ',', 0);
+        add_operation(&plan, parse_operation(args), exact);
+        free(args);
+    }
+
+    // Remove orientations that leave the image as it is
+    int kept = 0;
+    for (int i = 0; i < plan.count; i++) {
+        Orientation orientation = plan.ops[i].orientation;
+        if (plan.ops[i].type != ORIENT_OP || orientation.turns
+                || orientation.flipped) {
+            plan.ops[kept++] = plan.ops[i];
+        }
+    }
+    plan.count = kept;
+
+    return plan;
+}
+
+/* rotated_size()
+ *
+ * This function estimates the size of an image after an arbitrary rotation
+ * (FreeImage enlarges the image to fit the rotated corners).
+ *
+ * degrees: Rotation in degrees.
+ * width: Width of the image, replaced by the rotated width.
+ * height: Height of the image, replaced by the rotated height.
+ */
+void rotated_size(int degrees, double* width, double* height)
+{
+    double radians = degrees * M_PI / (QUARTER_TURN * 2);
+    double cosine = fabs(cos(radians));
+    double sine = fabs(sin(radians));
+    double rotatedWidth = *width * cosine + *height * sine;
+
+    *height = *width * sine + *height * cosine;
+    *width = rotatedWidth;
+}
+
+/* flips_in_place()
+ *
+ * This function decides whether orient_in_place() can leave an orientation
+ * to FreeImage's in-place flips: only horizontal and vertical flips of images
+ * too small to split across 'tasks' are done that way.
+ *
+ * orientation: The orientation to apply.
+ * tasks: The TaskPool the work would be split across (may be NULL).
+ * pixels: Number of pixels in the image.
+ *
+ * Returns: True if the image is changed in place, false if it is copied.
+ */
+bool flips_in_place(Orientation orientation, TaskPool* tasks, double pixels)
+{
+    return orientation.flipped
+            && (orientation.turns == 0 || orientation.turns == 2)
+            && !taskpool_worth_splitting(tasks, (unsigned long)pixels);
+}
+
+/* operation_cost()
+ *
+ * This function estimates the work done by an operation as the number of
+ * pixels it reads and writes.
+ *
+ * op: A pointer to the ImageOp.
+ * tasks: The TaskPool the operation will be split across (may be NULL).
+ * width: Width of the image the operation is given, replaced by the width of
+ *     the image it produces.
+ * height: Height of the image the operation is given, replaced by the height
+ *     of the image it produces.
+ *
+ * Returns: The estimated number of pixels processed.
+ */
+double operation_cost(const ImageOp* op, TaskPool* tasks, double* width,
+        double* height)
+{
+    double pixels = *width * *height;
+
+    if (op->type == SCALE_OP) {
+        // One pass across the rows and one down the columns
+        double cost = pixels + op->width * *height + op->width * op->height;
+        *width = op->width;
+        *height = op->height;
+        return cost;
+    }
+    if (op->type == ROTATE_OP) {
+        rotated_size(op->degrees, width, height);
+        return ROTATE_PASSES * *width * *height;
+    }
+    if (op->orientation.turns % 2) {
+        double swap = *width;
+        *width = *height;
+        *height = swap;
+    }
+
+    // Small flips are done in place, other orientations copy to a new image
+    if (flips_in_place(op->orientation, tasks, pixels)) {
+        return pixels;
+    }
+
+    return 2 * pixels;
+}
+
+/* plan_cost()
+ *
+ * This function estimates the total work done by a list of operations.
+ *
+ * ops: Array of operations.
+ * count: Number of operations in 'ops'.
+ * tasks: The TaskPool the operations will be split across (may be NULL).
+ * width: Width of the image before the operations.
+ * height: Height of the image before the operations.
+ *
+ * Returns: The estimated number of pixels processed.
+ */
+double plan_cost(const ImageOp* ops, int count, TaskPool* tasks, double width,
+        double height)
+{
+    double cost = 0;
+
+    for (int i = 0; i < count; i++) {
+        cost += operation_cost(&ops[i], tasks, &width, &height);
+    }
+
+    return cost;
+}
+
+/* prescale_rotation()
+ *
+ * This function works out a downscale to do before a rotation that is
+ * followed by a (large) downscale, so that fewer pixels are rotated. The
+ * final scale is kept so the result has exactly the requested size.
+ *
+ * rotate: A pointer to the ROTATE_OP.
+ * scale: A pointer to the SCALE_OP that follows it.
+ * width: Width of the image given to the rotation.
+ * height: Height of the image given to the rotation.
+ * prescale: Used to return the SCALE_OP to insert before the rotation.
+ *
+ * Returns: True if a prescale is worthwhile, otherwise false.
+ */
+bool prescale_rotation(const ImageOp* rotate, const ImageOp* scale,
+        double width, double height, ImageOp* prescale)
+{
+    double rotatedWidth = width;
+    double rotatedHeight = height;
+    rotated_size(rotate->degrees, &rotatedWidth, &rotatedHeight);
+    double factor = fmax(scale->width / rotatedWidth,
+                            scale->height / rotatedHeight)
+            * prescaleMargin;
+    if (factor * prescaleMargin >= 1) {
+        return false;
+    }
+
+    memset(prescale, 0, sizeof(ImageOp));
+    prescale->type = SCALE_OP;
+    prescale->width = (int)fmax(1, round(width * factor));
+    prescale->height = (int)fmax(1, round(height * factor));
+
+    return true;
+}
+
+/* reorder_pair()
+ *
+ * This function rewrites operations i and i + 1 into an equivalent (within
+ * the rounding of bilinear scaling) sequence where possible:
+ * 1. A scale and an orientation are swapped (swapping the width and height of
+ *    the scale if the orientation turns the image on its side).
+ * 2. A scale that only enlarges the image followed by another scale is
+ *    dropped.
+ * 3. A rotation followed by a large downscale gets a prescale in front.
+ *
+ * ops: Array of operations (with room for one more).
+ * count: Number of operations in 'ops', updated if it changes.
+ * i: Index of the first operation of the pair.
+ * width: Width of the image given to operation i.
+ * height: Height of the image given to operation i.
+ *
+ * Returns: True if the operations were rewritten, otherwise false.
+ */
+bool reorder_pair(
+        ImageOp* ops, int* count, int i, double width, double height)
+{
+    ImageOp first = ops[i];
+    ImageOp second = ops[i + 1];
+    ImageOp prescale;
+
+    if ((first.type == ORIENT_OP && second.type == SCALE_OP)
+            || (first.type == SCALE_OP && second.type == ORIENT_OP)) {
+        ImageOp* scale = (first.type == SCALE_OP) ? &first : &second;
+        ImageOp* orient = (first.type == ORIENT_OP) ? &first : &second;
+        if (orient->orientation.turns % 2) {
+            int swap = scale->width;
+            scale->width = scale->height;
+            scale->height = swap;
+        }
+        ops[i] = second;
+        ops[i + 1] = first;
+    } else if (first.type == SCALE_OP && second.type == SCALE_OP
+            && first.width >= width && first.height >= height) {
+        memmove(&ops[i], &ops[i + 1], sizeof(ImageOp) * (*count - i - 1));
+        (*count)--;
+    } else if (first.type == ROTATE_OP && second.type == SCALE_OP
+            && prescale_rotation(&first, &second, width, height, &prescale)) {
+        memmove(&ops[i + 1], &ops[i], sizeof(ImageOp) * (*count - i));
+        ops[i] = prescale;
+        (*count)++;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+/* improve_plan()
+ *
+ * This function looks for a single rewrite of a pair of neighbouring
+ * operations (see reorder_pair()) that lowers the estimated work of the plan,
+ * and makes it.
+ *
+ * plan: A pointer to the OpPlan.
+ * tasks: The TaskPool the operations will be split across (may be NULL).
+ * width: Width of the image before the operations.
+ * height: Height of the image before the operations.
+ *
+ * Returns: True if the plan was changed, otherwise false.
+ */
+bool improve_plan(OpPlan* plan, TaskPool* tasks, double width, double height)
+{
+    double cost = plan_cost(plan->ops, plan->count, tasks, width, height);
+    ImageOp* candidate = malloc(sizeof(ImageOp) * (plan->count + 1));
+    double opWidth = width;
+    double opHeight = height;
+
+    for (int i = 0; i + 1 < plan->count; i++) {
+        int count = plan->count;
+        memcpy(candidate, plan->ops, sizeof(ImageOp) * count);
+        if (reorder_pair(candidate, &count, i, opWidth, opHeight)
+                && plan_cost(candidate, count, tasks, width, height)
+                        < cost) {
+            free(plan->ops);
+            plan->ops = candidate;
+            plan->count = count;
+            return true;
+        }
+        operation_cost(&plan->ops[i], tasks, &opWidth, &opHeight);
+    }
+    free(candidate);
+
+    return false;
+}
+
+/* optimise_plan()
+ *
+ * This function reorders the operations of a plan to reduce the number of
+ * pixels processed: downscales are moved earlier and upscales later where the
+ * result stays the same (within the rounding of bilinear scaling), and large
+ * downscales after a rotation are partly done before it. Every change must
+ * lower the estimated cost, so this always finishes.
+ *
+ * plan: A pointer to the OpPlan (from plan_operations()).
+ * tasks: The TaskPool the plan's operations will be split across (may be
+ *     NULL).
+ * width: Width of the image the plan will be applied to.
+ * height: Height of the image the plan will be applied to.
+ */
+void optimise_plan(
+        OpPlan* plan, TaskPool* tasks, unsigned width, unsigned height)
+{
+    while (improve_plan(plan, tasks, width, height)) {
+    }
+}
+
+/* free_plan()
+ *
+ * This function frees the memory held by an OpPlan.
+ *
+ * plan: A pointer to the OpPlan to be freed.
+ */
+void free_plan(OpPlan* plan)
+{
+    free(plan->ops);
+    plan->ops = NULL;
+    plan->count = 0;
+}
+
+/* describe_plan()
+ *
+ * This function describes a plan in a canonical form, so that operation
+ * chains with the same effect (e.g. "flip,h/flip,h" and "rotate,0") are
+ * described the same way.
+ *
+ * plan: A pointer to the OpPlan.
+ *
+ * Returns: A newly allocated string describing the plan.
+ */
+char* describe_plan(const OpPlan* plan)
+{
+    char* description;
+    size_t length;
+    FILE* out = open_memstream(&description, &length);
+
+    for (int i = 0; i < plan->count; i++) {
+        const ImageOp* op = &plan->ops[i];
+        if (op->type == ORIENT_OP) {
+            fprintf(out, "/o%d%s", op->orientation.turns,
+                    op->orientation.flipped ? "f" : "");
+        } else if (op->type == ROTATE_OP) {
+            fprintf(out, "/r%d", op->degrees);
+        } else {
+            fprintf(out, "/s%dx%d", op->width, op->height);
+        }
+    }
+    fclose(out);
+
+    return description;
+}
+
+/* operation_name()
+ *
+ * This function gives the name of the requested operation an ImageOp
+ * performs (used when reporting that it failed).
+ *
+ * op: A pointer to the ImageOp.
+ *
+ * Returns: One of "rotate", "flip" or "scale".
+ */
+const char* operation_name(const ImageOp* op)
+{
+    if (op->type == SCALE_OP) {
+        return "scale";
+    }
+    if (op->type == ORIENT_OP && op->orientation.flipped
+            && op->orientation.turns % 2 == 0) {
+        return "flip";
+    }
+
+    return "rotate";
+}
+
+/* orient_in_place()
+ *
+ * This function applies an orientation to an image. Horizontal and vertical
+ * flips of images too small to split across 'tasks' are done in place by
+ * FreeImage, everything else is done by orient_image().
+ *
+ * imageMap: The image to be reoriented.
+ * orientation: The orientation to apply.
+ * tasks: The TaskPool to split the work across (may be NULL).
+ * cancel: A pointer to the CancelToken of the work (may be NULL).
+ *
+ * Returns: The reoriented image (which is 'imageMap' if it was changed in
+ *     place), or NULL if reorienting failed.
+ */
+FIBITMAP* orient_in_place(FIBITMAP* imageMap, Orientation orientation,
+        TaskPool* tasks, const CancelToken* cancel)
+{
+    double pixels = (double)FreeImage_GetWidth(imageMap)
+            * FreeImage_GetHeight(imageMap);
+
+    if (flips_in_place(orientation, tasks, pixels)) {
+        if (orientation.turns == 0) {
+            return FreeImage_FlipHorizontal(imageMap) ? imageMap : NULL;
+        }
+        return FreeImage_FlipVertical(imageMap) ? imageMap : NULL;
+    }
+
+    return orient_image(imageMap, orientation, tasks, cancel);
+}
+
+/* apply_operation()
+ *
+ * This function performs a single planned operation on an image. The given
+ * image is always used up: it is either returned (if it was changed in place)
+ * or unloaded. Reorientations and scales stop early (leaving the result
+ * incomplete) if the work is cancelled; arbitrary rotations, and scales that
+ * must be exact, are done by FreeImage in one go.
+ *
+ * imageMap: The image to operate on.
+ * op: A pointer to the ImageOp to perform.
+ * exact: Whether the result must be exactly what FreeImage gives (rather than
+ *     within 1 per channel, see rescale_image()).
+ * tasks: The TaskPool that large reorientations and scales are split across
+ *     (may be NULL).
+ * cancel: A pointer to the CancelToken of the work (may be NULL).
+ *
+ * Returns: The resulting image, or NULL if the operation failed.
+ */
+FIBITMAP* apply_operation(FIBITMAP* imageMap, const ImageOp* op, bool exact,
+        TaskPool* tasks, const CancelToken* cancel)
+{
+    FIBITMAP* result;
+
+    if (op->type == ORIENT_OP) {
+        result = orient_in_place(imageMap, op->orientation, tasks, cancel);
+    } else if (op->type == ROTATE_OP) {
+        result = FreeImage_Rotate(imageMap, op->degrees, NULL);
+    } else if (exact) {
+        result = FreeImage_Rescale(
+                imageMap, op->width, op->height, FILTER_BILINEAR);
+    } else {
+        result = rescale_image(
+                imageMap, op->width, op->height, tasks, cancel);
+    }
+
+    if (result != imageMap) {
+        FreeImage_Unload(imageMap);
+    }
+
+    return result;
+}
@@ -0,0 +1,60 @@
+#ifndef IMAGEOPS_H
+#define IMAGEOPS_H
+
+#include <stdbool.h>
+#include <FreeImage.h>
+#include "taskpool.h"
+
+/* One of the 8 ways an image can be oriented using flips and right angle
+ * rotations: an optional horizontal flip followed by a number of
+ * counter-clockwise quarter turns.
+ */
+typedef struct {
+    int turns;
+    bool flipped;
+} Orientation;
+
+// Types of planned image operation
+typedef enum {
+    ORIENT_OP = 0,
+    ROTATE_OP = 1,
+    SCALE_OP = 2
+} ImageOpType;
+
+/* A single image operation of an OpPlan. Only the members for its type are
+ * used.
+ */
+typedef struct {
+    ImageOpType type;
+    Orientation orientation;
+    int degrees;
+    int width;
+    int height;
+} ImageOp;
+
+/* The operations to perform for a request. Runs of requested operations that
+ * can be combined have been folded into a single operation each.
+ */
+typedef struct {
+    ImageOp* ops;
+    int count;
+    int requested;
+} OpPlan;
+
+// Function Prototypes
+int right_angle_turns(int degrees);
+Orientation compose_orientation(Orientation first, Orientation then);
+void orient_rows(FIBITMAP* src, FIBITMAP* dst, Orientation orientation,
+        unsigned firstRow, unsigned lastRow);
+FIBITMAP* orient_image(FIBITMAP* imageMap, Orientation orientation,
+        TaskPool* tasks, const CancelToken* cancel);
+OpPlan plan_operations(char** operations, bool exact);
+void optimise_plan(
+        OpPlan* plan, TaskPool* tasks, unsigned width, unsigned height);
+void free_plan(OpPlan* plan);
+char* describe_plan(const OpPlan* plan);
+const char* operation_name(const ImageOp* op);
+FIBITMAP* apply_operation(FIBITMAP* imageMap, const ImageOp* op, bool exact,
+        TaskPool* tasks, const CancelToken* cancel);
+
+#endif
@@ -0,0 +1,160 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+#include "metrics.h"
+
+// Quantiles reported for every histogram
+const double reportedQuantiles[] = {0.5, 0.9, 0.99, 0.999};
+const int quantileCount = 4;
+
+/* now_usec()
+ *
+ * This function reads the monotonic clock.
+ *
+ * Returns: The current monotonic time in microseconds.
+ */
+unsigned long now_usec(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (unsigned long)now.tv_sec * 1000000UL + now.tv_nsec / 1000;
+}
+
+/* histogram_create()
+ *
+ * This function creates an empty histogram.
+ *
+ * Returns: A pointer to a newly allocated Histogram with all buckets zero.
+ */
+Histogram* histogram_create(void)
+{
+    return calloc(1, sizeof(Histogram));
+}
+
+/* bucket_index()
+ *
+ * This function finds the bucket that 'value' belongs to. The top
+ * SUB_BUCKET_BITS + 1 significant bits of the value select the bucket.
+ *
+ * value: The value to be placed.
+ *
+ * Returns: Index of the bucket for 'value'.
+ */
+int bucket_index(unsigned long value)
+{
+    if (value < SUB_BUCKETS) {
+        return (int)value;
+    }
+
+    int magnitude = 63 - __builtin_clzl(value);
+    int shift = magnitude - SUB_BUCKET_BITS;
+    int subBucket = (int)((value >> shift) & (SUB_BUCKETS - 1));
+
+    return (shift + 1) * SUB_BUCKETS + subBucket;
+}
+
+/* bucket_upper_bound()
+ *
+ * This function finds the largest value that falls within a bucket.
+ *
+ * index: Index of the bucket.
+ *
+ * Returns: The largest value stored in the bucket.
+ */
+unsigned long bucket_upper_bound(int index)
+{
+    if (index < SUB_BUCKETS) {
+        return (unsigned long)index;
+    }
+
+    int shift = index / SUB_BUCKETS - 1;
+    unsigned long subBucket = index % SUB_BUCKETS;
+
+    return ((SUB_BUCKETS + subBucket + 1) << shift) - 1;
+}
+
+/* histogram_record()
+ *
+ * This function records a single value. It is safe to call from any number of
+ * threads at once and never blocks.
+ *
+ * histogram: A pointer to an instance of the Histogram struct.
+ * value: The value to be recorded.
+ */
+void histogram_record(Histogram* histogram, unsigned long value)
+{
+    __atomic_fetch_add(
+            &histogram->buckets[bucket_index(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->sum, value, __ATOMIC_RELAXED);
+
+    unsigned long max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    while (value > max
+            && !__atomic_compare_exchange_n(&histogram->max, &max, value,
+                    true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/* histogram_quantile()
+ *
+ * This function estimates a quantile of the recorded values.
+ *
+ * histogram: A pointer to an instance of the Histogram struct.
+ * quantile: The quantile to find, between 0 and 1 (e.g. 0.99).
+ *
+ * Returns: The upper bound of the bucket containing the quantile, capped at
+ *     the largest recorded value (0 if no values have been recorded).
+ */
+unsigned long histogram_quantile(Histogram* histogram, double quantile)
+{
+    unsigned long counts[HISTOGRAM_BUCKETS];
+    unsigned long total = 0;
+
+    // Copy the buckets first so the total matches the counts searched
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        counts[i] = __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+        total += counts[i];
+    }
+
+    unsigned long rank = (unsigned long)(quantile * total + 0.5);
+    unsigned long seen = 0;
+    for (int i = 0; total && i < HISTOGRAM_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= rank && counts[i]) {
+            unsigned long max =
+                    __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+            unsigned long bound = bucket_upper_bound(i);
+            return bound < max ? bound : max;
+        }
+    }
+
+    return 0;
+}
+
+/* histogram_print()
+ *
+ * This function prints a histogram's quantiles, count, sum and maximum in the
+ * Prometheus text exposition format.
+ *
+ * histogram: A pointer to an instance of the Histogram struct.
+ * out: Stream to print to.
+ * name: Metric name.
+ * label: Label set (without braces) identifying this histogram, e.g.
+ *     stage="decode".
+ */
+void histogram_print(Histogram* histogram, FILE* out, const char* name,
+        const char* label)
+{
+    for (int i = 0; i < quantileCount; i++) {
+        fprintf(out, "%s{%s,quantile=\"%g\"} %lu\n", name, label,
+                reportedQuantiles[i],
+                histogram_quantile(histogram, reportedQuantiles[i]));
+    }
+    fprintf(out, "%s_count{%s} %lu\n", name, label,
+            __atomic_load_n(&histogram->count, __ATOMIC_RELAXED));
+    fprintf(out, "%s_sum{%s} %lu\n", name, label,
+            __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED));
+    fprintf(out, "%s_max{%s} %lu\n", name, label,
+            __atomic_load_n(&histogram->max, __ATOMIC_RELAXED));
+}
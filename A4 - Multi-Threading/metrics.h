@@ -0,0 +1,31 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+
+// Histogram layout: values below 2^SUB_BUCKET_BITS get a bucket each, every
+// larger power of two range is split into 2^SUB_BUCKET_BITS linear buckets
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS (SUB_BUCKETS * (64 - SUB_BUCKET_BITS + 1))
+
+/* A log-linear (HDR style) histogram of non-negative values. Every bucket is
+ * at most 1/SUB_BUCKETS of its value wide, so quantiles are accurate to about
+ * 6% at any magnitude. Values are recorded with atomic operations only.
+ */
+typedef struct {
+    unsigned long buckets[HISTOGRAM_BUCKETS];
+    unsigned long count;
+    unsigned long sum;
+    unsigned long max;
+} Histogram;
+
+// Function Prototypes
+unsigned long now_usec(void);
+Histogram* histogram_create(void);
+void histogram_record(Histogram* histogram, unsigned long value);
+unsigned long histogram_quantile(Histogram* histogram, double quantile);
+void histogram_print(Histogram* histogram, FILE* out, const char* name,
+        const char* label);
+
+#endif
@@ -0,0 +1,125 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include "priorityqueue.h"
+
+/* priorityqueue_create()
+ *
+ * This function creates an empty PriorityQueue that can hold at most
+ * 'capacity' items at a time.
+ *
+ * capacity: Maximum number of items held by the queue (must be > 0).
+ *
+ * Returns: A pointer to a newly allocated PriorityQueue.
+ */
+PriorityQueue* priorityqueue_create(unsigned int capacity)
+{
+    PriorityQueue* queue = malloc(sizeof(PriorityQueue));
+    queue->items = malloc(sizeof(PriorityItem) * capacity);
+    queue->capacity = capacity;
+    queue->count = 0;
+    queue->nextSeq = 0;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->notEmpty, NULL);
+    pthread_cond_init(&queue->notFull, NULL);
+
+    return queue;
+}
+
+/* comes_before()
+ *
+ * Returns: True if item 'a' is to be taken off the queue before item 'b'.
+ */
+bool comes_before(const PriorityItem* a, const PriorityItem* b)
+{
+    return a->priority < b->priority
+            || (a->priority == b->priority && a->seq < b->seq);
+}
+
+/* priorityqueue_push()
+ *
+ * This function adds 'item' to the queue. If the queue is full the calling
+ * thread blocks until a consumer makes room.
+ *
+ * queue: A pointer to an instance of the PriorityQueue struct.
+ * item: The item to be added.
+ * priority: The item's priority (lower values are taken first).
+ */
+void priorityqueue_push(
+        PriorityQueue* queue, void* item, unsigned long priority)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->capacity) {
+        pthread_cond_wait(&queue->notFull, &queue->lock);
+    }
+
+    // Move the new item up from the bottom of the heap to its place
+    PriorityItem added = {priority, queue->nextSeq++, item};
+    unsigned int i = queue->count++;
+    while (i && comes_before(&added, &queue->items[(i - 1) / 2])) {
+        queue->items[i] = queue->items[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    queue->items[i] = added;
+
+    pthread_cond_signal(&queue->notEmpty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/* priorityqueue_pop()
+ *
+ * This function removes the item that comes first from the queue. If the
+ * queue is empty the calling thread blocks until a producer adds an item.
+ *
+ * queue: A pointer to an instance of the PriorityQueue struct.
+ *
+ * Returns: The item with the lowest priority value.
+ */
+void* priorityqueue_pop(PriorityQueue* queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0) {
+        pthread_cond_wait(&queue->notEmpty, &queue->lock);
+    }
+
+    void* item = queue->items[0].item;
+
+    // Move the last item down from the top of the heap to its place
+    PriorityItem last = queue->items[--queue->count];
+    unsigned int i = 0;
+    while (2 * i + 1 < queue->count) {
+        unsigned int child = 2 * i + 1;
+        if (child + 1 < queue->count
+                && comes_before(&queue->items[child + 1],
+                        &queue->items[child])) {
+            child++;
+        }
+        if (!comes_before(&queue->items[child], &last)) {
+            break;
+        }
+        queue->items[i] = queue->items[child];
+        i = child;
+    }
+    queue->items[i] = last;
+
+    pthread_cond_signal(&queue->notFull);
+    pthread_mutex_unlock(&queue->lock);
+
+    return item;
+}
+
+/* priorityqueue_depth()
+ *
+ * This function returns the number of items currently waiting in the queue.
+ *
+ * queue: A pointer to an instance of the PriorityQueue struct.
+ *
+ * Returns: Number of queued items.
+ */
+unsigned int priorityqueue_depth(PriorityQueue* queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    unsigned int depth = queue->count;
+    pthread_mutex_unlock(&queue->lock);
+
+    return depth;
+}
@@ -0,0 +1,36 @@
+#ifndef PRIORITYQUEUE_H
+#define PRIORITYQUEUE_H
+
+#include <pthread.h>
+
+/* An item waiting in a PriorityQueue along with its priority */
+typedef struct {
+    unsigned long priority;
+    unsigned long seq;
+    void* item;
+} PriorityItem;
+
+/* A bounded, blocking, multi-producer multi-consumer priority queue of
+ * pointers, kept as a binary min-heap. The item with the lowest priority value
+ * is taken first, and items of equal priority in the order they were added.
+ * Producers block while the queue is full and consumers block while it is
+ * empty.
+ */
+typedef struct {
+    PriorityItem* items;
+    unsigned int capacity;
+    unsigned int count;
+    unsigned long nextSeq;
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+} PriorityQueue;
+
+// Function Prototypes
+PriorityQueue* priorityqueue_create(unsigned int capacity);
+void priorityqueue_push(
+        PriorityQueue* queue, void* item, unsigned long priority);
+void* priorityqueue_pop(PriorityQueue* queue);
+unsigned int priorityqueue_depth(PriorityQueue* queue);
+
+#endif
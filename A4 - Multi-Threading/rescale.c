@@ -0,0 +1,1016 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RESCALE_X86
+#endif
+#include "rescale.h"
+
+/* One pass of a rescale being split into bands of rows */
+typedef struct {
+    const Plane* src;
+    const Plane* dst;
+    const WeightTable* table;
+} RescaleJob;
+
+// Fixed point format of the weights
+typedef enum {
+    WEIGHT_BITS = 15,
+    WEIGHT_ONE = 1 << 15,
+    WEIGHT_MAX = INT16_MAX
+} WeightValues;
+
+// Fixed point format of the intermediate image between the two passes
+typedef enum {
+    MIDDLE_BITS = 7,
+    WIDEN_SHIFT = WEIGHT_BITS - MIDDLE_BITS,
+    NARROW_SHIFT = WEIGHT_BITS + MIDDLE_BITS,
+    WIDEN_ROUNDING = 1 << (WIDEN_SHIFT - 1),
+    NARROW_ROUNDING = 1 << (NARROW_SHIFT - 1)
+} MiddleValues;
+
+// Most taps a weight table may have for the result to stay within 1 of
+// FreeImage (see rescale_image())
+#define MAX_TAPS 24
+
+/* Scales one row of 'bytes' channels per pixel horizontally using 'table',
+ * from 8 bit channels to intermediate ones or (if 'fromWide') back
+ */
+typedef void (*RowScaler)(const BYTE* src, BYTE* dst, const WeightTable* table,
+        unsigned bytes, bool fromWide);
+
+/* Combines 'taps' rows of 'length' channels into one using 'weights', from 8
+ * bit channels to intermediate ones or (if 'fromWide') back
+ */
+typedef void (*ColumnScaler)(const BYTE* const* rows, const int16_t* weights,
+        unsigned taps, BYTE* dst, unsigned length, bool fromWide);
+
+/* A set of rescaling kernels for one instruction set */
+typedef struct {
+    const char* name;
+    const char* cpuFeature;
+    RowScaler scaleRow;
+    ColumnScaler scaleColumn;
+} RescaleKernels;
+
+/* freeimage_weights()
+ *
+ * This function calculates the bilinear weights FreeImage uses for one output
+ * pixel (see CWeightsTable in FreeImage's Resize.cpp): a tent filter that is
+ * widened when downscaling, normalised to add up to 1, with zero weights at
+ * the right dropped.
+ *
+ * u: The output pixel.
+ * scale: Output size divided by source size.
+ * srcSize: Number of source pixels.
+ * weights: Used to return the weights (room for 2 * ceil(1 / scale) + 3).
+ * left: Used to return the first source pixel used.
+ *
+ * Returns: The number of source pixels used.
+ */
+int freeimage_weights(
+        unsigned u, double scale, unsigned srcSize, double* weights, int* left)
+{
+    double width = (scale < 1) ? 1 / scale : 1;
+    double filterScale = (scale < 1) ? scale : 1;
+    double center = u / scale + 0.5 / scale;
+    int first = (int)(center - width + 0.5);
+    int last = (int)(center + width + 0.5);
+    first = (first < 0) ? 0 : first;
+    last = (last > (int)srcSize) ? (int)srcSize : last;
+
+    double total = 0;
+    for (int i = first; i < last; i++) {
+        double distance = fabs(filterScale * (i + 0.5 - center));
+        weights[i - first] = filterScale * ((distance < 1) ? 1 - distance : 0);
+        total += weights[i - first];
+    }
+
+    int count = last - first;
+    for (int i = 0; total > 0 && total != 1 && i < count; i++) {
+        weights[i] /= total;
+    }
+    while (count > 1 && weights[count - 1] == 0) {
+        count--;
+    }
+
+    *left = first;
+    return count;
+}
+
+/* quantise_weights()
+ *
+ * This function converts weights to fixed point, making sure they still add
+ * up to 1 so that flat areas keep their exact colour. A single weight of 1
+ * doesn't fit in 16 bits and becomes WEIGHT_MAX, which still reproduces every
+ * channel value exactly after rounding.
+ *
+ * weights: The weights to be converted.
+ * count: Number of weights.
+ * fixed: Used to return the fixed point weights.
+ */
+void quantise_weights(const double* weights, int count, int16_t* fixed)
+{
+    int total = 0;
+    int largest = 0;
+    int values[count];
+
+    for (int i = 0; i < count; i++) {
+        values[i] = (int)lround(weights[i] * WEIGHT_ONE);
+        total += values[i];
+        if (values[i] > values[largest]) {
+            largest = i;
+        }
+    }
+    values[largest] += WEIGHT_ONE - total;
+
+    for (int i = 0; i < count; i++) {
+        fixed[i] = (values[i] > WEIGHT_MAX) ? WEIGHT_MAX : values[i];
+    }
+}
+
+/* create_weight_table()
+ *
+ * This function precomputes the weights for scaling one dimension of an image
+ * from 'srcSize' to 'dstSize' pixels. Every output pixel is given the same
+ * number of taps (the most any pixel needs, rounded up to an even number
+ * where the source allows so the SIMD kernels can work on pairs of taps) so
+ * that the kernels have no per-pixel bounds to check; the extra taps have a
+ * weight of 0.
+ *
+ * dstSize: Number of output pixels.
+ * srcSize: Number of source pixels.
+ *
+ * Returns: A newly allocated WeightTable (freed with free_weight_table()).
+ */
+WeightTable* create_weight_table(unsigned dstSize, unsigned srcSize)
+{
+    double scale = (double)dstSize / srcSize;
+    int window = 2 * (int)ceil((scale < 1) ? 1 / scale : 1) + 3;
+    double* weights = malloc(sizeof(double) * window * dstSize);
+    int* lefts = malloc(sizeof(int) * dstSize);
+    int* counts = malloc(sizeof(int) * dstSize);
+
+    WeightTable* table = malloc(sizeof(WeightTable));
+    table->length = dstSize;
+    table->srcSize = srcSize;
+    table->taps = 1;
+    for (unsigned u = 0; u < dstSize; u++) {
+        counts[u] = freeimage_weights(
+                u, scale, srcSize, weights + u * window, &lefts[u]);
+        if ((unsigned)counts[u] > table->taps) {
+            table->taps = counts[u];
+        }
+    }
+    if (table->taps % 2 && table->taps < srcSize) {
+        table->taps++;
+    }
+
+    table->left = malloc(sizeof(unsigned) * dstSize);
+    table->weights = calloc(dstSize * table->taps, sizeof(int16_t));
+    for (unsigned u = 0; u < dstSize; u++) {
+        // Start early enough that the padding taps stay within the source
+        int left = lefts[u];
+        if (left + table->taps > srcSize) {
+            left = srcSize - table->taps;
+        }
+        table->left[u] = left;
+        quantise_weights(weights + u * window, counts[u],
+                table->weights + u * table->taps + (lefts[u] - left));
+    }
+
+    free(weights);
+    free(lefts);
+    free(counts);
+    return table;
+}
+
+/* free_weight_table()
+ *
+ * This function frees the memory held by a WeightTable.
+ *
+ * table: A pointer to the WeightTable to be freed (may be NULL).
+ */
+void free_weight_table(WeightTable* table)
+{
+    if (table) {
+        free(table->left);
+        free(table->weights);
+        free(table);
+    }
+}
+
+/* pass_rounding()
+ *
+ * fromWide: True for the pass from the intermediate image to 8 bit channels,
+ *     false for the pass from 8 bit channels to the intermediate image.
+ *
+ * Returns: The rounding to add to a fixed point weighted sum in the pass.
+ */
+int pass_rounding(bool fromWide)
+{
+    return fromWide ? NARROW_ROUNDING : WIDEN_ROUNDING;
+}
+
+/* load_channel()
+ *
+ * This function reads channel value 'i' of a row.
+ *
+ * row: The row.
+ * i: Index of the channel value within the row.
+ * wide: True if the row holds intermediate (16 bit) channels.
+ *
+ * Returns: The channel value.
+ */
+int load_channel(const BYTE* row, unsigned i, bool wide)
+{
+    return wide ? ((const int16_t*)row)[i] : row[i];
+}
+
+/* store_channel()
+ *
+ * This function rounds a fixed point weighted sum and stores it as channel
+ * value 'i' of a row.
+ *
+ * sum: The weighted sum (already including the pass_rounding()).
+ * row: The row.
+ * i: Index of the channel value within the row.
+ * fromWide: True if the sum is of intermediate channels (so an 8 bit channel
+ *     is stored), false if it is of 8 bit channels (so an intermediate one is
+ *     stored).
+ */
+void store_channel(int sum, BYTE* row, unsigned i, bool fromWide)
+{
+    if (fromWide) {
+        sum >>= NARROW_SHIFT;
+        row[i] = (sum < 0) ? 0 : (sum > 0xFF) ? 0xFF : sum;
+    } else {
+        ((int16_t*)row)[i] = sum >> WIDEN_SHIFT;
+    }
+}
+
+/* scale_row_scalar()
+ *
+ * This is the portable horizontal kernel.
+ *
+ * src: The source row.
+ * dst: The output row.
+ * table: Weights for the row.
+ * bytes: Channels per pixel (3 or 4).
+ * fromWide: True if 'src' is a row of the intermediate image, false if 'dst'
+ *     is.
+ */
+void scale_row_scalar(const BYTE* src, BYTE* dst, const WeightTable* table,
+        unsigned bytes, bool fromWide)
+{
+    int rounding = pass_rounding(fromWide);
+
+    for (unsigned x = 0; x < table->length; x++) {
+        unsigned first = table->left[x] * bytes;
+        const int16_t* weights = table->weights + x * table->taps;
+        int sums[4] = {rounding, rounding, rounding, rounding};
+
+        for (unsigned i = 0; i < table->taps; i++) {
+            for (unsigned c = 0; c < bytes; c++) {
+                sums[c] += weights[i]
+                        * load_channel(src, first + i * bytes + c, fromWide);
+            }
+        }
+        for (unsigned c = 0; c < bytes; c++) {
+            store_channel(sums[c], dst, x * bytes + c, fromWide);
+        }
+    }
+}
+
+/* scale_column_scalar()
+ *
+ * This is the portable vertical kernel.
+ *
+ * rows: The 'taps' source rows.
+ * weights: Weight of each source row.
+ * taps: Number of source rows.
+ * dst: The output row.
+ * length: Number of channel values in each row.
+ * fromWide: True if 'rows' are rows of the intermediate image, false if 'dst'
+ *     is.
+ */
+void scale_column_scalar(const BYTE* const* rows, const int16_t* weights,
+        unsigned taps, BYTE* dst, unsigned length, bool fromWide)
+{
+    for (unsigned i = 0; i < length; i++) {
+        int sum = pass_rounding(fromWide);
+        for (unsigned t = 0; t < taps; t++) {
+            sum += weights[t] * load_channel(rows[t], i, fromWide);
+        }
+        store_channel(sum, dst, i, fromWide);
+    }
+}
+
+#ifdef RESCALE_X86
+/* load_pixel()
+ *
+ * This function loads one pixel into the low 64 bits of a vector, without
+ * reading past the end of the pixel.
+ *
+ * pixel: The pixel to load.
+ * size: Size of the pixel in bytes (at most 8).
+ *
+ * Returns: The pixel's channels as the low bytes of a vector.
+ */
+__attribute__((target("sse2"))) __m128i load_pixel(
+        const BYTE* pixel, unsigned size)
+{
+    uint64_t value = 0;
+    memcpy(&value, pixel, size);
+
+    return _mm_loadl_epi64((const __m128i*)&value);
+}
+
+/* load_tap_pair()
+ *
+ * This function loads two neighbouring source pixels with their channels
+ * interleaved as 16 bit values (first pixel's channel 0, second pixel's
+ * channel 0, first pixel's channel 1, ...), ready for multiplying by a pair
+ * of weights with _mm_madd_epi16().
+ *
+ * pixel: The first pixel.
+ * bytes: Channels per pixel.
+ * second: False if there is no second pixel (it is then taken as 0).
+ * wide: True if three pixels can be read from 'pixel', which allows both
+ *     pixels to be loaded at once.
+ * fromWide: True if the pixels have intermediate (16 bit) channels.
+ *
+ * Returns: The interleaved channels.
+ */
+__attribute__((target("sse2"))) __m128i load_tap_pair(const BYTE* pixel,
+        unsigned bytes, bool second, bool wide, bool fromWide)
+{
+    unsigned size = fromWide ? 2 * bytes : bytes;
+    __m128i first;
+    __m128i next;
+
+    if (wide && fromWide) {
+        first = _mm_loadu_si128((const __m128i*)pixel);
+        next = (bytes == 4) ? _mm_srli_si128(first, 8)
+                : _mm_srli_si128(first, 6);
+    } else if (wide) {
+        first = _mm_loadl_epi64((const __m128i*)pixel);
+        next = _mm_srl_epi64(first, _mm_cvtsi32_si128(8 * bytes));
+    } else {
+        first = load_pixel(pixel, size);
+        next = second ? load_pixel(pixel + size, size) : _mm_setzero_si128();
+    }
+
+    if (fromWide) {
+        return _mm_unpacklo_epi16(first, next);
+    }
+    return _mm_unpacklo_epi8(
+            _mm_unpacklo_epi8(first, next), _mm_setzero_si128());
+}
+
+/* tap_weights()
+ *
+ * This function loads the weights of taps 'tap' and 'tap + 1' into every
+ * 32 bit lane, ready for _mm_madd_epi16().
+ *
+ * weights: The weights of all taps.
+ * tap: The first tap of the pair.
+ * taps: Number of taps (the second weight is 0 if it is past the end).
+ *
+ * Returns: The packed weights.
+ */
+__attribute__((target("sse2"))) __m128i tap_weights(
+        const int16_t* weights, unsigned tap, unsigned taps)
+{
+    uint32_t pair = (uint16_t)weights[tap];
+
+    if (tap + 1 < taps) {
+        memcpy(&pair, weights + tap, sizeof(pair));
+    }
+
+    return _mm_set1_epi32((int)pair);
+}
+
+/* store_pixel()
+ *
+ * This function rounds the fixed point channel sums in the 32 bit lanes of
+ * 'sum' and stores them as a pixel.
+ *
+ * sum: The weighted sums (already including the pass_rounding()).
+ * dst: Where to store the pixel.
+ * bytes: Channels per pixel.
+ * fromWide: True if the sums are of intermediate channels (so 8 bit channels
+ *     are stored), false if they are of 8 bit channels.
+ */
+__attribute__((target("sse2"))) void store_pixel(
+        __m128i sum, BYTE* dst, unsigned bytes, bool fromWide)
+{
+    const __m128i zero = _mm_setzero_si128();
+    uint64_t value;
+
+    if (fromWide) {
+        sum = _mm_srai_epi32(sum, NARROW_SHIFT);
+        sum = _mm_packus_epi16(_mm_packs_epi32(sum, zero), zero);
+    } else {
+        sum = _mm_packs_epi32(_mm_srai_epi32(sum, WIDEN_SHIFT), zero);
+        bytes *= 2;
+    }
+    _mm_storel_epi64((__m128i*)&value, sum);
+    memcpy(dst, &value, bytes);
+}
+
+/* wide_loads()
+ *
+ * This function checks whether every tap pair of an output pixel can be
+ * loaded with a single read of three pixels without going past the end of
+ * the row.
+ *
+ * table: Weights for the row.
+ * x: The output pixel.
+ *
+ * Returns: True if wide loads can be used, otherwise false.
+ */
+bool wide_loads(const WeightTable* table, unsigned x)
+{
+    return table->left[x] + table->taps + 2 <= table->srcSize;
+}
+
+/* scale_row_sse2()
+ *
+ * This is the SSE2 horizontal kernel. Each _mm_madd_epi16() applies the
+ * weights of two neighbouring taps to every channel at once.
+ *
+ * src: The source row.
+ * dst: The output row.
+ * table: Weights for the row.
+ * bytes: Channels per pixel (3 or 4).
+ * fromWide: True if 'src' is a row of the intermediate image, false if 'dst'
+ *     is.
+ */
+__attribute__((target("sse2"))) void scale_row_sse2(const BYTE* src,
+        BYTE* dst, const WeightTable* table, unsigned bytes, bool fromWide)
+{
+    unsigned taps = table->taps;
+    unsigned srcSize = fromWide ? 2 * bytes : bytes;
+    unsigned dstSize = fromWide ? bytes : 2 * bytes;
+
+    for (unsigned x = 0; x < table->length; x++) {
+        const BYTE* pixel = src + table->left[x] * srcSize;
+        const int16_t* weights = table->weights + x * taps;
+        bool wide = wide_loads(table, x);
+        __m128i sum = _mm_set1_epi32(pass_rounding(fromWide));
+
+        for (unsigned i = 0; i < taps; i += 2) {
+            sum = _mm_add_epi32(sum,
+                    _mm_madd_epi16(load_tap_pair(pixel, bytes, i + 1 < taps,
+                                           wide, fromWide),
+                            tap_weights(weights, i, taps)));
+            pixel += 2 * srcSize;
+        }
+        store_pixel(sum, dst, bytes, fromWide);
+        dst += dstSize;
+    }
+}
+
+/* load_channels_sse2()
+ *
+ * This function loads 8 channel values of a row as 16 bit values.
+ *
+ * row: The row.
+ * i: Index of the first channel value.
+ * wide: True if the row holds intermediate (16 bit) channels.
+ *
+ * Returns: The channel values.
+ */
+__attribute__((target("sse2"))) __m128i load_channels_sse2(
+        const BYTE* row, unsigned i, bool wide)
+{
+    if (wide) {
+        return _mm_loadu_si128((const __m128i*)((const int16_t*)row + i));
+    }
+
+    return _mm_unpacklo_epi8(
+            _mm_loadl_epi64((const __m128i*)(row + i)), _mm_setzero_si128());
+}
+
+/* scale_column_sse2()
+ *
+ * This is the SSE2 vertical kernel. It produces 8 channel values per
+ * iteration, combining two source rows per _mm_madd_epi16().
+ *
+ * rows: The 'taps' source rows.
+ * weights: Weight of each source row.
+ * taps: Number of source rows.
+ * dst: The output row.
+ * length: Number of channel values in each row.
+ * fromWide: True if 'rows' are rows of the intermediate image, false if 'dst'
+ *     is.
+ */
+__attribute__((target("sse2"))) void scale_column_sse2(
+        const BYTE* const* rows, const int16_t* weights, unsigned taps,
+        BYTE* dst, unsigned length, bool fromWide)
+{
+    const __m128i zero = _mm_setzero_si128();
+    unsigned i = 0;
+
+    for (; i + 8 <= length; i += 8) {
+        __m128i low = _mm_set1_epi32(pass_rounding(fromWide));
+        __m128i high = low;
+        for (unsigned t = 0; t < taps; t += 2) {
+            __m128i weight = tap_weights(weights, t, taps);
+            __m128i a = load_channels_sse2(rows[t], i, fromWide);
+            __m128i b = (t + 1 < taps)
+                    ? load_channels_sse2(rows[t + 1], i, fromWide)
+                    : zero;
+            low = _mm_add_epi32(
+                    low, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), weight));
+            high = _mm_add_epi32(
+                    high, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), weight));
+        }
+        if (fromWide) {
+            __m128i values = _mm_packs_epi32(
+                    _mm_srai_epi32(low, NARROW_SHIFT),
+                    _mm_srai_epi32(high, NARROW_SHIFT));
+            _mm_storel_epi64((__m128i*)(dst + i),
+                    _mm_packus_epi16(values, values));
+        } else {
+            _mm_storeu_si128((__m128i*)((int16_t*)dst + i),
+                    _mm_packs_epi32(_mm_srai_epi32(low, WIDEN_SHIFT),
+                            _mm_srai_epi32(high, WIDEN_SHIFT)));
+        }
+    }
+
+    // Finish the channels that don't fill a whole vector
+    const BYTE* tails[taps];
+    for (unsigned t = 0; t < taps; t++) {
+        tails[t] = rows[t] + i * (fromWide ? 2 : 1);
+    }
+    scale_column_scalar(tails, weights, taps, dst + i * (fromWide ? 1 : 2),
+            length - i, fromWide);
+}
+
+/* scale_row_avx2()
+ *
+ * This is the AVX2 horizontal kernel. It works like scale_row_sse2() but
+ * produces two output pixels at once, one in each 128 bit lane.
+ *
+ * src: The source row.
+ * dst: The output row.
+ * table: Weights for the row.
+ * bytes: Channels per pixel (3 or 4).
+ * fromWide: True if 'src' is a row of the intermediate image, false if 'dst'
+ *     is.
+ */
+__attribute__((target("avx2"))) void scale_row_avx2(const BYTE* src,
+        BYTE* dst, const WeightTable* table, unsigned bytes, bool fromWide)
+{
+    unsigned taps = table->taps;
+    unsigned srcSize = fromWide ? 2 * bytes : bytes;
+    unsigned dstSize = fromWide ? bytes : 2 * bytes;
+    unsigned x = 0;
+
+    for (; x + 2 <= table->length; x += 2) {
+        const BYTE* first = src + table->left[x] * srcSize;
+        const BYTE* second = src + table->left[x + 1] * srcSize;
+        const int16_t* weights = table->weights + x * taps;
+        bool wide = wide_loads(table, x + 1);
+        __m256i sum = _mm256_set1_epi32(pass_rounding(fromWide));
+
+        for (unsigned i = 0; i < taps; i += 2) {
+            bool pair = i + 1 < taps;
+            __m256i values = _mm256_inserti128_si256(
+                    _mm256_castsi128_si256(load_tap_pair(
+                            first, bytes, pair, wide, fromWide)),
+                    load_tap_pair(second, bytes, pair, wide, fromWide), 1);
+            __m256i weight = _mm256_inserti128_si256(
+                    _mm256_castsi128_si256(tap_weights(weights, i, taps)),
+                    tap_weights(weights + taps, i, taps), 1);
+            sum = _mm256_add_epi32(sum, _mm256_madd_epi16(values, weight));
+            first += 2 * srcSize;
+            second += 2 * srcSize;
+        }
+        store_pixel(_mm256_castsi256_si128(sum), dst, bytes, fromWide);
+        store_pixel(_mm256_extracti128_si256(sum, 1), dst + dstSize, bytes,
+                fromWide);
+        dst += 2 * dstSize;
+    }
+
+    // An odd last pixel is done by the SSE2 kernel
+    if (x < table->length) {
+        WeightTable last = {1, table->srcSize, taps, table->left + x,
+                table->weights + x * taps};
+        scale_row_sse2(src, dst, &last, bytes, fromWide);
+    }
+}
+
+/* load_channels_avx2()
+ *
+ * This function loads 16 channel values of a row as 16 bit values.
+ *
+ * row: The row.
+ * i: Index of the first channel value.
+ * wide: True if the row holds intermediate (16 bit) channels.
+ *
+ * Returns: The channel values.
+ */
+__attribute__((target("avx2"))) __m256i load_channels_avx2(
+        const BYTE* row, unsigned i, bool wide)
+{
+    if (wide) {
+        return _mm256_loadu_si256((const __m256i*)((const int16_t*)row + i));
+    }
+
+    return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(row + i)));
+}
+
+/* scale_column_avx2()
+ *
+ * This is the AVX2 vertical kernel. It works like scale_column_sse2() but
+ * produces 16 channel values per iteration.
+ *
+ * rows: The 'taps' source rows.
+ * weights: Weight of each source row.
+ * taps: Number of source rows.
+ * dst: The output row.
+ * length: Number of channel values in each row.
+ * fromWide: True if 'rows' are rows of the intermediate image, false if 'dst'
+ *     is.
+ */
+__attribute__((target("avx2"))) void scale_column_avx2(
+        const BYTE* const* rows, const int16_t* weights, unsigned taps,
+        BYTE* dst, unsigned length, bool fromWide)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    unsigned i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m256i low = _mm256_set1_epi32(pass_rounding(fromWide));
+        __m256i high = low;
+        for (unsigned t = 0; t < taps; t += 2) {
+            __m256i weight = _mm256_broadcastsi128_si256(
+                    tap_weights(weights, t, taps));
+            __m256i a = load_channels_avx2(rows[t], i, fromWide);
+            __m256i b = (t + 1 < taps)
+                    ? load_channels_avx2(rows[t + 1], i, fromWide)
+                    : zero;
+            low = _mm256_add_epi32(low,
+                    _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), weight));
+            high = _mm256_add_epi32(high,
+                    _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), weight));
+        }
+        // The unpacks and packs work within 128 bit lanes, so the values
+        // end up back in their original order
+        if (fromWide) {
+            __m256i values = _mm256_packs_epi32(
+                    _mm256_srai_epi32(low, NARROW_SHIFT),
+                    _mm256_srai_epi32(high, NARROW_SHIFT));
+            values = _mm256_permute4x64_epi64(
+                    _mm256_packus_epi16(values, values), 0x08);
+            _mm_storeu_si128((__m128i*)(dst + i),
+                    _mm256_castsi256_si128(values));
+        } else {
+            _mm256_storeu_si256((__m256i*)((int16_t*)dst + i),
+                    _mm256_packs_epi32(_mm256_srai_epi32(low, WIDEN_SHIFT),
+                            _mm256_srai_epi32(high, WIDEN_SHIFT)));
+        }
+    }
+
+    const BYTE* tails[taps];
+    for (unsigned t = 0; t < taps; t++) {
+        tails[t] = rows[t] + i * (fromWide ? 2 : 1);
+    }
+    scale_column_sse2(tails, weights, taps, dst + i * (fromWide ? 1 : 2),
+            length - i, fromWide);
+}
+#endif
+
+// Available kernels, best first
+const RescaleKernels kernelSets[] = {
+#ifdef RESCALE_X86
+        {"avx2", "avx2", scale_row_avx2, scale_column_avx2},
+        {"sse2", "sse2", scale_row_sse2, scale_column_sse2},
+#endif
+        {"scalar", NULL, scale_row_scalar, scale_column_scalar}};
+const int kernelSetCount = sizeof(kernelSets) / sizeof(RescaleKernels);
+
+// Kernels in use (chosen on first use unless selected beforehand)
+const RescaleKernels* activeKernels = NULL;
+pthread_once_t kernelsChosen = PTHREAD_ONCE_INIT;
+
+/* kernels_supported()
+ *
+ * This function checks whether the CPU can run a set of kernels.
+ *
+ * kernels: A pointer to the RescaleKernels to check.
+ *
+ * Returns: True if the kernels can be used, otherwise false.
+ */
+bool kernels_supported(const RescaleKernels* kernels)
+{
+    if (!kernels->cpuFeature) {
+        return true;
+    }
+#ifdef RESCALE_X86
+    if (!strcmp(kernels->cpuFeature, "avx2")) {
+        return __builtin_cpu_supports("avx2");
+    }
+    if (!strcmp(kernels->cpuFeature, "sse2")) {
+        return __builtin_cpu_supports("sse2");
+    }
+#endif
+
+    return false;
+}
+
+/* choose_best_kernels()
+ *
+ * This function selects the fastest kernels the CPU supports, unless kernels
+ * have already been selected with select_rescale_kernels().
+ */
+void choose_best_kernels(void)
+{
+    if (!activeKernels) {
+        select_rescale_kernels(NULL);
+    }
+}
+
+/* select_rescale_kernels()
+ *
+ * This function selects which rescaling kernels to use. It is intended for
+ * testing and benchmarking; by default the fastest supported kernels are used.
+ *
+ * name: One of "avx2", "sse2" or "scalar", or NULL for the fastest supported.
+ *
+ * Returns: True if the kernels were selected, false if they are unknown or
+ *     not supported by the CPU.
+ */
+bool select_rescale_kernels(const char* name)
+{
+    for (int i = 0; i < kernelSetCount; i++) {
+        if ((!name || !strcmp(name, kernelSets[i].name))
+                && kernels_supported(&kernelSets[i])) {
+            activeKernels = &kernelSets[i];
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* rescale_kernel_name()
+ *
+ * Returns: The name of the rescaling kernels in use.
+ */
+const char* rescale_kernel_name(void)
+{
+    pthread_once(&kernelsChosen, choose_best_kernels);
+
+    return activeKernels->name;
+}
+
+/* can_rescale()
+ *
+ * This function checks whether rescale_image() has kernels for an image
+ * (standard 24 or 32 bpp bitmaps).
+ *
+ * imageMap: The image to be scaled.
+ *
+ * Returns: True if the image can be scaled in-tree, otherwise false.
+ */
+bool can_rescale(FIBITMAP* imageMap)
+{
+    unsigned bpp = FreeImage_GetBPP(imageMap);
+
+    return FreeImage_GetImageType(imageMap) == FIT_BITMAP
+            && (bpp == 24 || bpp == 32);
+}
+
+/* rescale_horizontal_first()
+ *
+ * This function decides which dimension is scaled first. Like FreeImage, the
+ * order with the smaller intermediate image is used.
+ *
+ * imageMap: The image to be scaled.
+ * width: Width to scale to.
+ * height: Height to scale to.
+ *
+ * Returns: True if the width is scaled first, otherwise false.
+ */
+bool rescale_horizontal_first(FIBITMAP* imageMap, unsigned width,
+        unsigned height)
+{
+    return (unsigned long)width * FreeImage_GetHeight(imageMap)
+            <= (unsigned long)height * FreeImage_GetWidth(imageMap);
+}
+
+/* rescale_horizontal()
+ *
+ * This function scales rows [firstRow, lastRow) of 'src' to the width of
+ * 'dst' (which has the same height). Exactly one of the two is the
+ * intermediate image.
+ *
+ * src: The source rows.
+ * dst: The output rows.
+ * table: Weights for scaling from the width of 'src' to that of 'dst'.
+ * firstRow: First row to scale.
+ * lastRow: Row to stop at (exclusive).
+ */
+void rescale_horizontal(const Plane* src, const Plane* dst,
+        const WeightTable* table, unsigned firstRow, unsigned lastRow)
+{
+    pthread_once(&kernelsChosen, choose_best_kernels);
+
+    for (unsigned y = firstRow; y < lastRow; y++) {
+        activeKernels->scaleRow(src->bits + (size_t)y * src->pitch,
+                dst->bits + (size_t)y * dst->pitch, table, src->channels,
+                src->wide);
+    }
+}
+
+/* rescale_vertical()
+ *
+ * This function fills rows [firstRow, lastRow) of 'dst' by scaling 'src' (of
+ * the same width) to the height of 'dst'. Exactly one of the two is the
+ * intermediate image.
+ *
+ * src: The source rows.
+ * dst: The output rows.
+ * table: Weights for scaling from the height of 'src' to that of 'dst'.
+ * firstRow: First row of 'dst' to fill.
+ * lastRow: Row of 'dst' to stop at (exclusive).
+ */
+void rescale_vertical(const Plane* src, const Plane* dst,
+        const WeightTable* table, unsigned firstRow, unsigned lastRow)
+{
+    pthread_once(&kernelsChosen, choose_best_kernels);
+    unsigned length = dst->width * dst->channels;
+    const BYTE** rows = malloc(sizeof(BYTE*) * table->taps);
+
+    for (unsigned y = firstRow; y < lastRow; y++) {
+        for (unsigned t = 0; t < table->taps; t++) {
+            rows[t] = src->bits + (size_t)(table->left[y] + t) * src->pitch;
+        }
+        activeKernels->scaleColumn(rows, table->weights + y * table->taps,
+                table->taps, dst->bits + (size_t)y * dst->pitch, length,
+                src->wide);
+    }
+    free(rows);
+}
+
+/* horizontal_band()
+ *
+ * This is the TaskFunction for the horizontal pass of a parallel rescale.
+ *
+ * arg: Expected to be a pointer to the RescaleJob.
+ * firstRow: First row to scale.
+ * lastRow: Row to stop at (exclusive).
+ */
+void horizontal_band(void* arg, unsigned firstRow, unsigned lastRow)
+{
+    RescaleJob* job = (RescaleJob*)arg;
+
+    rescale_horizontal(job->src, job->dst, job->table, firstRow, lastRow);
+}
+
+/* vertical_band()
+ *
+ * This is the TaskFunction for the vertical pass of a parallel rescale.
+ *
+ * arg: Expected to be a pointer to the RescaleJob.
+ * firstRow: First output row to fill.
+ * lastRow: Output row to stop at (exclusive).
+ */
+void vertical_band(void* arg, unsigned firstRow, unsigned lastRow)
+{
+    RescaleJob* job = (RescaleJob*)arg;
+
+    rescale_vertical(job->src, job->dst, job->table, firstRow, lastRow);
+}
+
+/* run_pass()
+ *
+ * This function runs one pass of a rescale over every row of its output,
+ * split into bands across 'tasks' if the output is large enough.
+ *
+ * band: horizontal_band or vertical_band.
+ * src: The source rows of the pass.
+ * dst: The output rows of the pass.
+ * table: Weights for the pass.
+ * tasks: The TaskPool to split the work across (may be NULL).
+ * cancel: A pointer to the CancelToken of the work (may be NULL).
+ */
+void run_pass(TaskFunction band, const Plane* src, const Plane* dst,
+        const WeightTable* table, TaskPool* tasks, const CancelToken* cancel)
+{
+    RescaleJob job = {src, dst, table};
+
+    taskpool_run(tasks, band, &job, dst->height, 1,
+            (unsigned long)dst->width * dst->height, cancel);
+}
+
+/* image_plane()
+ *
+ * This function describes the pixels of an image for the rescaling passes.
+ *
+ * imageMap: The image.
+ *
+ * Returns: A Plane for the image's own 8 bit channels.
+ */
+Plane image_plane(FIBITMAP* imageMap)
+{
+    Plane plane = {FreeImage_GetBits(imageMap), FreeImage_GetPitch(imageMap),
+            FreeImage_GetWidth(imageMap), FreeImage_GetHeight(imageMap),
+            FreeImage_GetBPP(imageMap) / 8, false};
+
+    return plane;
+}
+
+/* allocate_like()
+ *
+ * This function allocates an image of the same type as another.
+ *
+ * imageMap: The image to copy the type from.
+ * width: Width of the new image.
+ * height: Height of the new image.
+ *
+ * Returns: The new image, or NULL if allocation failed.
+ */
+FIBITMAP* allocate_like(FIBITMAP* imageMap, unsigned width, unsigned height)
+{
+    return FreeImage_AllocateT(FreeImage_GetImageType(imageMap), width, height,
+            FreeImage_GetBPP(imageMap), FreeImage_GetRedMask(imageMap),
+            FreeImage_GetGreenMask(imageMap), FreeImage_GetBlueMask(imageMap));
+}
+
+/* rescale_image()
+ *
+ * This function scales an image with a bilinear filter, in two separable
+ * passes using precomputed weight tables and the fastest kernels the CPU
+ * supports. The image between the passes keeps 7 fractional bits per channel
+ * rather than being rounded to whole channel values as FreeImage does, so
+ * the only differences from FreeImage_Rescale() with FILTER_BILINEAR are
+ * FreeImage's own rounding between passes (at most 1/2), the fixed point
+ * weights (at most 255 * taps / 32768 per pass) and the intermediate's
+ * rounding (1/256). With at most MAX_TAPS taps per pass these add up to less
+ * than 1, so the result is always within 1 (per channel) of FreeImage's.
+ * Wider filters (downscales by more than about 10 times), and images other
+ * than 24 and 32 bpp bitmaps, are passed on to FreeImage_Rescale(). Each pass
+ * over a large image is split into bands of rows that are scaled in
+ * parallel. If the work is cancelled the remaining bands are skipped.
+ *
+ * imageMap: The image to be scaled (left unchanged).
+ * width: Width to scale to.
+ * height: Height to scale to.
+ * tasks: The TaskPool to split the work across (may be NULL).
+ * cancel: A pointer to the CancelToken of the work (may be NULL).
+ *
+ * Returns: A newly allocated scaled image (incomplete if the work was
+ *     cancelled), or NULL if scaling failed.
+ */
+FIBITMAP* rescale_image(FIBITMAP* imageMap, unsigned width, unsigned height,
+        TaskPool* tasks, const CancelToken* cancel)
+{
+    if (!can_rescale(imageMap)) {
+        return FreeImage_Rescale(imageMap, width, height, FILTER_BILINEAR);
+    }
+
+    Plane source = image_plane(imageMap);
+    WeightTable* columns = create_weight_table(width, source.width);
+    WeightTable* rows = create_weight_table(height, source.height);
+    if (columns->taps > MAX_TAPS || rows->taps > MAX_TAPS) {
+        free_weight_table(columns);
+        free_weight_table(rows);
+        return FreeImage_Rescale(imageMap, width, height, FILTER_BILINEAR);
+    }
+
+    bool horizontalFirst = rescale_horizontal_first(imageMap, width, height);
+    Plane middle = {NULL, 0, horizontalFirst ? width : source.width,
+            horizontalFirst ? source.height : height, source.channels, true};
+    middle.pitch = middle.width * middle.channels * sizeof(int16_t);
+    middle.bits = malloc((size_t)middle.pitch * middle.height);
+    FIBITMAP* scaled = allocate_like(imageMap, width, height);
+    if (!middle.bits || !scaled) {
+        free(middle.bits);
+        FreeImage_Unload(scaled);
+        free_weight_table(columns);
+        free_weight_table(rows);
+        return NULL;
+    }
+
+    Plane output = image_plane(scaled);
+    if (horizontalFirst) {
+        run_pass(horizontal_band, &source, &middle, columns, tasks, cancel);
+        run_pass(vertical_band, &middle, &output, rows, tasks, cancel);
+    } else {
+        run_pass(vertical_band, &source, &middle, rows, tasks, cancel);
+        run_pass(horizontal_band, &middle, &output, columns, tasks, cancel);
+    }
+    free_weight_table(columns);
+    free_weight_table(rows);
+    free(middle.bits);
+    FreeImage_CloneMetadata(scaled, imageMap);
+
+    return scaled;
+}
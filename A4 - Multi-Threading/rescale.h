@@ -0,0 +1,50 @@
+#ifndef RESCALE_H
+#define RESCALE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <FreeImage.h>
+#include "taskpool.h"
+
+/* Precomputed bilinear weights for scaling one dimension of an image from
+ * 'srcSize' to 'length' pixels. Every output pixel uses the same number of
+ * source pixels ('taps'), starting at left[i], with fixed point weights that
+ * add up to exactly 1.
+ */
+typedef struct {
+    unsigned length;
+    unsigned srcSize;
+    unsigned taps;
+    unsigned* left;
+    int16_t* weights;
+} WeightTable;
+
+/* Rows of channel values being scaled: either an image's own 8 bit channels or
+ * the intermediate image between the two passes of a rescale, which holds
+ * each channel as a 16 bit fixed point value ('wide').
+ */
+typedef struct {
+    BYTE* bits;
+    unsigned pitch;
+    unsigned width;
+    unsigned height;
+    unsigned channels;
+    bool wide;
+} Plane;
+
+// Function Prototypes
+WeightTable* create_weight_table(unsigned dstSize, unsigned srcSize);
+void free_weight_table(WeightTable* table);
+bool select_rescale_kernels(const char* name);
+const char* rescale_kernel_name(void);
+bool can_rescale(FIBITMAP* imageMap);
+bool rescale_horizontal_first(FIBITMAP* imageMap, unsigned width,
+        unsigned height);
+void rescale_horizontal(const Plane* src, const Plane* dst,
+        const WeightTable* table, unsigned firstRow, unsigned lastRow);
+void rescale_vertical(const Plane* src, const Plane* dst,
+        const WeightTable* table, unsigned firstRow, unsigned lastRow);
+FIBITMAP* rescale_image(FIBITMAP* imageMap, unsigned width, unsigned height,
+        TaskPool* tasks, const CancelToken* cancel);
+
+#endif
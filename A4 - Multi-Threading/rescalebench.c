@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <FreeImage.h>
+#include "metrics.h"
+#include "rescale.h"
+
+/* Benchmark of the in-tree bilinear rescaler against FreeImage_Rescale(). It
+ * is not part of uqimageproc and is built separately, e.g.
+ *
+ *     gcc -O2 -std=gnu99 rescalebench.c rescale.c taskpool.c metrics.c
+ *             -lfreeimage -lm -pthread -o rescalebench
+ */
+
+// Default benchmark parameters
+typedef enum {
+    DEFAULT_BPP = 32,
+    DEFAULT_ITERATIONS = 10
+} BenchDefaults;
+
+const char* const benchUsage
+        = "Usage: rescalebench width height newwidth newheight "
+          "[bpp [iterations]]\n";
+const char* const kernelNames[] = {"scalar", "sse2", "avx2"};
+const int kernelCount = sizeof(kernelNames) / sizeof(char*);
+
+/* create_test_image()
+ *
+ * This function creates an image with a mix of smooth gradients and noise.
+ *
+ * width: Width of the image.
+ * height: Height of the image.
+ * bpp: Bits per pixel (24 or 32).
+ *
+ * Returns: The new image.
+ */
+FIBITMAP* create_test_image(int width, int height, int bpp)
+{
+    FIBITMAP* imageMap = FreeImage_Allocate(width, height, bpp, 0, 0, 0);
+
+    srand(2310);
+    for (int y = 0; y < height; y++) {
+        BYTE* line = FreeImage_GetScanLine(imageMap, y);
+        for (int i = 0; i < width * bpp / 8; i++) {
+            line[i] = (rand() % 4) ? (i + 3 * y) & 0xFF : rand() & 0xFF;
+        }
+    }
+
+    return imageMap;
+}
+
+/* max_difference()
+ *
+ * This function finds the largest difference between any channel of two
+ * images of the same size and format.
+ *
+ * first: The first image.
+ * second: The second image.
+ *
+ * Returns: The largest difference.
+ */
+int max_difference(FIBITMAP* first, FIBITMAP* second)
+{
+    unsigned length = FreeImage_GetLine(first);
+    int largest = 0;
+
+    for (unsigned y = 0; y < FreeImage_GetHeight(first); y++) {
+        BYTE* a = FreeImage_GetScanLine(first, y);
+        BYTE* b = FreeImage_GetScanLine(second, y);
+        for (unsigned i = 0; i < length; i++) {
+            int difference = abs(a[i] - b[i]);
+            largest = (difference > largest) ? difference : largest;
+        }
+    }
+
+    return largest;
+}
+
+/* time_rescale()
+ *
+ * This function times a number of rescales of an image.
+ *
+ * imageMap: The image to scale.
+ * width: Width to scale to.
+ * height: Height to scale to.
+ * iterations: Number of times to scale the image.
+ * inTree: True to use rescale_image(), false to use FreeImage_Rescale().
+ * result: Used to return the output of the last rescale.
+ *
+ * Returns: The average time of a rescale in microseconds.
+ */
+double time_rescale(FIBITMAP* imageMap, int width, int height, int iterations,
+        bool inTree, FIBITMAP** result)
+{
+    uint64_t start = now_usec();
+
+    for (int i = 0; i < iterations; i++) {
+        FreeImage_Unload(*result);
+        *result = inTree ? rescale_image(imageMap, width, height, NULL, NULL)
+                         : FreeImage_Rescale(
+                                 imageMap, width, height, FILTER_BILINEAR);
+    }
+
+    return (double)(now_usec() - start) / iterations;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 5 || argc > 7) {
+        fprintf(stderr, benchUsage);
+        return 1;
+    }
+    int width = atoi(argv[1]);
+    int height = atoi(argv[2]);
+    int newWidth = atoi(argv[3]);
+    int newHeight = atoi(argv[4]);
+    int bpp = (argc > 5) ? atoi(argv[5]) : DEFAULT_BPP;
+    int iterations = (argc > 6) ? atoi(argv[6]) : DEFAULT_ITERATIONS;
+    if (width <= 0 || height <= 0 || newWidth <= 0 || newHeight <= 0
+            || (bpp != 24 && bpp != 32) || iterations <= 0) {
+        fprintf(stderr, benchUsage);
+        return 1;
+    }
+
+    FIBITMAP* imageMap = create_test_image(width, height, bpp);
+    FIBITMAP* expected = NULL;
+    double baseline = time_rescale(
+            imageMap, newWidth, newHeight, iterations, false, &expected);
+    printf("%-10s %10.0f us\n", "freeimage", baseline);
+
+    for (int i = 0; i < kernelCount; i++) {
+        if (!select_rescale_kernels(kernelNames[i])) {
+            printf("%-10s %13s\n", kernelNames[i], "unsupported");
+            continue;
+        }
+        FIBITMAP* scaled = NULL;
+        double elapsed = time_rescale(
+                imageMap, newWidth, newHeight, iterations, true, &scaled);
+        printf("%-10s %10.0f us %6.2fx  max diff %d\n", kernelNames[i],
+                elapsed, baseline / elapsed, max_difference(expected, scaled));
+        FreeImage_Unload(scaled);
+    }
+
+    FreeImage_Unload(expected);
+    FreeImage_Unload(imageMap);
+    return 0;
+}
@@ -0,0 +1,317 @@
+#include <stdlib.h>
+#include "taskpool.h"
+#include "metrics.h"
+
+// Task pool values
+typedef enum {
+    TASKS_PER_THREAD = 4,
+    CANCEL_CHECKS = 16,
+    INITIAL_DEQUE_CAPACITY = 16
+} TaskPoolValues;
+
+/* A job given to taskpool_run(). It lives on the stack of the caller, which
+ * waits until all of its tasks have been run (or skipped, once the job has
+ * been cancelled).
+ */
+typedef struct TaskJob {
+    TaskFunction function;
+    void* arg;
+    const CancelToken* cancel;
+    unsigned remaining;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} TaskJob;
+
+/* Information for a single pool thread */
+typedef struct {
+    TaskPool* pool;
+    int index;
+} TaskThread;
+
+/* deque_push()
+ *
+ * This function adds a task to the back of a deque, growing it if needed.
+ *
+ * pool: The TaskPool the deque belongs to.
+ * deque: The TaskDeque to add to.
+ * task: The task to add.
+ */
+void deque_push(TaskPool* pool, TaskDeque* deque, Task task)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->capacity) {
+        Task* tasks = malloc(sizeof(Task) * deque->capacity * 2);
+        for (unsigned i = 0; i < deque->count; i++) {
+            tasks[i] = deque->tasks[(deque->head + i) % deque->capacity];
+        }
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->capacity *= 2;
+        deque->head = 0;
+    }
+
+    deque->tasks[(deque->head + deque->count) % deque->capacity] = task;
+    deque->count++;
+    __atomic_add_fetch(&pool->pending, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&deque->lock);
+}
+
+/* deque_take()
+ *
+ * This function removes a task from a deque: from the back if the caller owns
+ * the deque (the most recently added, whose data is most likely still in
+ * cache), otherwise from the front.
+ *
+ * pool: The TaskPool the deque belongs to.
+ * deque: The TaskDeque to take from.
+ * owner: Whether the caller owns the deque.
+ * task: Used to return the task.
+ *
+ * Returns: True if a task was taken, false if the deque was empty.
+ */
+bool deque_take(TaskPool* pool, TaskDeque* deque, bool owner, Task* task)
+{
+    bool taken = false;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count) {
+        if (owner) {
+            *task = deque->tasks[(deque->head + deque->count - 1)
+                    % deque->capacity];
+        } else {
+            *task = deque->tasks[deque->head];
+            deque->head = (deque->head + 1) % deque->capacity;
+        }
+        deque->count--;
+        __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_RELEASE);
+        taken = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return taken;
+}
+
+/* take_task()
+ *
+ * This function finds a task to run: first from the thread's own deque, then
+ * by stealing from the other deques in turn.
+ *
+ * pool: A pointer to the TaskPool.
+ * index: Index of the calling thread's deque, or -1 if it has none.
+ * task: Used to return the task.
+ *
+ * Returns: True if a task was found, false if there was no work.
+ */
+bool take_task(TaskPool* pool, int index, Task* task)
+{
+    if (index >= 0 && deque_take(pool, &pool->deques[index], true, task)) {
+        return true;
+    }
+
+    int start = (index >= 0) ? index + 1 : 0;
+    for (int i = 0; i < pool->threads; i++) {
+        int victim = (start + i) % pool->threads;
+        if (victim != index
+                && deque_take(pool, &pool->deques[victim], false, task)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* run_task()
+ *
+ * This function runs a task (unless its job has been cancelled) and wakes up
+ * the caller of taskpool_run() if it was the last task of its job.
+ *
+ * task: A pointer to the Task to run.
+ */
+void run_task(Task* task)
+{
+    TaskJob* job = task->job;
+    if (!cancel_requested(job->cancel)) {
+        job->function(job->arg, task->first, task->last);
+    }
+
+    pthread_mutex_lock(&job->lock);
+    if (--job->remaining == 0) {
+        pthread_cond_signal(&job->done);
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+/* task_thread()
+ *
+ * This is the thread function for each pool thread. It runs tasks while there
+ * are any and otherwise sleeps until more are added.
+ *
+ * arg: Expected to be a pointer to the TaskThread's information.
+ *
+ * Returns: This function never returns.
+ */
+void* task_thread(void* arg)
+{
+    TaskThread* self = (TaskThread*)arg;
+    TaskPool* pool = self->pool;
+
+    while (1) {
+        Task task;
+        if (take_task(pool, self->index, &task)) {
+            run_task(&task);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        while (!__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE)) {
+            pthread_cond_wait(&pool->workReady, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+/* taskpool_create()
+ *
+ * This function creates a TaskPool and starts its threads.
+ *
+ * threads: Number of pool threads to start (must be > 0).
+ * minWork: Least amount of work for which a job is split across the pool.
+ * cpus: The CpuSet the pool threads run on (NULL to run them anywhere).
+ *
+ * Returns: A pointer to the newly created TaskPool.
+ */
+TaskPool* taskpool_create(int threads, unsigned long minWork,
+        const CpuSet* cpus)
+{
+    TaskPool* pool = malloc(sizeof(TaskPool));
+    pool->deques = malloc(sizeof(TaskDeque) * threads);
+    pool->threads = threads;
+    pool->minWork = minWork;
+    pool->pending = 0;
+    pool->nextDeque = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->workReady, NULL);
+
+    for (int i = 0; i < threads; i++) {
+        TaskDeque* deque = &pool->deques[i];
+        deque->tasks = malloc(sizeof(Task) * INITIAL_DEQUE_CAPACITY);
+        deque->capacity = INITIAL_DEQUE_CAPACITY;
+        deque->head = 0;
+        deque->count = 0;
+        pthread_mutex_init(&deque->lock, NULL);
+    }
+    for (int i = 0; i < threads; i++) {
+        TaskThread* self = malloc(sizeof(TaskThread));
+        self->pool = pool;
+        self->index = i;
+        pthread_t threadID;
+        pthread_create(&threadID, NULL, task_thread, self);
+        place_thread(threadID, cpus);
+        pthread_detach(threadID);
+    }
+
+    return pool;
+}
+
+/* cancel_requested()
+ *
+ * This function checks whether the work belonging to a CancelToken is no
+ * longer wanted.
+ *
+ * cancel: A pointer to the CancelToken (may be NULL, for work that can't be
+ *     cancelled).
+ *
+ * Returns: True if the work has been cancelled or its deadline has passed.
+ */
+bool cancel_requested(const CancelToken* cancel)
+{
+    if (!cancel) {
+        return false;
+    }
+
+    return (cancel->cancelled
+                   && __atomic_load_n(cancel->cancelled, __ATOMIC_RELAXED))
+            || (cancel->deadline && now_usec() >= cancel->deadline);
+}
+
+/* taskpool_worth_splitting()
+ *
+ * This function checks whether a job is big enough to be split across the
+ * pool.
+ *
+ * pool: A pointer to the TaskPool (may be NULL, in which case nothing is
+ *     split).
+ * work: Amount of work in the job (in the same unit as the pool's minWork).
+ *
+ * Returns: True if the job would be split, otherwise false.
+ */
+bool taskpool_worth_splitting(TaskPool* pool, unsigned long work)
+{
+    return pool && work >= pool->minWork;
+}
+
+/* taskpool_run()
+ *
+ * This function runs 'function' over the items [0, count) and returns once
+ * all of them are done. If the job is worth splitting the items are divided
+ * into ranges (each a multiple of 'align' items, apart from the last) which
+ * are spread across the pool. The calling thread runs tasks too while it
+ * waits. Otherwise the caller runs the whole job itself. A job that can be
+ * cancelled is divided into at least CANCEL_CHECKS ranges either way, and once
+ * it is cancelled the ranges not yet started are skipped (leaving the job's
+ * output incomplete).
+ *
+ * pool: A pointer to the TaskPool (may be NULL).
+ * function: The function to run on each range.
+ * arg: Argument passed to every call of 'function'.
+ * count: Number of items in the job.
+ * align: Range sizes are rounded up to a multiple of this (must be > 0).
+ * work: Amount of work in the job, compared against the pool's minWork.
+ * cancel: A pointer to the job's CancelToken (may be NULL).
+ */
+void taskpool_run(TaskPool* pool, TaskFunction function, void* arg,
+        unsigned count, unsigned align, unsigned long work,
+        const CancelToken* cancel)
+{
+    bool split = taskpool_worth_splitting(pool, work);
+    unsigned ranges = split ? pool->threads * TASKS_PER_THREAD : 1;
+    if (cancel && ranges < CANCEL_CHECKS) {
+        ranges = CANCEL_CHECKS;
+    }
+    unsigned size = (count + ranges - 1) / ranges;
+    size = (size + align - 1) / align * align;
+    if (!split || count <= size) {
+        for (unsigned first = 0; first < count && !cancel_requested(cancel);
+                first += size) {
+            function(arg, first, (count - first > size) ? first + size : count);
+        }
+        return;
+    }
+
+    TaskJob job = {function, arg, cancel, (count + size - 1) / size,
+            PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+    unsigned deque = __atomic_fetch_add(&pool->nextDeque, 1, __ATOMIC_RELAXED);
+    for (unsigned first = 0; first < count; first += size) {
+        unsigned last = (count - first > size) ? first + size : count;
+        Task task = {&job, first, last};
+        deque_push(pool, &pool->deques[deque++ % pool->threads], task);
+    }
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_broadcast(&pool->workReady);
+    pthread_mutex_unlock(&pool->lock);
+
+    // Help out rather than sit idle, then wait for tasks still running
+    Task task;
+    while (take_task(pool, -1, &task)) {
+        run_task(&task);
+    }
+    pthread_mutex_lock(&job.lock);
+    while (job.remaining) {
+        pthread_cond_wait(&job.done, &job.lock);
+    }
+    pthread_mutex_unlock(&job.lock);
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.done);
+}
@@ -0,0 +1,67 @@
+#ifndef TASKPOOL_H
+#define TASKPOOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include "affinity.h"
+
+/* Lets the work for a request be abandoned part way through: it is no longer
+ * wanted once '*cancelled' has been set (if 'cancelled' isn't NULL) or once
+ * the 'deadline' (a now_usec() time, 0 for none) has passed.
+ */
+typedef struct {
+    const bool* cancelled;
+    unsigned long deadline;
+} CancelToken;
+
+/* Function run on each range of a parallel job. It processes items
+ * [first, last) of the job described by 'arg'.
+ */
+typedef void (*TaskFunction)(void* arg, unsigned first, unsigned last);
+
+struct TaskJob;
+
+/* A range of a parallel job waiting to be run */
+typedef struct {
+    struct TaskJob* job;
+    unsigned first;
+    unsigned last;
+} Task;
+
+/* A growable double ended queue of tasks belonging to one pool thread. The
+ * owner takes tasks from the back, other threads steal from the front.
+ */
+typedef struct {
+    Task* tasks;
+    unsigned capacity;
+    unsigned head;
+    unsigned count;
+    pthread_mutex_t lock;
+} TaskDeque;
+
+/* A shared fork/join pool for splitting the work on a single large item (such
+ * as an image) across cores. The ranges of a job are spread over the deques of
+ * the pool threads, and a thread that runs out of work steals from the
+ * others. Jobs with less than 'minWork' units of work aren't worth the
+ * overhead and are run directly by the caller.
+ */
+typedef struct {
+    TaskDeque* deques;
+    int threads;
+    unsigned long minWork;
+    unsigned pending;
+    unsigned nextDeque;
+    pthread_mutex_t lock;
+    pthread_cond_t workReady;
+} TaskPool;
+
+// Function Prototypes
+TaskPool* taskpool_create(int threads, unsigned long minWork,
+        const CpuSet* cpus);
+bool cancel_requested(const CancelToken* cancel);
+bool taskpool_worth_splitting(TaskPool* pool, unsigned long work);
+void taskpool_run(TaskPool* pool, TaskFunction function, void* arg,
+        unsigned count, unsigned align, unsigned long work,
+        const CancelToken* cancel);
+
+#endif
@@ -1,14 +1,41 @@
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <csse2310a4.h>
 #include <FreeImage.h>
-#include <semaphore.h>
 #include <csse2310_freeimage.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
 #include "common.h"
+#include "workqueue.h"
+#include "priorityqueue.h"
+#include "httprequest.h"
+#include "metrics.h"
+#include "imageops.h"
+#include "taskpool.h"
+#include "cache.h"
+#include "hash.h"
+#include "encode.h"
+#include "decode.h"
+#include "bufferpool.h"
+#include "homepage.h"
+#include "affinity.h"
+
+// Stages of the image pipeline (in processing order)
+typedef enum {
+    DECODE_STAGE = 0,
+    TRANSFORM_STAGE = 1,
+    ENCODE_STAGE = 2,
+    SEND_STAGE = 3,
+    STAGE_COUNT = 4,
+    PIPELINE_DONE = 4
+} PipelineStage;
 
 /* Information of a single server - Contains all necessary variables including
  * port number and max connection number
@@ -16,41 +43,400 @@
 typedef struct {
     char* port;
     int maxConns;
+    int workers;
+    int reactors;
+    int stageThreads[STAGE_COUNT];
+    int parallelPixels;
+    int resultCacheBytes;
+    int decodeCacheBytes;
+    int compression;
+    int bufferPoolBytes;
+    char* homePage;
+    int pipelineDepth;
+    int maxQueue;
+    int maxPixelWork;
+    int deadlineMs;
+    int listeners;
+    int pinListeners;
+    int backlog;
+    CpuSet workerCpus;
+    CpuSet stageCpus;
 } ServerInfo;
 
+// Server statistics values
+typedef enum {
+    CONNECT = 0,
+    DISCONNECT = 1,
+    HTTP_SUCCESS = 2,
+    HTTP_FAIL = 3,
+    OPERATE_IMAGE = 4,
+    BYTES_IN = 5,
+    BYTES_OUT = 6,
+    STAT_COUNT = 7
+} StatChange;
+
+// Latencies recorded by the server (each kept in its own histogram)
+typedef enum {
+    QUEUE_WAIT = 0,
+    BODY_READ = 1,
+    DECODE_TIME = 2,
+    ROTATE_TIME = 3,
+    FLIP_TIME = 4,
+    SCALE_TIME = 5,
+    ENCODE_TIME = 6,
+    WRITE_TIME = 7,
+    LATENCY_COUNT = 8
+} Latency;
+
+// Allocations counted for each request (each kept in its own histogram)
+typedef enum {
+    ARENA_ALLOCS = 0,
+    HEAP_ALLOCS = 1,
+    ALLOC_COUNT = 2
+} AllocCount;
+
+// Reasons for shedding a connection or request instead of admitting it
+typedef enum {
+    SHED_CONNECTIONS = 0,
+    SHED_QUEUE = 1,
+    SHED_PIXEL_WORK = 2,
+    SHED_COUNT = 3,
+    ADMITTED = 3
+} ShedReason;
+
+// Costs recorded for each image job (each kept in its own histogram)
+typedef enum {
+    ESTIMATED_COST = 0,
+    ACTUAL_COST = 1,
+    COST_RATIO = 2,
+    COST_COUNT = 3
+} CostMeasure;
+
+// Reasons for cancelling the work done for a request
+typedef enum {
+    DEADLINE_EXCEEDED = 0,
+    CLIENT_GONE = 1,
+    CANCEL_COUNT = 2
+} CancelReason;
+
+// Size of a CPU cache line in bytes
+#define CACHE_LINE 64
+
+/* Statistics counters recorded by a single thread (indexed by StatChange).
+ * Each thread only ever writes its own shard, and shards are aligned to a
+ * cache line so no two threads' counters share one.
+ */
+typedef struct StatsShard {
+    unsigned long counts[STAT_COUNT];
+    struct StatsShard* next;
+} __attribute__((aligned(CACHE_LINE))) StatsShard;
+
 /* Server statistics - Constains all necessary variables for server statistics
- * counting and maximum connection limiting including the necessary semaphores.
+ * counting and admission control. Counters are kept per thread and only added
+ * together when a snapshot is taken, so recording a statistic never waits on
+ * another thread. Latencies (in microseconds) and the number of allocations
+ * made for each request are recorded into lock-free histograms, as are the
+ * estimated and actual costs of image jobs (see CostMeasure). New
+ * connections are only admitted while fewer than 'maxConns' are 'admitted',
+ * fewer than 'maxQueue' requests are 'pending' (received but not yet
+ * answered) and the estimated 'pixelWork' of those requests is below
+ * 'maxPixelWork' (a limit of 0 meaning no limit); the others are shed and
+ * counted in 'shed' by ShedReason. The same request limits are checked again
+ * for every request received, and requests over them (or that find their
+ * request queue full) are shed and counted in 'shedRequests'. Requests whose
+ * work was cancelled are counted in 'cancelled' by CancelReason. These are
+ * all updated atomically.
  */
 typedef struct {
-    sem_t maxConnsLock;
-    sem_t statsLock;
+    pthread_mutex_t shardsLock;
+    StatsShard* shards;
+    Histogram* latencies[LATENCY_COUNT];
+    Histogram* allocations[ALLOC_COUNT];
+    Histogram* costs[COST_COUNT];
+    unsigned admitted;
+    unsigned pending;
+    unsigned long pixelWork;
+    unsigned long shed[SHED_COUNT];
+    unsigned long shedRequests[SHED_COUNT];
+    unsigned long cancelled[CANCEL_COUNT];
+    int maxConns;
+    int maxQueue;
+    int maxPixelWork;
+} ServerStats;
+
+/* A point in time copy of the server statistics */
+typedef struct {
     unsigned int currentClients;
     unsigned int totalClients;
     unsigned int successRequests;
     unsigned int failRequests;
     unsigned int completedOperations;
-    int maxConns;
-} ServerStats;
+    unsigned long bytesIn;
+    unsigned long bytesOut;
+} StatsSnapshot;
 
-/* Information for a single SIGHUP signal handling thread */
+
+// Gives back the body of a response once it has been written (or discarded)
+typedef void (*ReleaseFunction)(void* owner, void* data);
+
+/* A response waiting to be written to a client: its status line and headers
+ * ('head') followed by its body. A large body is written straight from where
+ * it was produced and handed to 'release' afterwards; a small one is simply
+ * copied into 'head' along with the headers ('body' is then NULL). 'seq' is
+ * the sequence number of the request it answers on its connection.
+ */
+typedef struct OutputChunk {
+    unsigned long seq;
+    const unsigned char* body;
+    size_t bodyLen;
+    size_t headLen;
+    size_t sent;
+    unsigned long queuedAt;
+    ReleaseFunction release;
+    void* owner;
+    void* data;
+    struct OutputChunk* next;
+    unsigned char head[];
+} OutputChunk;
+
+/* Information for a single connection between the server and a specific
+ * client. The socket is non-blocking and watched by one epoll reactor; input
+ * is buffered until the parser can use it. Pipelined requests are parsed
+ * ahead and processed concurrently, up to 'maxInFlight' at a time. Requests
+ * are numbered as they arrive and their responses are written strictly in
+ * that order: a response that is ready before those of earlier requests
+ * waits in the 'held' list (kept in sequence order) until 'sendSeq' reaches
+ * it. Once a request with a body too large to accept has been answered the
+ * connection stops sending and closes after 'discarded' bytes have been
+ * thrown away (or the client stops). A connection that was 'shed' is only
+ * sent the overload response and then closed in the same way. 'cancelled' is
+ * set (atomically) once the client is found to have gone or the connection is
+ * closed, which stops the work still being done for its requests. Its
+ * requests are handled by the threads of placement 'group' (see Placement).
+ * The connection is reference counted as both its reactor and any request
+ * being processed refer to it.
+ */
 typedef struct {
-    sigset_t set;
+    int fd;
+    int epollFd;
+    pthread_mutex_t lock;
+    int refCount;
+    int group;
+    uint32_t events;
+    unsigned inFlight;
+    unsigned maxInFlight;
+    unsigned long nextSeq;
+    unsigned long sendSeq;
+    bool wake;
+    bool shed;
+    bool peerClosed;
+    bool failed;
+    bool closed;
+    bool cancelled;
+    bool writeShut;
+    unsigned long discarded;
+    unsigned char* inBuf;
+    size_t inLen;
+    size_t inCap;
+    unsigned long requestStart;
+    HttpParser parser;
+    OutputChunk* outHead;
+    OutputChunk* outTail;
+    OutputChunk* held;
     ServerStats* stats;
-} SignalThreadInfo;
+} Connection;
+
+/* A fully received HTTP request, the connection it arrived on and its
+ * sequence number there. 'responded' is set once its response is queued.
+ * 'admission' says whether the request was admitted when it was received (see
+ * admit_request()). Work on the request stops once 'cancel' says so: when its
+ * connection is closed or its deadline (if it has one) has passed.
+ */
+typedef struct {
+    Connection* conn;
+    HttpRequest http;
+    unsigned long seq;
+    bool responded;
+    ShedReason admission;
+    unsigned long queuedAt;
+    CancelToken cancel;
+} ClientRequest;
+
+/* An image request moving through the processing pipeline. Each stage fills
+ * in the members needed by the stages after it. If 'exact' is set the
+ * operations are performed exactly as FreeImage would, without reordering.
+ * The result is encoded by 'encoder' (using the FreeImage PNG flags in
+ * 'compression' if the format is compressed with zlib). If
+ * either cache is enabled 'bodyKey' identifies the uploaded image. If results
+ * are being cached 'resultKey' identifies the request's result, and 'result'
+ * is set once the encoded image has been added to the cache. 'pixelWork' is
+ * the job's share of the server's estimated pixel work. 'estimatedCost' is the
+ * pixel work estimated before the job entered the pipeline, which sets its
+ * 'priority' there, and 'actualCost' the time (in microseconds) the pipeline
+ * stages have spent on it. The job stays within the queues and threads of
+ * placement 'group' (that of its connection).
+ */
+typedef struct {
+    ClientRequest* request;
+    char** operations;
+    OpPlan plan;
+    bool exact;
+    const ImageEncoder* encoder;
+    int compression;
+    char* bodyKey;
+    char* resultKey;
+    CacheEntry* result;
+    FIBITMAP* imageMap;
+    EncodedImage* output;
+    unsigned long pixelWork;
+    unsigned long estimatedCost;
+    unsigned long actualCost;
+    unsigned long priority;
+    unsigned long queuedAt;
+    int group;
+} ImageJob;
+
+struct Pipeline;
+
+/* Function run by a pipeline stage on each job. Returns the next stage. */
+typedef PipelineStage (*StageFunction)(ImageJob*, struct Pipeline*);
+
+/* A single stage of the image pipeline with its own queue and threads for
+ * each placement group ('threads' counts those of all groups). Jobs are taken
+ * off a queue in order of their priority.
+ */
+typedef struct {
+    const char* name;
+    StageFunction function;
+    PriorityQueue* queues[MAX_NODES];
+    int threads;
+    struct Pipeline* pipeline;
+} Stage;
+
+/* Information for a single pipeline stage thread */
+typedef struct {
+    Stage* stage;
+    int group;
+} StageThread;
+
+/* The image pipeline: decode -> transform -> encode -> send. Each stage takes
+ * the job due first: a job is due once the time it would take to process its
+ * estimated cost (at AGING_PIXELS_PER_USEC) has passed since it entered the
+ * pipeline. Cheap jobs therefore overtake expensive ones, but an expensive job
+ * is only overtaken by jobs arriving within that time and can't be starved.
+ * Large images are transformed with the help of the TaskPool of the job's
+ * placement group (one of 'groups'). If enabled, encoded results are kept in
+ * the 'results' cache and decoded uploads in the 'decoded' cache (each NULL
+ * if disabled). Results are PNG encoded with the 'compression' flags unless a
+ * request asks for something else.
+ */
+typedef struct Pipeline {
+    Stage stages[STAGE_COUNT];
+    int groups;
+    ServerStats* stats;
+    TaskPool* tasks[MAX_NODES];
+    Cache* results;
+    Cache* decoded;
+    int compression;
+} Pipeline;
+
+/* Information shared by every thread of the fixed-size worker pool. Fully
+ * received requests are placed on the bounded request queue of their
+ * connection's placement group by the reactors and picked up by whichever
+ * worker of that group is free. Valid image requests are then passed on to
+ * the image pipeline, and the home page is served from memory. Requests must
+ * be answered within 'deadlineMs' milliseconds of being received (0 meaning
+ * no deadline) unless they ask for less.
+ */
+typedef struct {
+    WorkQueue* requestQueues[MAX_NODES];
+    Pipeline* pipeline;
+    ServerStats* stats;
+    HomePage* homePage;
+    int deadlineMs;
+} WorkerPool;
 
-/* Information for a single connection between the server and a specific client
+/* Information for a single worker pool thread */
+typedef struct {
+    WorkerPool* pool;
+    int group;
+} WorkerThread;
+
+/* Where the server's threads run. Threads are grouped by NUMA node: every
+ * group has its own request queue, pipeline stage queues and TaskPool, and
+ * the requests of a connection are handled by the group of the node it was
+ * accepted on ('groupOf' maps every node to a group). Unless worker or stage
+ * CPUs are given ('placed' is false) there is a single group whose threads
+ * run anywhere. Otherwise there is a group for each node with worker CPUs,
+ * whose workers run on its 'workerCpus' and whose stage and task threads run
+ * on its 'stageCpus' (the node's own stage CPUs, or all of them if it has
+ * none). Connections accepted on a node without workers go to group 0.
  */
 typedef struct {
-    int clientFd;
-    ServerStats* serverStats;
-} ClientData;
+    int count;
+    bool placed;
+    CpuSet workerCpus[MAX_NODES];
+    CpuSet stageCpus[MAX_NODES];
+    int groupOf[MAX_NODES];
+} Placement;
+/* Information for a single epoll reactor thread. Each of its connections may
+ * have up to 'pipelineDepth' requests in flight.
+ */
+typedef struct {
+    int epollFd;
+    int pipelineDepth;
+    WorkerPool* pool;
+    pthread_t thread;
+} Reactor;
+
+/* Information for a single accepting thread. Every listener has its own
+ * socket bound to the server's port with SO_REUSEPORT, so the kernel spreads
+ * new connections across them, and hands the connections it accepts to its
+ * own group of 'reactorCount' reactors in turn. If 'cpu' isn't -1 the
+ * listener and its reactors only run on that CPU. Connections are given to
+ * the placement group of the node they are accepted on.
+ */
+typedef struct {
+    int fd;
+    Reactor* reactors;
+    int reactorCount;
+    int cpu;
+    const Placement* placement;
+    ServerStats* stats;
+} Listener;
+
+/* Information for a single SIGHUP signal handling thread */
+typedef struct {
+    sigset_t set;
+    ServerStats* stats;
+    Pipeline* pipeline;
+} SignalThreadInfo;
 
 // Server Program Values
 typedef enum {
     MAX_CONNS = 10000,
     MIN_CONNS = 0,
     MAX_IMAGE_SIZE = 8388608,
-    MAX_CMD_ARG = 5,
+    MAX_CMD_ARG = 41,
+    MAX_WORKERS = 1024,
+    MAX_REACTORS = 64,
+    MAX_LISTENERS = 64,
+    MAX_PIPELINE_DEPTH = 64,
+    DEFAULT_PIPELINE_DEPTH = 8,
+    REQUEST_QUEUE_PER_WORKER = 4,
+    MAX_REQUEST_QUEUE = 65536,
+    STAGE_QUEUE_PER_THREAD = 4,
+    REACTOR_EVENTS = 64,
+    READ_CHUNK = 4096,
+    READ_BUDGET = 1048576,
+    MAX_DISCARD = 1048576,
+    RESPONSE_HEAD_SIZE = 1024,
+    MAX_NUMBER_SIZE = 24,
+    MAX_GATHER = 16,
+    DEFAULT_PARALLEL_PIXELS = 262144,
+    DEFAULT_BUFFER_POOL = 67108864,
+    AGING_PIXELS_PER_USEC = 8,
+    BODY_KEY_SIZE = 64,
     OP_ERROR_MSG_DEFAULT = 30,
     SIZE_ERROR_MSG_DEFAULT = 28
 } ServerValues;
@@ -58,23 +444,19 @@ typedef enum {
 // HTTP response statuses
 typedef enum {
     SUCCESS = 200,
+    NOT_MODIFIED = 304,
     BAD_METHOD = 405,
     BAD_GET = 404,
     BAD_POST = 400,
+    NOT_ACCEPTABLE = 406,
     IMAGE_TOO_LARGE = 413,
     BAD_IMAGE = 422,
-    OPERATION_ERROR = 501
+    SERVER_ERROR = 500,
+    OPERATION_ERROR = 501,
+    SERVICE_UNAVAILABLE = 503,
+    GATEWAY_TIMEOUT = 504
 } HttpStatus;
 
-// Server statistics values
-typedef enum {
-    CONNECT = 0,
-    DISCONNECT = 1,
-    HTTP_SUCCESS = 2,
-    HTTP_FAIL = 3,
-    OPERATE_IMAGE = 4
-} StatChange;
-
 // Program/Server exit codes
 typedef enum { USAGE_ERROR = 5, PORT_ERROR = 17 } ExitStatus;
 
@@ -84,14 +466,83 @@ const char* const finishedClientsMsg = "Num completed clients: %u\n";
 const char* const successHttpMsg = "Successfully processed HTTP requests: %u\n";
 const char* const failHttpMsg = "HTTP requests unsuccessful: %u\n";
 const char* const imageOperationMsg = "Operations on images completed: %u\n";
+const char* const stageDepthMsg = "Pipeline %s stage: %d threads, %u queued\n";
+const char* const cacheMsg = "%s cache: %lu hits, %lu misses, %lu evictions\n";
+const char* const bufferPoolMsg
+        = "Buffer pool: %lu reused, %lu allocated, %zu bytes kept\n";
+const char* const shedMsg = "Shed clients (%s): %lu\n";
+const char* const shedRequestMsg = "Shed requests (%s): %lu\n";
+const char* const cancelMsg = "Cancelled requests (%s): %lu\n";
+
+// Names of the latency histograms (indexed by Latency)
+const char* const latencyNames[LATENCY_COUNT] = {"queue_wait", "body_read",
+        "decode", "rotate", "flip", "scale", "encode", "write"};
+
+// Names of the allocation histograms (indexed by AllocCount)
+const char* const allocNames[ALLOC_COUNT] = {"arena", "heap"};
+
+// Names of the reasons for shedding a connection (indexed by ShedReason)
+const char* const shedNames[SHED_COUNT]
+        = {"connections", "queue", "pixel_work"};
+
+// Names of the reasons for cancelling a request (indexed by CancelReason)
+const char* const cancelNames[CANCEL_COUNT] = {"deadline", "client_gone"};
+
+// Names of the image job cost histograms (indexed by CostMeasure)
+const char* const costNames[COST_COUNT]
+        = {"estimated_pixels", "actual_us", "ns_per_pixel"};
+
+// Sent to a connection or request that is shed, which may try again after a
+// second
+const char* const overloadMessage = "Server is overloaded, try again later\n";
+const char* const retryAfterSeconds = "1";
+
+// Sent for a request that couldn't be answered before its deadline, which
+// may be given (in milliseconds) by this header
+const char* const deadlineMessage = "Request deadline exceeded\n";
+const char* const timeoutHeader = "X-Request-Timeout";
+
+// Names of the image pipeline stages
+const char* const stageNames[STAGE_COUNT]
+        = {"decode", "transform", "encode", "send"};
 
 // Command line option arguments
 const char* const portArg = "--port";
 const char* const connsArg = "--maxConns";
+const char* const workersArg = "--workers";
+const char* const reactorsArg = "--reactors";
+const char* const stageThreadsArg = "--stageThreads";
+const char* const parallelPixelsArg = "--parallelPixels";
+const char* const resultCacheArg = "--resultCache";
+const char* const decodeCacheArg = "--decodeCache";
+const char* const compressionArg = "--compression";
+const char* const bufferPoolArg = "--bufferPool";
+const char* const homePageArg = "--homePage";
+const char* const pipelineDepthArg = "--pipelineDepth";
+const char* const maxQueueArg = "--maxQueue";
+const char* const maxPixelWorkArg = "--maxPixelWork";
+const char* const deadlineArg = "--deadline";
+const char* const listenersArg = "--listeners";
+const char* const pinListenersArg = "--pinListeners";
+const char* const backlogArg = "--backlog";
+const char* const workerCpusArg = "--workerCpus";
+const char* const stageCpusArg = "--stageCpus";
+
+// Home page served unless --homePage is given
+const char* const defaultHomePage
+        = "/local/courses/csse2310/resources/a4/home.html";
 
 // Error message
 const char* const usageError
-        = "Usage: uqimageproc [--port portnum] [--maxConns num]\n";
+        = "Usage: uqimageproc [--port portnum] [--maxConns num] "
+          "[--workers num] [--reactors num] "
+          "[--stageThreads decode,transform,encode,send] "
+          "[--parallelPixels num] [--resultCache bytes] "
+          "[--decodeCache bytes] [--compression level] "
+          "[--bufferPool bytes] [--homePage path] [--pipelineDepth num] "
+          "[--maxQueue num] [--maxPixelWork pixels] [--deadline ms] "
+          "[--listeners num] [--pinListeners 0|1] [--backlog num] "
+          "[--workerCpus list] [--stageCpus list]\n";
 const char* const portError = "uqimageproc: unable to listen on port \"%s\"\n";
 
 /* usage_error()
@@ -137,51 +588,257 @@ void port_error(char* port, struct addrinfo* ai, int listenFd)
     exit(PORT_ERROR);
 }
 
+// Statistics shard of the calling thread (created on first use)
+__thread StatsShard* localShard = NULL;
+
+/* get_stats_shard()
+ *
+ * This function returns the calling thread's statistics shard, creating it and
+ * adding it to the server's list of shards the first time a thread records a
+ * statistic. This is the only time the shards lock is taken.
+ *
+ * stats: A pointer to an instance of the ServerStats struct
+ *
+ * Returns: A pointer to the calling thread's StatsShard.
+ */
+StatsShard* get_stats_shard(ServerStats* stats)
+{
+    if (localShard) {
+        return localShard;
+    }
+
+    void* memory = NULL;
+    posix_memalign(&memory, CACHE_LINE, sizeof(StatsShard));
+    localShard = memset(memory, 0, sizeof(StatsShard));
+
+    pthread_mutex_lock(&stats->shardsLock);
+    localShard->next = stats->shards;
+    __atomic_store_n(&stats->shards, localShard, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&stats->shardsLock);
+
+    return localShard;
+}
+
+/* add_stats()
+ *
+ * This function adds 'amount' to a server statistic and is multi-thread safe.
+ * Each thread only changes its own counters so no lock is taken and no cache
+ * line is shared with another thread.
+ *
+ * stats: A pointer to an instance of the ServerStats struct
+ * type: One of the StatChange enums. This describes the stat to be recorded.
+ * amount: The amount to add to the statistic.
+ */
+void add_stats(ServerStats* stats, StatChange type, unsigned long amount)
+{
+    StatsShard* shard = get_stats_shard(stats);
+
+    // Only this thread writes to the shard, so a plain addition published
+    // with a release store is enough for readers
+    __atomic_store_n(&shard->counts[type], shard->counts[type] + amount,
+            __ATOMIC_RELEASE);
+}
+
 /* change_stats
  *
- * This function changes the server statistics and is multi-thread safe using
- * semaphores.
+ * This function increments a server statistic by one and is multi-thread
+ * safe.
  *
  * stats: A pointer to an instance of the ServerStats struct
- * type: One of the StatChange enums. This describes the stat to be incremented
- *     or decremented.
+ * type: One of the StatChange enums. This describes the stat to be recorded.
  */
 void change_stats(ServerStats* stats, StatChange type)
 {
-    // Wait for semaphore
-    sem_wait(&stats->statsLock);
+    add_stats(stats, type, 1);
+}
+
+/* record_latency()
+ *
+ * This function records the time elapsed since 'start' in the histogram for
+ * the given latency.
+ *
+ * stats: A pointer to an instance of the ServerStats struct
+ * type: One of the Latency enums. This describes the latency being recorded.
+ * start: Monotonic time (from now_usec()) the measured period started at.
+ */
+void record_latency(ServerStats* stats, Latency type, unsigned long start)
+{
+    histogram_record(stats->latencies[type], now_usec() - start);
+}
+
+/* sum_stat()
+ *
+ * This function adds up the counter of a single statistic across every
+ * thread's shard.
+ *
+ * stats: A pointer to an instance of the ServerStats struct
+ * type: The statistic to be added up.
+ *
+ * Returns: The total count of the statistic.
+ */
+unsigned long sum_stat(ServerStats* stats, StatChange type)
+{
+    unsigned long total = 0;
+    StatsShard* shard = __atomic_load_n(&stats->shards, __ATOMIC_ACQUIRE);
+
+    for (; shard; shard = shard->next) {
+        total += __atomic_load_n(&shard->counts[type], __ATOMIC_ACQUIRE);
+    }
+
+    return total;
+}
+
+/* snapshot_stats()
+ *
+ * This function takes a consistent snapshot of the server statistics.
+ * Disconnections are added up before connections: every disconnection counted
+ * happened after its connection was recorded, so that connection is always
+ * counted too and the number of current clients can never be negative.
+ *
+ * stats: A pointer to an instance of the ServerStats struct
+ *
+ * Returns: A snapshot of the statistics.
+ */
+StatsSnapshot snapshot_stats(ServerStats* stats)
+{
+    StatsSnapshot snapshot;
+
+    unsigned long disconnects = sum_stat(stats, DISCONNECT);
+    unsigned long connects = sum_stat(stats, CONNECT);
+    snapshot.currentClients = connects - disconnects;
+    snapshot.totalClients = disconnects;
+    snapshot.successRequests = sum_stat(stats, HTTP_SUCCESS);
+    snapshot.failRequests = sum_stat(stats, HTTP_FAIL);
+    snapshot.completedOperations = sum_stat(stats, OPERATE_IMAGE);
+    snapshot.bytesIn = sum_stat(stats, BYTES_IN);
+    snapshot.bytesOut = sum_stat(stats, BYTES_OUT);
+
+    return snapshot;
+}
+
+/* parse_number_option()
+ *
+ * This function converts the value of a numeric command line option and checks
+ * that it lies within the range [min, max].
+ *
+ * value: The value string following the option specifier.
+ * min: Minimum allowed value.
+ * max: Maximum allowed value.
+ *
+ * Returns: The integer representation of 'value'.
+ * Errors: If 'value' is not a number or is out of range the program exits by
+ *     calling the usage_error() function.
+ */
+int parse_number_option(char* value, int min, int max)
+{
+    if (is_empty(value) || !is_number(value)) {
+        usage_error();
+    }
+
+    int number = atoi(value);
+    if (number < min || number > max) {
+        usage_error();
+    }
+
+    return number;
+}
+
+/* parse_stage_threads()
+ *
+ * This function parses the value of the --stageThreads option, which is a
+ * comma separated list with one positive thread count for each pipeline
+ * stage.
+ *
+ * value: The value string following the option specifier.
+ * threads: Array (indexed by PipelineStage) to store the thread counts in.
+ *
+ * Errors: If 'value' doesn't contain exactly one valid count per stage the
+ *     program exits by calling the usage_error() function.
+ */
+void parse_stage_threads(char* value, int* threads)
+{
+    char* valueCopy = strdup(value);
+    char** counts = split_by_char(valueCopy, ',', 0);
+
+    int i;
+    for (i = 0; i < STAGE_COUNT; i++) {
+        if (counts[i] == NULL) {
+            usage_error();
+        }
+        threads[i] = parse_number_option(counts[i], 1, MAX_WORKERS);
+    }
+    if (counts[i] != NULL) {
+        usage_error();
+    }
+
+    free(counts);
+    free(valueCopy);
+}
+
+/* online_cpus()
+ *
+ * This function finds how many CPUs are online, which is the default number of
+ * threads for the worker pool and the size of the shared TaskPool.
+ *
+ * Returns: The number of online CPUs (between 1 and MAX_WORKERS).
+ */
+int online_cpus(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
 
-    // Increment / Decrement appropriate stats counter
-    switch (type) {
-    case CONNECT: // When new client connects
-        stats->currentClients++;
-        break;
-    case DISCONNECT: // When a client disconnects
-        stats->totalClients++;
-        stats->currentClients--;
-        break;
-    case HTTP_SUCCESS: // When a successful http response is sent
-        stats->successRequests++;
-        break;
-    case HTTP_FAIL: // When a fail http rseponse is sent
-        stats->failRequests++;
-        break;
-    case OPERATE_IMAGE: // Each time the server operates on an image
-        stats->completedOperations++;
+    return (cpus < 1) ? 1 : (cpus > MAX_WORKERS) ? MAX_WORKERS : (int)cpus;
+}
+
+/* parse_cpus_option()
+ *
+ * This function reads the value of a CPU list command line option (e.g.
+ * "0-3,8"). CPUs the process isn't allowed to run on are left out.
+ *
+ * value: The value of the option.
+ * cpus: Used to return the CpuSet.
+ *
+ * Errors: If the list is invalid or names none of the allowed CPUs the
+ *     program exits by calling the usage_error() function.
+ */
+void parse_cpus_option(char* value, CpuSet* cpus)
+{
+    CpuSet allowed;
+    allowed_cpus(&allowed);
+    if (!parse_cpu_list(value, cpus) || strchr(value, '\n')) {
+        usage_error();
     }
 
-    // Post semaphore
-    sem_post(&stats->statsLock);
+    // Only keep the allowed CPUs (if those can be found)
+    if (cpuset_count(&allowed)) {
+        for (unsigned i = 0; i < CPU_SET_WORDS; i++) {
+            cpus->words[i] &= allowed.words[i];
+        }
+    }
+    if (!cpuset_count(cpus)) {
+        usage_error();
+    }
 }
 
 /* process_command_line()
  *
  * This function processes and checks the command line arguments. Here are the
  * checks that happen:
- * 1. The command line specifiers are either --port or --maxConns.
+ * 1. The command line specifiers are one of --port, --maxConns, --workers,
+ *    --reactors, --stageThreads, --parallelPixels, --resultCache,
+ *    --decodeCache, --compression, --bufferPool, --homePage,
+ *    --pipelineDepth, --maxQueue, --maxPixelWork, --deadline, --listeners,
+ *    --pinListeners, --backlog, --workerCpus or --stageCpus.
  * 2. The command line specifiers are followed by a non-empty value.
  * 3. The following value for the --maxConns specifier is a non-negative
- *    integer value.
+ *    integer value, the values for --workers and --reactors are positive
+ *    integer values, --stageThreads has one positive value per stage,
+ *    --pipelineDepth is between 1 and MAX_PIPELINE_DEPTH, --listeners is
+ *    between 1 and MAX_LISTENERS, --pinListeners is 0 or 1,
+ *    --parallelPixels, --resultCache, --decodeCache, --bufferPool,
+ *    --maxQueue, --maxPixelWork, --deadline and --backlog are non-negative
+ *    integer values, --compression is a PNG compression level (see
+ *    parse_png_level()) and --workerCpus and --stageCpus are lists of
+ *    allowed CPUs (see parse_cpus_option()).
  * 4. There are no duplicate specifiers
  *
  * argc: Number of command line arguments
@@ -193,35 +850,153 @@ void change_stats(ServerStats* stats, StatChange type)
  */
 ServerInfo process_command_line(int argc, char** argv)
 {
-    // Check argc < 6
+    // Check argc < 42
     if (argc > MAX_CMD_ARG) {
         usage_error();
     }
 
     // Create serverinfo struct instance
-    ServerInfo server = {NULL, -1};
+    ServerInfo server = {NULL, -1, -1, -1, {0}, -1, -1, -1, -1, -1, NULL, -1,
+            -1, -1, -1, -1, -1, -1, {{0}}, {{0}}};
 
     // Loop over each command line argument
     for (int i = 1; i < argc; i++) {
-        // Port Argument
-        if (!server.port && !strcmp(argv[i], portArg) && (i + 1 < argc)
-                && !is_empty(argv[i + 1])) {
+        // Every specifier must be followed by a non-empty value
+        if (i + 1 >= argc || is_empty(argv[i + 1])) {
+            usage_error();
+        }
+
+        if (!server.port && !strcmp(argv[i], portArg)) { // Port Argument
             server.port = argv[i + 1];
-            // MaxConns Argument
-        } else if (server.maxConns == -1 && !strcmp(argv[i], connsArg)
-                && (i + 1 < argc) && !is_empty(argv[i + 1])) {
+        } else if (server.maxConns == -1 && !strcmp(argv[i], connsArg)) {
             int conns = atoi(argv[i + 1]);
             if (conns > MAX_CONNS || conns < MIN_CONNS) {
                 usage_error();
-            } else { // Error!
-                server.maxConns = conns;
             }
+            server.maxConns = conns;
+        } else if (server.workers == -1 && !strcmp(argv[i], workersArg)) {
+            server.workers = parse_number_option(argv[i + 1], 1, MAX_WORKERS);
+        } else if (server.reactors == -1 && !strcmp(argv[i], reactorsArg)) {
+            server.reactors
+                    = parse_number_option(argv[i + 1], 1, MAX_REACTORS);
+        } else if (!server.stageThreads[0]
+                && !strcmp(argv[i], stageThreadsArg)) {
+            parse_stage_threads(argv[i + 1], server.stageThreads);
+        } else if (server.parallelPixels == -1
+                && !strcmp(argv[i], parallelPixelsArg)) {
+            server.parallelPixels
+                    = parse_number_option(argv[i + 1], 0, INT_MAX);
+        } else if (server.resultCacheBytes == -1
+                && !strcmp(argv[i], resultCacheArg)) {
+            server.resultCacheBytes
+                    = parse_number_option(argv[i + 1], 0, INT_MAX);
+        } else if (server.decodeCacheBytes == -1
+                && !strcmp(argv[i], decodeCacheArg)) {
+            server.decodeCacheBytes
+                    = parse_number_option(argv[i + 1], 0, INT_MAX);
+        } else if (server.compression == -1
+                && !strcmp(argv[i], compressionArg)) {
+            server.compression = parse_png_level(argv[i + 1]);
+            if (server.compression == -1) {
+                usage_error();
+            }
+        } else if (server.bufferPoolBytes == -1
+                && !strcmp(argv[i], bufferPoolArg)) {
+            server.bufferPoolBytes
+                    = parse_number_option(argv[i + 1], 0, INT_MAX);
+        } else if (!server.homePage && !strcmp(argv[i], homePageArg)) {
+            server.homePage = argv[i + 1];
+        } else if (server.pipelineDepth == -1
+                && !strcmp(argv[i], pipelineDepthArg)) {
+            server.pipelineDepth
+                    = parse_number_option(argv[i + 1], 1, MAX_PIPELINE_DEPTH);
+        } else if (server.maxQueue == -1 && !strcmp(argv[i], maxQueueArg)) {
+            server.maxQueue = parse_number_option(argv[i + 1], 0, INT_MAX);
+        } else if (server.maxPixelWork == -1
+                && !strcmp(argv[i], maxPixelWorkArg)) {
+            server.maxPixelWork
+                    = parse_number_option(argv[i + 1], 0, INT_MAX);
+        } else if (server.deadlineMs == -1 && !strcmp(argv[i], deadlineArg)) {
+            server.deadlineMs = parse_number_option(argv[i + 1], 0, INT_MAX);
+        } else if (server.listeners == -1 && !strcmp(argv[i], listenersArg)) {
+            server.listeners
+                    = parse_number_option(argv[i + 1], 1, MAX_LISTENERS);
+        } else if (server.pinListeners == -1
+                && !strcmp(argv[i], pinListenersArg)) {
+            server.pinListeners = parse_number_option(argv[i + 1], 0, 1);
+        } else if (server.backlog == -1 && !strcmp(argv[i], backlogArg)) {
+            server.backlog = parse_number_option(argv[i + 1], 0, INT_MAX);
+        } else if (!cpuset_count(&server.workerCpus)
+                && !strcmp(argv[i], workerCpusArg)) {
+            parse_cpus_option(argv[i + 1], &server.workerCpus);
+        } else if (!cpuset_count(&server.stageCpus)
+                && !strcmp(argv[i], stageCpusArg)) {
+            parse_cpus_option(argv[i + 1], &server.stageCpus);
         } else { // Error!
             usage_error();
         }
         i++;
     }
 
+    // Default to one worker per online CPU
+    if (server.workers == -1) {
+        server.workers = online_cpus();
+    }
+    if (server.listeners == -1) {
+        server.listeners = 1;
+    }
+    // Default to one reactor per listener
+    if (server.reactors == -1) {
+        server.reactors = server.listeners;
+    }
+    if (!server.stageThreads[0]) {
+        for (int i = 0; i < STAGE_COUNT; i++) {
+            server.stageThreads[i] = server.workers;
+        }
+    }
+    if (server.parallelPixels == -1) {
+        server.parallelPixels = DEFAULT_PARALLEL_PIXELS;
+    }
+    if (server.resultCacheBytes == -1) {
+        server.resultCacheBytes = 0;
+    }
+    if (server.decodeCacheBytes == -1) {
+        server.decodeCacheBytes = 0;
+    }
+    if (server.compression == -1) {
+        server.compression = PNG_DEFAULT;
+    }
+    if (server.bufferPoolBytes == -1) {
+        server.bufferPoolBytes = DEFAULT_BUFFER_POOL;
+    }
+    if (!server.homePage) {
+        server.homePage = (char*)defaultHomePage;
+    }
+    if (server.pipelineDepth == -1) {
+        server.pipelineDepth = DEFAULT_PIPELINE_DEPTH;
+    }
+    // Default to as many pending requests as the request and stage queues
+    // hold, plus one being worked on by each of their threads
+    if (server.maxQueue == -1) {
+        server.maxQueue = server.workers * (REQUEST_QUEUE_PER_WORKER + 1);
+        for (int i = 0; i < STAGE_COUNT; i++) {
+            server.maxQueue
+                    += server.stageThreads[i] * (STAGE_QUEUE_PER_THREAD + 1);
+        }
+    }
+    if (server.maxPixelWork == -1) {
+        server.maxPixelWork = 0;
+    }
+    if (server.deadlineMs == -1) {
+        server.deadlineMs = 0;
+    }
+    if (server.pinListeners == -1) {
+        server.pinListeners = 0;
+    }
+    if (server.backlog == -1) {
+        server.backlog = SOMAXCONN;
+    }
+
     return server;
 }
 
@@ -247,12 +1022,16 @@ void get_port_num(int listenFd)
 /* check_port()
  *
  * When this function is called the server will attempt to listen to the 'port'
- * number specified within the given ServerInfo struct.
+ * number specified within the given ServerInfo struct on 'listeners' sockets,
+ * each queueing up to 'backlog' connections that are yet to be accepted. If
+ * there is more than one listener every socket is bound with SO_REUSEPORT:
+ * the first to the requested port and the others to the port it was given
+ * (which is only known then for an ephemeral port).
  *
  * server: An instance of the ServerInfo struct.
  *
- * Returns: When port is successfully opened for listening the server socket
- *     file descriptor will be returned
+ * Returns: When port is successfully opened for listening an array of the
+ *     'listeners' server socket file descriptors will be returned
  * Errors: If for some reason the socket cannot be created, the given port
  *     within the command line is invalid, a socket could not be bound to
  *     an address or a socket cannot be listened on, the server will shut down
@@ -261,7 +1040,7 @@ void get_port_num(int listenFd)
  * REF: This function is inspired by server-multithreaded.c given during week 10
  * REF: lectures.
  */
-int check_port(ServerInfo server)
+int* check_port(ServerInfo server)
 {
     char* port;
 
@@ -282,765 +1061,2588 @@ int check_port(ServerInfo server)
         port_error(port, ai, -1);
     }
 
-    // Try creating socket -> Binding to a port -> Listen to a port
-    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (listenfd < 0) {
-        port_error(port, ai, listenfd);
-    }
+    int* listenFds = malloc(sizeof(int) * server.listeners);
+    for (int i = 0; i < server.listeners; i++) {
+        // Try creating socket -> Binding to a port -> Listen to a port
+        int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+        if (listenfd < 0) {
+            port_error(port, ai, listenfd);
+        }
 
-    int optVal = 1;
-    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optVal, sizeof(int))
-            < 0) {
-        port_error(port, ai, listenfd);
-    }
-    if (bind(listenfd, ai->ai_addr, sizeof(struct sockaddr)) < 0) {
-        port_error(port, ai, listenfd);
-    }
+        int optVal = 1;
+        if (setsockopt(
+                    listenfd, SOL_SOCKET, SO_REUSEADDR, &optVal, sizeof(int))
+                < 0) {
+            port_error(port, ai, listenfd);
+        }
+        if (server.listeners > 1
+                && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optVal,
+                           sizeof(int))
+                        < 0) {
+            port_error(port, ai, listenfd);
+        }
+        if (bind(listenfd, ai->ai_addr, sizeof(struct sockaddr)) < 0) {
+            port_error(port, ai, listenfd);
+        }
+
+        if (listen(listenfd, server.backlog) < 0) { // Listen
+            port_error(port, ai, listenfd);
+        }
 
-    if (listen(listenfd, 0) < 0) { // Listen
-        port_error(port, ai, listenfd);
+        // The other listeners share the port the first was given
+        socklen_t len = ai->ai_addrlen;
+        if (!i && getsockname(listenfd, ai->ai_addr, &len) < 0) {
+            port_error(port, ai, listenfd);
+        }
+        listenFds[i] = listenfd;
     }
 
     // Print port number
-    get_port_num(listenfd);
+    get_port_num(listenFds[0]);
     freeaddrinfo(ai);
 
-    return listenfd;
+    return listenFds;
 }
 
-/* read_home_page()
+/* set_nonblocking()
  *
- * This function reads the home page body that needs to be returned for a
- * valid GET HTTP request.
+ * This function puts the given file descriptor into non-blocking mode.
  *
- * Returns: The body of HTML file.
+ * fd: File descriptor to be changed.
  */
-char* read_home_page(void)
+void set_nonblocking(int fd)
 {
-    char* homePage = NULL;
-    FILE* file = fopen("/local/courses/csse2310/resources/a4/home.html", "r");
-    char nextChar;
-    int count = 0;
-
-    while ((nextChar = fgetc(file)) != EOF) {
-        homePage = realloc(homePage, sizeof(char) * (count + 1));
-        homePage[count++] = nextChar;
-    }
-
-    // Add null character
-    homePage = realloc(homePage, sizeof(char) * (count + 1));
-    homePage[count] = '\0';
-
-    // Close file stream
-    fclose(file);
-
-    return homePage;
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
-/* send_http_response()
+/* release_connection()
  *
- * This function builds a http response and sends it to a client.
+ * This function drops one reference to a connection. When the last reference
+ * is dropped the socket is closed and all memory belonging to the connection
+ * is freed. The socket is only closed here (rather than in close_connection())
+ * so its descriptor can't be reused while another thread still refers to it.
  *
- * fd: Socket file descriptor for an accepted connection.
- * status: Status for HTTP response
- * statusExplanation: Explanation for HTTP response
- * headers: Headers for the HTTP response.
- * body: Body for HTTP response.
- * bodySize: Size of Body for the HTTP response
+ * conn: A pointer to an instance of the Connection struct.
  */
-void send_http_response(int fd, int status, const char* statusExplanation,
-        HttpHeader** headers, const unsigned char* body, unsigned long bodySize)
+void release_connection(Connection* conn)
 {
-    // Create HTTP response
-    unsigned long responseLen;
-    unsigned char* response = construct_HTTP_response(
-            status, statusExplanation, headers, body, bodySize, &responseLen);
+    pthread_mutex_lock(&conn->lock);
+    int refCount = --conn->refCount;
+    pthread_mutex_unlock(&conn->lock);
 
-    // Send HTTP response
-    write(fd, response, responseLen);
-    free(response);
-    free_array_of_headers(headers);
+    if (refCount) {
+        return;
+    }
+
+    close(conn->fd);
+    buffer_free(conn->inBuf);
+    pthread_mutex_destroy(&conn->lock);
+    free(conn);
 }
 
-/* create_header()
- *
- * This function creates the headers array which includes only one
- * "Content-Type" header.
+/* update_interest()
  *
- * typeValue: The value for the Content-Type header.
+ * This function recalculates which epoll events the reactor needs for a
+ * connection. Reading is paused while as many requests as allowed are being
+ * processed, and writability is watched while output is pending or when
+ * another thread has asked the reactor to look at the connection again. Must
+ * be called with the connection locked.
  *
- * Returns: An array of HttpHeader pointers. (Only one instance of HttpHeader
- *     will be included which is "Content-Type").
+ * conn: A pointer to an instance of the Connection struct.
  */
-HttpHeader** create_header(char* typeValue)
+void update_interest(Connection* conn)
 {
-    char* typeName = "Content-Type";
-
-    // Create single HttpHeader instance
-    HttpHeader* type = malloc(1 * sizeof(HttpHeader));
-    type->name = strdup(typeName);
-    type->value = strdup(typeValue);
+    if (conn->closed) {
+        return;
+    }
 
-    // Add single instance to array of instances
-    HttpHeader** headers = malloc(sizeof(HttpHeader*) * 2);
-    headers[0] = type;
-    headers[1] = NULL;
+    uint32_t events = 0;
+    if (conn->inFlight < conn->maxInFlight && !conn->peerClosed) {
+        events |= EPOLLIN;
+    }
+    if (conn->outHead || conn->wake || conn->failed) {
+        events |= EPOLLOUT;
+    }
 
-    return headers;
+    if (events != conn->events) {
+        struct epoll_event event;
+        event.events = events;
+        event.data.ptr = conn;
+        epoll_ctl(conn->epollFd, EPOLL_CTL_MOD, conn->fd, &event);
+        conn->events = events;
+    }
 }
 
-/* check_method()
- *
- * This function checks whether the given HTTP request's method is either a
- * POST or GET. If 'method' is neither then an error HTTP response will be sent
- * to the client.
+/* free_chunk()
  *
- * fd: Socket file descriptor for an accepted connection.
- * method: Method of HTTP request.
- * stats: A pointer to an instance of the ServerStats struct.
+ * This function frees a response that has been written or discarded, giving
+ * its body back to whatever produced it.
  *
- * Returns: If the given HTTP request's method was valid then 0 is returned.
- *     Otherwise 1.
+ * chunk: A pointer to the OutputChunk.
  */
-int check_method(int fd, char* method, ServerStats* stats)
+void free_chunk(OutputChunk* chunk)
 {
-    if (strcmp(method, "POST") && strcmp(method, "GET")) {
-        // Construct HTTP response
-        char* message = "Invalid method on request list\n";
-        int messageLen = strlen(message);
-        const char* explanation = "Method Not Allowed";
-        HttpHeader** headers = create_header("text/plain");
-
-        // Send HTTP response and change stats
-        send_http_response(fd, BAD_METHOD, explanation, headers,
-                (unsigned char*)message, messageLen);
-        change_stats(stats, HTTP_FAIL);
-
-        return 1;
+    if (chunk->release) {
+        chunk->release(chunk->owner, chunk->data);
     }
-
-    return 0;
+    free(chunk);
 }
 
-/* check_get_request()
- *
- * If the HTTP request received is a GET method then this function will check
- * if the given address is correct ('/' and nothing else). If a the GET HTTP
- * request is valid then a success HTTP response will be sent to the client
- * with the body being the home page HTML. Otherwise an error HTTP response will
- * be sent to the client.
+/* close_connection()
  *
- * fd: Socket file descriptor for an accepted connection.
- * method: Method of HTTP request.
- * address: Address of the HTTP request.
- * stats: A pointer to an instance of the ServerStats struct.
+ * This function stops watching a connection, shuts its socket down and
+ * discards any pending input and output. Work still being done for its
+ * requests is cancelled as nobody is left to answer. The server statistics
+ * and connection limit are updated as the client is now disconnected. Must be
+ * called with the connection locked and only from the connection's reactor
+ * thread.
  *
- * Returns: If the given HTTP request was a valid GET HTTP request then 0 is
- *     returned. Otherwise 1.
+ * conn: A pointer to an instance of the Connection struct.
  */
-int check_get_request(int fd, char* method, char* address, ServerStats* stats)
+void close_connection(Connection* conn)
 {
+    conn->closed = true;
+    __atomic_store_n(&conn->cancelled, true, __ATOMIC_RELAXED);
+    epoll_ctl(conn->epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+    shutdown(conn->fd, SHUT_RDWR);
+
+    // Discard pending and held output and any partially received request
+    while (conn->outHead) {
+        OutputChunk* chunk = conn->outHead;
+        conn->outHead = chunk->next;
+        free_chunk(chunk);
+    }
+    conn->outTail = NULL;
+    while (conn->held) {
+        OutputChunk* chunk = conn->held;
+        conn->held = chunk->next;
+        free_chunk(chunk);
+    }
+    http_parser_reset(&conn->parser);
+
+    // A shed connection was never counted as a client
+    if (!conn->shed) {
+        change_stats(conn->stats, DISCONNECT);
+        __atomic_sub_fetch(&conn->stats->admitted, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* chunk_iov()
+ *
+ * This function describes the part of a response that is still to be written.
+ *
+ * chunk: A pointer to the OutputChunk.
+ * iov: Array of (at least) two iovecs to fill in.
+ *
+ * Returns: The number of iovecs used.
+ */
+int chunk_iov(OutputChunk* chunk, struct iovec* iov)
+{
+    int count = 0;
+
+    if (chunk->sent < chunk->headLen) {
+        iov[count].iov_base = chunk->head + chunk->sent;
+        iov[count++].iov_len = chunk->headLen - chunk->sent;
+    }
+    size_t bodySent = (chunk->sent > chunk->headLen)
+            ? chunk->sent - chunk->headLen
+            : 0;
+    if (bodySent < chunk->bodyLen) {
+        iov[count].iov_base = (void*)(chunk->body + bodySent);
+        iov[count++].iov_len = chunk->bodyLen - bodySent;
+    }
+
+    return count;
+}
+
+/* connection_gone()
+ *
+ * This function is called once there is evidence that a connection's client
+ * has really gone: an error on its socket or a reset (not just the client
+ * finishing sending, which a client that still wants its responses does
+ * too). Work still being done for its requests is cancelled straight away,
+ * as nobody is left to answer, and the connection is closed by its reactor.
+ * Must be called with the connection locked.
+ *
+ * conn: A pointer to an instance of the Connection struct.
+ */
+void connection_gone(Connection* conn)
+{
+    conn->failed = true;
+    __atomic_store_n(&conn->cancelled, true, __ATOMIC_RELAXED);
+}
+
+/* flush_output()
+ *
+ * This function writes as much pending output to the connection's socket as
+ * it will currently accept. The headers and bodies of up to MAX_GATHER queued
+ * responses are gathered into each sendmsg() (with MSG_MORE if more are
+ * queued behind them), and short writes are picked up where they left off.
+ * The time taken to write each response (from when it was queued) is
+ * recorded. Must be called with the connection locked.
+ *
+ * conn: A pointer to an instance of the Connection struct.
+ */
+void flush_output(Connection* conn)
+{
+    while (conn->outHead && !conn->failed) {
+        struct iovec iov[MAX_GATHER * 2];
+        struct msghdr msg = {0};
+        OutputChunk* chunk = conn->outHead;
+        for (int i = 0; chunk && i < MAX_GATHER; i++, chunk = chunk->next) {
+            msg.msg_iovlen += chunk_iov(chunk, iov + msg.msg_iovlen);
+        }
+        msg.msg_iov = iov;
+
+        ssize_t written = sendmsg(
+                conn->fd, &msg, MSG_NOSIGNAL | (chunk ? MSG_MORE : 0));
+        if (written < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                connection_gone(conn);
+            }
+            if (errno != EINTR) {
+                return;
+            }
+            continue;
+        }
+        add_stats(conn->stats, BYTES_OUT, written);
+
+        // Retire the responses that are now complete
+        size_t left = written;
+        while (left) {
+            chunk = conn->outHead;
+            size_t unsent = chunk->headLen + chunk->bodyLen - chunk->sent;
+            if (left < unsent) {
+                chunk->sent += left;
+                break;
+            }
+            left -= unsent;
+            record_latency(conn->stats, WRITE_TIME, chunk->queuedAt);
+            conn->outHead = chunk->next;
+            if (!conn->outHead) {
+                conn->outTail = NULL;
+            }
+            free_chunk(chunk);
+        }
+    }
+}
+
+/* append_output()
+ *
+ * This function adds a response to the end of the connection's pending
+ * output. A response with nothing in it (standing in for a request that was
+ * never answered) is simply freed. Must be called with the connection locked.
+ *
+ * conn: A pointer to an instance of the Connection struct.
+ * chunk: The response to append (ownership is taken).
+ */
+void append_output(Connection* conn, OutputChunk* chunk)
+{
+    if (!chunk->headLen && !chunk->bodyLen) {
+        free_chunk(chunk);
+        return;
+    }
+
+    chunk->sent = 0;
+    chunk->queuedAt = now_usec();
+    chunk->next = NULL;
+    if (conn->outTail) {
+        conn->outTail->next = chunk;
+    } else {
+        conn->outHead = chunk;
+    }
+    conn->outTail = chunk;
+}
+
+/* hold_output()
+ *
+ * This function puts a response that is ready before the responses to
+ * earlier requests into the connection's reorder buffer, which is kept in
+ * sequence order. Must be called with the connection locked.
+ *
+ * conn: A pointer to an instance of the Connection struct.
+ * chunk: The response to hold (ownership is taken).
+ */
+void hold_output(Connection* conn, OutputChunk* chunk)
+{
+    OutputChunk** link = &conn->held;
+
+    while (*link && (*link)->seq < chunk->seq) {
+        link = &(*link)->next;
+    }
+    chunk->next = *link;
+    *link = chunk;
+}
+
+/* queue_output()
+ *
+ * This function queues the response to a request on its connection. If the
+ * responses to all earlier requests have been queued the response (and any
+ * held responses that follow on from it) is appended to the connection's
+ * output and written as far as the socket will take it; the reactor is
+ * asked to finish the write once the socket becomes writable. Otherwise the
+ * response is held until its turn comes. If the connection has already
+ * failed or closed the response is discarded.
+ *
+ * request: A pointer to the ClientRequest being answered.
+ * chunk: The response to send (ownership is taken).
+ */
+void queue_output(ClientRequest* request, OutputChunk* chunk)
+{
+    Connection* conn = request->conn;
+
+    request->responded = true;
+    chunk->seq = request->seq;
+    pthread_mutex_lock(&conn->lock);
+    if (conn->closed || conn->failed) {
+        pthread_mutex_unlock(&conn->lock);
+        free_chunk(chunk);
+        return;
+    }
+
+    if (chunk->seq != conn->sendSeq) {
+        hold_output(conn, chunk);
+        pthread_mutex_unlock(&conn->lock);
+        return;
+    }
+    append_output(conn, chunk);
+    conn->sendSeq++;
+    while (conn->held && conn->held->seq == conn->sendSeq) {
+        chunk = conn->held;
+        conn->held = chunk->next;
+        append_output(conn, chunk);
+        conn->sendSeq++;
+    }
+
+    flush_output(conn);
+    update_interest(conn);
+    pthread_mutex_unlock(&conn->lock);
+}
+
+/* format_response_head()
+ *
+ * This function writes the status line and headers of a HTTP response
+ * (including its Content-Length, unless it is a Not Modified response, which
+ * has no body) into 'buffer'. RESPONSE_HEAD_SIZE is ample for the headers the
+ * server sends.
+ *
+ * buffer: Buffer of RESPONSE_HEAD_SIZE bytes.
+ * status: Status for HTTP response
+ * statusExplanation: Explanation for HTTP response
+ * headers: Headers for the HTTP response.
+ * bodySize: Size of Body for the HTTP response
+ *
+ * Returns: The length of the head.
+ */
+size_t format_response_head(char* buffer, int status,
+        const char* statusExplanation, HttpHeader** headers,
+        unsigned long bodySize)
+{
+    int len = snprintf(buffer, RESPONSE_HEAD_SIZE, "HTTP/1.1 %d %s\r\n",
+            status, statusExplanation);
+    for (int i = 0; headers && headers[i] && len < RESPONSE_HEAD_SIZE; i++) {
+        len += snprintf(buffer + len, RESPONSE_HEAD_SIZE - len, "%s: %s\r\n",
+                headers[i]->name, headers[i]->value);
+    }
+    if (len < RESPONSE_HEAD_SIZE && status == NOT_MODIFIED) {
+        len += snprintf(buffer + len, RESPONSE_HEAD_SIZE - len, "\r\n");
+    } else if (len < RESPONSE_HEAD_SIZE) {
+        len += snprintf(buffer + len, RESPONSE_HEAD_SIZE - len,
+                "Content-Length: %lu\r\n\r\n", bodySize);
+    }
+
+    return (len < RESPONSE_HEAD_SIZE) ? len : RESPONSE_HEAD_SIZE - 1;
+}
+
+/* send_http_response()
+ *
+ * This function builds a http response and sends it to a client. The body is
+ * copied along with the headers, so this is meant for small bodies. The
+ * response is written straight away if the socket can take it, otherwise the
+ * reactor finishes writing it once the socket becomes writable.
+ *
+ * request: A pointer to the ClientRequest being answered.
+ * status: Status for HTTP response
+ * statusExplanation: Explanation for HTTP response
+ * headers: Headers for the HTTP response.
+ * body: Body for HTTP response.
+ * bodySize: Size of Body for the HTTP response
+ */
+void send_http_response(ClientRequest* request, int status,
+        const char* statusExplanation, HttpHeader** headers,
+        const unsigned char* body, unsigned long bodySize)
+{
+    char head[RESPONSE_HEAD_SIZE];
+    size_t headLen = format_response_head(
+            head, status, statusExplanation, headers, bodySize);
+
+    OutputChunk* chunk = calloc(1, sizeof(OutputChunk) + headLen + bodySize);
+    memcpy(chunk->head, head, headLen);
+    if (bodySize) {
+        memcpy(chunk->head + headLen, body, bodySize);
+    }
+    chunk->headLen = headLen + bodySize;
+
+    // Queue HTTP response on the connection (which takes ownership)
+    queue_output(request, chunk);
+}
+
+/* send_body_response()
+ *
+ * This function sends a http response whose body is written to the client
+ * straight from where it is, without being copied. Once the body has been
+ * written (or the response discarded) release(owner, data) is called.
+ *
+ * request: A pointer to the ClientRequest being answered.
+ * status: Status for HTTP response
+ * statusExplanation: Explanation for HTTP response
+ * headers: Headers for the HTTP response.
+ * body: Body for HTTP response.
+ * bodySize: Size of Body for the HTTP response
+ * release: Function giving the body back.
+ * owner: First argument for 'release'.
+ * data: Second argument for 'release'.
+ */
+void send_body_response(ClientRequest* request, int status,
+        const char* statusExplanation, HttpHeader** headers,
+        const unsigned char* body, unsigned long bodySize,
+        ReleaseFunction release, void* owner, void* data)
+{
+    char head[RESPONSE_HEAD_SIZE];
+    size_t headLen = format_response_head(
+            head, status, statusExplanation, headers, bodySize);
+
+    OutputChunk* chunk = calloc(1, sizeof(OutputChunk) + headLen);
+    memcpy(chunk->head, head, headLen);
+    chunk->headLen = headLen;
+    chunk->body = body;
+    chunk->bodyLen = bodySize;
+    chunk->release = release;
+    chunk->owner = owner;
+    chunk->data = data;
+
+    queue_output(request, chunk);
+}
+
+/* free_output()
+ *
+ * This function frees the encoded image that was the body of a response once
+ * it has been sent.
+ *
+ * owner: Unused.
+ * data: Expected to be a pointer to the EncodedImage.
+ */
+void free_output(void* owner __attribute__((unused)), void* data)
+{
+    free_encoded_image(data);
+}
+
+/* release_result()
+ *
+ * This function gives back the result cache entry whose value was the body of
+ * a response once it has been sent.
+ *
+ * owner: Expected to be a pointer to the result Cache.
+ * data: Expected to be a pointer to the CacheEntry.
+ */
+void release_result(void* owner, void* data)
+{
+    cache_release((Cache*)owner, (CacheEntry*)data);
+}
+
+/* create_header()
+ *
+ * This function creates the headers array which includes only one
+ * "Content-Type" header. The headers are allocated from the request's arena
+ * so they are freed along with the request.
+ *
+ * request: A pointer to the ClientRequest being answered.
+ * typeValue: The value for the Content-Type header.
+ *
+ * Returns: An array of HttpHeader pointers. (Only one instance of HttpHeader
+ *     will be included which is "Content-Type").
+ */
+HttpHeader** create_header(ClientRequest* request, const char* typeValue)
+{
+    Arena* arena = &request->http.arena;
+
+    // Create single HttpHeader instance
+    HttpHeader* type = arena_alloc(arena, sizeof(HttpHeader));
+    type->name = "Content-Type";
+    type->value = (char*)typeValue;
+
+    // Add single instance to array of instances
+    HttpHeader** headers = arena_alloc(arena, sizeof(HttpHeader*) * 2);
+    headers[0] = type;
+    headers[1] = NULL;
+
+    return headers;
+}
+
+/* create_image_headers()
+ *
+ * This function creates the headers for a response containing an encoded
+ * image: its Content-Type and, for formats that are nothing but pixels, the
+ * image's dimensions (X-Image-Width, X-Image-Height and X-Image-Stride).
+ *
+ * request: A pointer to the ClientRequest being answered.
+ * encoder: The ImageEncoder that encoded the image.
+ * image: The EncodedImage.
+ *
+ * Returns: A NULL terminated array of HttpHeader pointers (allocated from the
+ *     request's arena).
+ */
+HttpHeader** create_image_headers(ClientRequest* request,
+        const ImageEncoder* encoder, const EncodedImage* image)
+{
+    HttpHeader** headers = create_header(request, encoder->type);
+    if (!encoder->rawPixels) {
+        return headers;
+    }
+
+    Arena* arena = &request->http.arena;
+    char* names[] = {"X-Image-Width", "X-Image-Height", "X-Image-Stride"};
+    unsigned values[] = {image->width, image->height, image->width * 4};
+    int count = sizeof(values) / sizeof(unsigned);
+    HttpHeader* type = headers[0];
+    headers = arena_alloc(arena, sizeof(HttpHeader*) * (count + 2));
+    headers[0] = type;
+    for (int i = 0; i < count; i++) {
+        HttpHeader* header = arena_alloc(arena, sizeof(HttpHeader));
+        header->name = names[i];
+        header->value = arena_alloc(arena, MAX_NUMBER_SIZE);
+        snprintf(header->value, MAX_NUMBER_SIZE, "%u", values[i]);
+        headers[i + 1] = header;
+    }
+    headers[count + 1] = NULL;
+
+    return headers;
+}
+
+/* check_method()
+ *
+ * This function checks whether the given HTTP request's method is either a
+ * POST or GET. If 'method' is neither then an error HTTP response will be sent
+ * to the client.
+ *
+ * request: A pointer to the ClientRequest being answered.
+ * method: Method of HTTP request.
+ * stats: A pointer to an instance of the ServerStats struct.
+ *
+ * Returns: If the given HTTP request's method was valid then 0 is returned.
+ *     Otherwise 1.
+ */
+int check_method(ClientRequest* request, char* method, ServerStats* stats)
+{
+    if (strcmp(method, "POST") && strcmp(method, "GET")) {
+        // Construct HTTP response
+        char* message = "Invalid method on request list\n";
+        int messageLen = strlen(message);
+        const char* explanation = "Method Not Allowed";
+        HttpHeader** headers = create_header(request, "text/plain");
+
+        // Send HTTP response and change stats
+        send_http_response(request, BAD_METHOD, explanation, headers,
+                (unsigned char*)message, messageLen);
+        change_stats(stats, HTTP_FAIL);
+
+        return 1;
+    }
+
+    return 0;
+}
+
+/* write_cache_metrics()
+ *
+ * This function writes the counters of a cache in the Prometheus text format.
+ *
+ * out: The stream to write to.
+ * name: Name of the cache (used as the value of its 'cache' label).
+ * cache: A pointer to the Cache.
+ */
+void write_cache_metrics(FILE* out, const char* name, Cache* cache)
+{
+    CacheStats stats = cache_stats(cache);
+
+    fprintf(out, "uqimageproc_cache_hits_total{cache=\"%s\"} %lu\n", name,
+            stats.hits);
+    fprintf(out, "uqimageproc_cache_misses_total{cache=\"%s\"} %lu\n", name,
+            stats.misses);
+    fprintf(out, "uqimageproc_cache_evictions_total{cache=\"%s\"} %lu\n",
+            name, stats.evictions);
+    fprintf(out, "uqimageproc_cache_entries{cache=\"%s\"} %u\n", name,
+            stats.count);
+    fprintf(out, "uqimageproc_cache_bytes{cache=\"%s\"} %zu\n", name,
+            stats.used);
+    fprintf(out, "uqimageproc_cache_capacity_bytes{cache=\"%s\"} %zu\n",
+            name, stats.capacity);
+}
+
+/* stage_depth()
+ *
+ * Returns: The number of jobs waiting in a pipeline stage's queues (those of
+ *     every placement group).
+ */
+unsigned stage_depth(Stage* stage)
+{
+    unsigned depth = 0;
+    for (int i = 0; i < stage->pipeline->groups; i++) {
+        depth += priorityqueue_depth(stage->queues[i]);
+    }
+
+    return depth;
+}
+
+/* write_metrics()
+ *
+ * This function writes the server statistics (including the requests and
+ * pixel work pending and the clients and requests shed by admission control),
+ * the state of each pipeline stage, the counters of any enabled cache and of
+ * the buffer pool, every latency histogram, the histograms of allocations
+ * made per request (from its arena, and from the heap for the arena) and
+ * those of the estimated and actual costs of image jobs in the Prometheus
+ * text format.
+ *
+ * out: Stream to write to.
+ * stats: A pointer to an instance of the ServerStats struct.
+ * pipeline: A pointer to an instance of the Pipeline struct.
+ */
+void write_metrics(FILE* out, ServerStats* stats, Pipeline* pipeline)
+{
+    StatsSnapshot snapshot = snapshot_stats(stats);
+    fprintf(out, "uqimageproc_clients_connected %u\n",
+            snapshot.currentClients);
+    fprintf(out, "uqimageproc_clients_completed_total %u\n",
+            snapshot.totalClients);
+    fprintf(out, "uqimageproc_http_requests_total{result=\"success\"} %u\n",
+            snapshot.successRequests);
+    fprintf(out, "uqimageproc_http_requests_total{result=\"fail\"} %u\n",
+            snapshot.failRequests);
+    fprintf(out, "uqimageproc_image_operations_total %u\n",
+            snapshot.completedOperations);
+    fprintf(out, "uqimageproc_bytes_received_total %lu\n", snapshot.bytesIn);
+    fprintf(out, "uqimageproc_bytes_sent_total %lu\n", snapshot.bytesOut);
+    fprintf(out, "uqimageproc_pending_requests %u\n",
+            __atomic_load_n(&stats->pending, __ATOMIC_RELAXED));
+    fprintf(out, "uqimageproc_pixel_work %lu\n",
+            __atomic_load_n(&stats->pixelWork, __ATOMIC_RELAXED));
+    for (int i = 0; i < SHED_COUNT; i++) {
+        fprintf(out, "uqimageproc_clients_shed_total{reason=\"%s\"} %lu\n",
+                shedNames[i],
+                __atomic_load_n(&stats->shed[i], __ATOMIC_RELAXED));
+    }
+    for (int i = SHED_QUEUE; i < SHED_COUNT; i++) {
+        fprintf(out, "uqimageproc_requests_shed_total{reason=\"%s\"} %lu\n",
+                shedNames[i],
+                __atomic_load_n(&stats->shedRequests[i], __ATOMIC_RELAXED));
+    }
+    for (int i = 0; i < CANCEL_COUNT; i++) {
+        fprintf(out,
+                "uqimageproc_requests_cancelled_total{reason=\"%s\"} %lu\n",
+                cancelNames[i],
+                __atomic_load_n(&stats->cancelled[i], __ATOMIC_RELAXED));
+    }
+
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        Stage* stage = &pipeline->stages[i];
+        fprintf(out, "uqimageproc_stage_threads{stage=\"%s\"} %d\n",
+                stage->name, stage->threads);
+        fprintf(out, "uqimageproc_stage_queue_depth{stage=\"%s\"} %u\n",
+                stage->name, stage_depth(stage));
+    }
+    if (pipeline->results) {
+        write_cache_metrics(out, "result", pipeline->results);
+    }
+    if (pipeline->decoded) {
+        write_cache_metrics(out, "decoded", pipeline->decoded);
+    }
+    BufferPoolStats buffers = buffer_pool_stats();
+    fprintf(out, "uqimageproc_buffer_pool_reused_total %lu\n",
+            buffers.reused);
+    fprintf(out, "uqimageproc_buffer_pool_allocated_total %lu\n",
+            buffers.allocated);
+    fprintf(out, "uqimageproc_buffer_pool_bytes %zu\n", buffers.retained);
+    fprintf(out, "uqimageproc_buffer_pool_limit_bytes %zu\n", buffers.limit);
+
+    char label[64];
+    for (int i = 0; i < LATENCY_COUNT; i++) {
+        snprintf(label, sizeof(label), "stage=\"%s\"", latencyNames[i]);
+        histogram_print(
+                stats->latencies[i], out, "uqimageproc_latency_us", label);
+    }
+    for (int i = 0; i < ALLOC_COUNT; i++) {
+        snprintf(label, sizeof(label), "from=\"%s\"", allocNames[i]);
+        histogram_print(stats->allocations[i], out,
+                "uqimageproc_request_allocations", label);
+    }
+    for (int i = 0; i < COST_COUNT; i++) {
+        snprintf(label, sizeof(label), "measure=\"%s\"", costNames[i]);
+        histogram_print(
+                stats->costs[i], out, "uqimageproc_job_cost", label);
+    }
+}
+
+/* metrics_response()
+ *
+ * This function sends a success HTTP response with the current server
+ * metrics (see write_metrics()) as the body.
+ *
+ * request: A pointer to the ClientRequest being answered.
+ * pool: A pointer to an instance of the WorkerPool struct.
+ */
+void metrics_response(ClientRequest* request, WorkerPool* pool)
+{
+    char* message = NULL;
+    size_t messageLen = 0;
+    FILE* out = open_memstream(&message, &messageLen);
+    write_metrics(out, pool->stats, pool->pipeline);
+    fclose(out);
+
+    HttpHeader** headers = create_header(request, "text/plain; version=0.0.4");
+    send_http_response(request, SUCCESS, "OK", headers,
+            (unsigned char*)message, messageLen);
+    free(message);
+    change_stats(pool->stats, HTTP_SUCCESS);
+}
+
+/* release_home_page()
+ *
+ * This function gives back the version of the home page that was the body of
+ * a response once it has been sent.
+ *
+ * owner: Expected to be a pointer to the HomePage.
+ * data: Expected to be a pointer to the HomePageVersion.
+ */
+void release_home_page(void* owner, void* data)
+{
+    home_page_release((HomePage*)owner, (HomePageVersion*)data);
+}
+
+/* home_page_response()
+ *
+ * This function answers a request for the home page from memory, along with
+ * its ETag. If the client already has the current version (its If-None-Match
+ * header matches) only a Not Modified response is sent. If the home page
+ * can't be read a fail HTTP response is sent instead.
+ *
+ * request: A pointer to the ClientRequest being answered.
+ * pool: A pointer to an instance of the WorkerPool struct.
+ */
+void home_page_response(ClientRequest* request, WorkerPool* pool)
+{
+    HomePageVersion* version = home_page_get(pool->homePage);
+    if (!version) {
+        char* message = "Home page unavailable\n";
+        send_http_response(request, SERVER_ERROR, "Internal Server Error",
+                create_header(request, "text/plain"),
+                (unsigned char*)message, strlen(message));
+        change_stats(pool->stats, HTTP_FAIL);
+        return;
+    }
+
+    // Content-Type and ETag headers
+    Arena* arena = &request->http.arena;
+    HttpHeader** headers = arena_alloc(arena, sizeof(HttpHeader*) * 3);
+    headers[0] = create_header(request, "text/html")[0];
+    headers[1] = arena_alloc(arena, sizeof(HttpHeader));
+    headers[1]->name = "ETag";
+    headers[1]->value = version->etag;
+    headers[2] = NULL;
+
+    char* ifNoneMatch
+            = get_header_value(request->http.headers, "If-None-Match");
+    if (ifNoneMatch && etag_matches(ifNoneMatch, version->etag)) {
+        send_http_response(
+                request, NOT_MODIFIED, "Not Modified", headers, NULL, 0);
+        home_page_release(pool->homePage, version);
+    } else {
+        send_body_response(request, SUCCESS, "OK", headers, version->data,
+                version->size, release_home_page, pool->homePage, version);
+    }
+    change_stats(pool->stats, HTTP_SUCCESS);
+}
+
+/* check_get_request()
+ *
+ * If the HTTP request received is a GET method then this function will check
+ * if the given address is correct ('/' or '/metrics' and nothing else). If
+ * the GET HTTP request is valid then a success HTTP response will be sent to
+ * the client with the body being the home page HTML (see
+ * home_page_response()) or the server metrics.
+ * Otherwise an error HTTP response will be sent to the client.
+ *
+ * request: A pointer to the ClientRequest being answered.
+ * method: Method of HTTP request.
+ * address: Address of the HTTP request.
+ * pool: A pointer to an instance of the WorkerPool struct.
+ *
+ * Returns: If the given HTTP request was a valid GET HTTP request then 0 is
+ *     returned. Otherwise 1.
+ */
+int check_get_request(
+        ClientRequest* request, char* method, char* address, WorkerPool* pool)
+{
+    ServerStats* stats = pool->stats;
     // Construct headers
     HttpHeader** headers;
 
-    // Invalid home page request
-    if (!strcmp(method, "GET") && strcmp(address, "/")) {
-        // Construct HTTP request
-        char* message = "Invalid address\n";
-        int messageLen = strlen(message);
-        const char* explanation = "Not Found";
-        headers = create_header("text/plain");
+    // Metrics request
+    if (!strcmp(method, "GET") && !strcmp(address, "/metrics")) {
+        metrics_response(request, pool);
+        return 1;
+    }
+
+    // Invalid home page request
+    if (!strcmp(method, "GET") && strcmp(address, "/")) {
+        // Construct HTTP request
+        char* message = "Invalid address\n";
+        int messageLen = strlen(message);
+        const char* explanation = "Not Found";
+        headers = create_header(request, "text/plain");
+
+        // Send http response and change stats
+        send_http_response(request, BAD_GET, explanation, headers,
+                (unsigned char*)message, messageLen);
+        change_stats(stats, HTTP_FAIL);
+
+        return 1;
+    }
+
+    // Valid home page request
+    if (!strcmp(method, "GET") && !strcmp(address, "/")) {
+        home_page_response(request, pool);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* check_operation_arg_number()
+ *
+ * This function checks the amount of arguments present for each image
+ * operation. For rotate and flip there must be only one argument present, no
+ * more, no less. For scale there must be only two arguments present no more,
+ * no less.
+ *
+ * split: Array of strings in the format of [operations, arg, arg2, ...].
+ *        (This parameter is assumed to be a char** type created by using
+ *        arena_split() function)
+ *
+ * Returns: If the correct number of arguments are present then 1 is returned
+ *     otherwise 0.
+ */
+int check_operation_arg_number(char** split)
+{
+    int argCount = 0;
+    char* type = split[0];
+
+    // Check that the first 'word' is either rotate, flip or scale
+    if (!strcmp(type, "rotate") || !strcmp(type, "flip")) {
+        argCount = 1;
+    } else if (!strcmp(type, "scale")) {
+        argCount = 2;
+    } else {
+        return 0;
+    }
+
+    // Check correct amount of args for scale, flip and rotate
+    for (int i = 1; i < (argCount + 2); i++) {
+        if (i < argCount + 1 && split[i] == NULL) {
+            return 0;
+        }
+        if (i == argCount + 1 && split[i] != NULL) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* check_operation_arg_valid()
+ *
+ * This function checks that the arguments of each operations are valid.
+ *
+ * split: Array of strings in the format of [operations, arg, arg2, ...].
+ *        (This parameter is assumed to be a char** created by using
+ *        arena_split() function).
+ *
+ * Returns: If the operation arguments are valid 1 is returned, otherwise 0.
+ */
+int check_operation_arg_valid(char** split)
+{
+    char* type = split[0];
+
+    if (!strcmp(type, "rotate") && !check_rotate_arg(split[1])) {
+        return 0;
+    }
+    if (!strcmp(type, "flip") && !check_flip_arg(split[1])) {
+        return 0;
+    }
+    if (!strcmp(type, "scale") && !check_scale_arg(split[1], split[2])) {
+        return 0;
+    }
+
+    return 1;
+}
+
+/* check_image_operation()
+ *
+ * This function checks that the image 'operation' (and its arguments) given
+ * are valid.
+ *
+ * request: A pointer to the ClientRequest (whose arena is used).
+ * operation: An operation and it's argument in string format separated by
+ *     commas.
+ *
+ * Returns: If the given 'operation' is invalid then 0 will return otherwise 1.
+ */
+int check_image_operation(ClientRequest* request, char* operation)
+{
+    // Split given operation string by a comma.
+    Arena* arena = &request->http.arena;
+    char* opCopy = arena_strdup(arena, operation);
+    char** split = arena_split(arena, opCopy, ',');
+    int returnValue = 1;
+
+    if (split[0] == NULL) {
+        returnValue = 1;
+    }
+
+    // Check correct number of arguments
+    if (returnValue && !check_operation_arg_number(split)) {
+        returnValue = 0;
+    }
+
+    // Check that arguments are valid
+    if (returnValue && !check_operation_arg_valid(split)) {
+        returnValue = 0;
+    }
+
+    return returnValue;
+}
+
+/* check_post_request()
+ *
+ * This function checks that a given POST request is valid. It's validity will
+ * depend on if the address is in a valid format
+ *
+ * request: A pointer to the ClientRequest being answered.
+ * method: Method of HTTP request
+ * address: Address of HTTP request
+ * stats: A pointer to an instance of the ServerStats struct.
+ *
+ * Returns: If the POST request is valid then an array of strings
+ *     (NULL terminated) will be returned.
+ */
+char** check_post_request(
+        ClientRequest* request, char* method, char* address, ServerStats* stats)
+{
+    // Check method is POST
+    if (strcmp(method, "POST")) {
+        return 0;
+    }
+
+    bool invalidResp = false;
+
+    // Split address by '/'
+    char** operations = arena_split(&request->http.arena, address, '/');
+    int i = 1;
+    // If request address contains nothing or doesn't start with '/'
+    if (strcmp(operations[0], "") || operations[0] == NULL) {
+        invalidResp = true;
+    }
+
+    // Loop over each operation request
+    while (operations[i] != NULL && !invalidResp) {
+        // Check each operation is in the right format
+        if (!check_image_operation(request, operations[i])) {
+            invalidResp = true;
+        }
+        i++;
+    }
+
+    if (invalidResp) { // If invalid POST request sent fail HTTP response
+        // Construct http response
+        HttpHeader** headers = create_header(request, "text/plain");
+        char* message = "Invalid operation requested\n";
+        int messageLen = strlen(message);
+        const char* explanation = "Bad Request";
+
+        // Send http resposne
+        send_http_response(request, BAD_POST, explanation, headers,
+                (unsigned char*)message, messageLen);
+        change_stats(stats, HTTP_FAIL);
+        return NULL;
+    }
+
+    return operations;
+}
+
+/* check_image_size()
+ *
+ * This function checks if the image from the HTTP response is too large. The
+ * body of such a request was never read in; its length is as much of its size
+ * as was known when it was rejected.
+ *
+ * request: A pointer to the ClientRequest being answered.
+ * imageSize: Size of image in bytes.
+ * stats: A pointer to instance of the ServerStats struct.
+ *
+ * Returns: If the image size is valid then the function 0 is returned.
+ *     Otherwise 1.
+ */
+int check_image_size(
+        ClientRequest* request, unsigned long imageSize, ServerStats* stats)
+{
+    // Check if image size too large
+    if (imageSize > MAX_IMAGE_SIZE) {
+        HttpHeader** headers = create_header(request, "text/plain");
+
+        // Create HTTP response message
+        size_t messageSize = SIZE_ERROR_MSG_DEFAULT + sizeof(imageSize);
+        char* message = malloc(sizeof(char) * messageSize);
+        snprintf(message, messageSize, "Image is too large: %lu bytes\n",
+                imageSize);
+        int messageLen = strlen(message);
+        const char* explanation = "Payload Too Large";
+
+        // Send http response
+        send_http_response(request, IMAGE_TOO_LARGE, explanation, headers,
+                (unsigned char*)message, messageLen);
+        change_stats(stats, HTTP_FAIL);
+        free(message);
+
+        return 1;
+    }
+
+    return 0;
+}
+
+/* invalid_image_response()
+ *
+ * This function creates and sends an invalid image HTTP response to a specified
+ * client.
+ *
+ * request: A pointer to the ClientRequest being answered.
+ */
+void invalid_image_response(ClientRequest* request)
+{
+    char* message = "Invalid image received\n";
+    int messageLen = strlen(message);
+    const char* explanation = "Unprocessable Content";
+    HttpHeader** headers = create_header(request, "text/plain");
+
+    // Send http response
+    send_http_response(request, BAD_IMAGE, explanation, headers,
+            (unsigned char*)message, messageLen);
+}
+
+/* operation_failed_response()
+ *
+ * This function creates and sends an operation failed HTTP response to a
+ * specified client.
+ *
+ * request: A pointer to the ClientRequest being answered.
+ * failedOperation: The operation type which is one of 'rotate', 'flip' or
+ *     'scale' that the program failed at.
+ */
+void operation_error_response(
+        ClientRequest* request, const char* failedOperation)
+{
+    // Create HTTP resposne
+    HttpHeader** headers = create_header(request, "text/plain");
+    size_t messageSize = OP_ERROR_MSG_DEFAULT + sizeof(failedOperation);
+    char* message = malloc(sizeof(char) * messageSize);
+    snprintf(message, messageSize, "Operation did not complete: %s\n",
+            failedOperation);
+    int messageLen = strlen(message);
+    const char* explanation = "Not Implemented";
+
+    // Send HTTP response
+    send_http_response(request, OPERATION_ERROR, explanation, headers,
+            (unsigned char*)message, messageLen);
+    free(message);
+}
+
+/* cancelled_response()
+ *
+ * This function answers a request whose work has been cancelled, counting it
+ * by CancelReason. Nothing is sent if the client has gone. Otherwise the
+ * request's deadline has passed: if it passed while the request was waiting
+ * in a queue the server is overloaded, so it is answered with a Service
+ * Unavailable response (the client may try again after retryAfterSeconds),
+ * and if it passed while an operation was running with a Gateway Timeout
+ * response.
+ *
+ * request: A pointer to the ClientRequest being answered.
+ * working: Whether an operation was running on the request's image.
+ * stats: A pointer to a ServerStats struct instance.
+ */
+void cancelled_response(
+        ClientRequest* request, bool working, ServerStats* stats)
+{
+    if (__atomic_load_n(request->cancel.cancelled, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(
+                &stats->cancelled[CLIENT_GONE], 1, __ATOMIC_RELAXED);
+        return;
+    }
+    __atomic_add_fetch(
+            &stats->cancelled[DEADLINE_EXCEEDED], 1, __ATOMIC_RELAXED);
+
+    HttpHeader retryAfter = {"Retry-After", (char*)retryAfterSeconds};
+    HttpHeader contentType = {"Content-Type", "text/plain"};
+    HttpHeader* headers[] = {&contentType, working ? NULL : &retryAfter, NULL};
+    int status = working ? GATEWAY_TIMEOUT : SERVICE_UNAVAILABLE;
+    const char* explanation
+            = working ? "Gateway Timeout" : "Service Unavailable";
+
+    send_http_response(request, status, explanation, headers,
+            (unsigned char*)deadlineMessage, strlen(deadlineMessage));
+    change_stats(stats, HTTP_FAIL);
+}
+
+/* overloaded_response()
+ *
+ * This function answers a request that is shed because the server is
+ * overloaded, counting it by ShedReason. It gets a Service Unavailable
+ * response asking the client to try again after retryAfterSeconds, and the
+ * connection stays open for the client's later requests.
+ *
+ * request: A pointer to the ClientRequest being shed.
+ * reason: Why the request is shed.
+ * stats: A pointer to a ServerStats struct instance.
+ */
+void overloaded_response(
+        ClientRequest* request, ShedReason reason, ServerStats* stats)
+{
+    __atomic_add_fetch(&stats->shedRequests[reason], 1, __ATOMIC_RELAXED);
+
+    HttpHeader retryAfter = {"Retry-After", (char*)retryAfterSeconds};
+    HttpHeader contentType = {"Content-Type", "text/plain"};
+    HttpHeader* headers[] = {&retryAfter, &contentType, NULL};
+    send_http_response(request, SERVICE_UNAVAILABLE, "Service Unavailable",
+            headers, (unsigned char*)overloadMessage,
+            strlen(overloadMessage));
+    change_stats(stats, HTTP_FAIL);
+}
+
+/* operation_latency()
+ *
+ * This function finds which latency histogram the time taken by a planned
+ * operation is recorded in.
+ *
+ * op: A pointer to the ImageOp.
+ *
+ * Returns: One of ROTATE_TIME, FLIP_TIME or SCALE_TIME.
+ */
+Latency operation_latency(const ImageOp* op)
+{
+    const char* name = operation_name(op);
+
+    if (!strcmp(name, "scale")) {
+        return SCALE_TIME;
+    }
+
+    return strcmp(name, "flip") ? ROTATE_TIME : FLIP_TIME;
+}
+
+/* operate_on_image()
+ *
+ * This function performs all the image manipulation planned for a request on
+ * a given 'imageMap'. Planning has already folded runs of rotations and flips
+ * together so each run takes a single pass over the image. Unless 'exact' is
+ * set the plan is now reordered to process fewer pixels (e.g. downscaling
+ * before rotating). Operations on large images are split across 'tasks'. The
+ * time taken by each planned operation is recorded. If the request is
+ * cancelled (see CancelToken) while an operation is running, that operation
+ * stops early and the rest are skipped.
+ *
+ * request: A pointer to the ClientRequest being answered.
+ * imageMap: A pointer to a FIBITMAP struct instance.
+ * plan: A pointer to the OpPlan from plan_operations().
+ * exact: Whether the operations must give exactly the FreeImage result.
+ * tasks: A pointer to the shared TaskPool.
+ * stats: A pointer to a ServerStats struct instance.
+ *
+ * Returns: If any operations 'rotate', 'flip' or 'scale' was unsuccessful for
+ *     some reason or the request was cancelled the function returns NULL
+ *     (and 'imageMap' has been unloaded). Otherwise a new modified pointer to
+ *     instance of FIBITMAP is returned.
+ */
+FIBITMAP* operate_on_image(ClientRequest* request, FIBITMAP* imageMap,
+        OpPlan* plan, bool exact, TaskPool* tasks, ServerStats* stats)
+{
+    if (!exact) {
+        optimise_plan(plan, tasks, FreeImage_GetWidth(imageMap),
+                FreeImage_GetHeight(imageMap));
+    }
+
+    for (int i = 0; i < plan->count; i++) {
+        ImageOp* op = &plan->ops[i];
+        unsigned long start = now_usec();
+        imageMap = apply_operation(
+                imageMap, op, exact, tasks, &request->cancel);
+        record_latency(stats, operation_latency(op), start);
+
+        // Check if operation failed
+        if (imageMap == NULL) {
+            // Send fail response
+            operation_error_response(request, operation_name(op));
+            change_stats(stats, HTTP_FAIL);
+            return NULL;
+        }
+
+        // The result of a cancelled operation may be incomplete
+        if (cancel_requested(&request->cancel)) {
+            FreeImage_Unload(imageMap);
+            cancelled_response(request, true, stats);
+            return NULL;
+        }
+    }
+
+    add_stats(stats, OPERATE_IMAGE, plan->requested);
+
+    return imageMap;
+}
+
+/* pixel_work()
+ *
+ * This function estimates the work needed for an image job on an image of
+ * 'pixels' pixels. Decoding the image and encoding the result pass over every
+ * pixel once, as does each planned operation (a scale over every pixel of
+ * the larger of its input and its output).
+ *
+ * job: A pointer to the ImageJob (whose operations have been planned).
+ * pixels: Number of pixels in the image.
+ *
+ * Returns: The estimated number of pixels to be processed.
+ */
+unsigned long pixel_work(ImageJob* job, unsigned long pixels)
+{
+    unsigned long work = pixels;
+
+    for (int i = 0; i < job->plan.count; i++) {
+        const ImageOp* op = &job->plan.ops[i];
+        if (op->type == SCALE_OP) {
+            unsigned long scaled = (unsigned long)op->width * op->height;
+            work += (scaled > pixels) ? scaled : pixels;
+            pixels = scaled;
+        } else {
+            work += pixels;
+        }
+    }
+
+    return work + pixels;
+}
+
+/* set_pixel_work()
+ *
+ * This function changes the estimated pixel work of an image job, keeping the
+ * server's total (used for admission control) up to date.
+ *
+ * job: A pointer to the ImageJob.
+ * stats: A pointer to an instance of the ServerStats struct.
+ * work: The job's new estimate (0 once it has finished).
+ */
+void set_pixel_work(ImageJob* job, ServerStats* stats, unsigned long work)
+{
+    if (work > job->pixelWork) {
+        __atomic_add_fetch(
+                &stats->pixelWork, work - job->pixelWork, __ATOMIC_RELAXED);
+    } else {
+        __atomic_sub_fetch(
+                &stats->pixelWork, job->pixelWork - work, __ATOMIC_RELAXED);
+    }
+    job->pixelWork = work;
+}
+
+/* unload_image()
+ *
+ * This function unloads a cached FIBITMAP once it has left the decoded image
+ * cache and is no longer in use.
+ *
+ * imageMap: Expected to be a pointer to the FIBITMAP.
+ */
+void unload_image(void* imageMap)
+{
+    FreeImage_Unload((FIBITMAP*)imageMap);
+}
+
+/* load_cached_image()
+ *
+ * This function gets a private copy of an uploaded image from the decoded
+ * image cache, decoding (and caching) it first if it isn't there. Requests for
+ * the same image share the cached copy, each cloning it as the operations on
+ * an image use it up.
+ *
+ * job: A pointer to the ImageJob being processed.
+ * pipeline: A pointer to the Pipeline (whose decoded image cache is enabled).
+ *
+ * Returns: The image, or NULL if it couldn't be decoded.
+ */
+FIBITMAP* load_cached_image(ImageJob* job, Pipeline* pipeline)
+{
+    HttpRequest* http = &job->request->http;
+    size_t keyLen = strlen(job->bodyKey);
+
+    CacheEntry* entry = cache_get(pipeline->decoded, job->bodyKey, keyLen);
+    if (!entry) {
+        unsigned long start = now_usec();
+        FIBITMAP* imageMap = fi_load_image_from_buffer(http->body, http->len);
+        record_latency(pipeline->stats, DECODE_TIME, start);
+        if (!imageMap) {
+            return NULL;
+        }
+        entry = cache_put(pipeline->decoded, job->bodyKey, keyLen, imageMap,
+                FreeImage_GetMemorySize(imageMap));
+        if (!entry) { // Too large to cache (or cached meanwhile)
+            return imageMap;
+        }
+    }
 
-        // Send http response and change stats
-        send_http_response(fd, BAD_GET, explanation, headers,
-                (unsigned char*)message, messageLen);
+    FIBITMAP* copy = FreeImage_Clone((FIBITMAP*)entry->value);
+    cache_release(pipeline->decoded, entry);
+
+    return copy;
+}
+
+/* decode_stage()
+ *
+ * This is the first stage of the image pipeline. It tries loading the body of
+ * the request into a FIBITMAP. Raw pixel uploads are used as they are (see
+ * load_raw_image()); anything else is decoded by FreeImage (through the
+ * decoded image cache if enabled). The job's pixel work is then estimated
+ * from the image's real size. If loading the image fails (meaning that it is
+ * an invalid image) a fail HTTP response is sent to the client.
+ *
+ * job: A pointer to the ImageJob being processed.
+ * pipeline: A pointer to the Pipeline the job is moving through.
+ *
+ * Returns: The next stage for the job, or PIPELINE_DONE if it failed.
+ */
+PipelineStage decode_stage(ImageJob* job, Pipeline* pipeline)
+{
+    ServerStats* stats = pipeline->stats;
+    HttpRequest* http = &job->request->http;
+
+    // Try loading image into BITMAP
+    if (is_raw_image(http->headers, http->body, http->len)) {
+        unsigned long start = now_usec();
+        job->imageMap = load_raw_image(http->headers, http->body, http->len);
+        record_latency(stats, DECODE_TIME, start);
+    } else if (pipeline->decoded) {
+        job->imageMap = load_cached_image(job, pipeline);
+    } else {
+        unsigned long start = now_usec();
+        job->imageMap = fi_load_image_from_buffer(http->body, http->len);
+        record_latency(stats, DECODE_TIME, start);
+    }
+    if (job->imageMap == NULL) { // Loading image failed
+        invalid_image_response(job->request);
         change_stats(stats, HTTP_FAIL);
+        return PIPELINE_DONE;
+    }
+    unsigned long pixels = (unsigned long)FreeImage_GetWidth(job->imageMap)
+            * FreeImage_GetHeight(job->imageMap);
+    set_pixel_work(job, stats, pixel_work(job, pixels));
 
-        return 1;
+    return TRANSFORM_STAGE;
+}
+
+/* transform_stage()
+ *
+ * This stage performs all of the requested image operations on the decoded
+ * image.
+ *
+ * job: A pointer to the ImageJob being processed.
+ * pipeline: A pointer to the Pipeline the job is moving through.
+ *
+ * Returns: The next stage for the job, or PIPELINE_DONE if an operation
+ *     failed (in which case a fail HTTP response has already been sent).
+ */
+PipelineStage transform_stage(ImageJob* job, Pipeline* pipeline)
+{
+    job->imageMap = operate_on_image(job->request, job->imageMap, &job->plan,
+            job->exact, pipeline->tasks[job->group], pipeline->stats);
+
+    // Check if operations on the image failed.
+    if (job->imageMap == NULL) {
+        return PIPELINE_DONE;
     }
 
-    // Valid home page request
-    if (!strcmp(method, "GET") && !strcmp(address, "/")) {
-        // Construct HTTP request
-        char* message = read_home_page();
-        int messageLen = strlen(message);
-        const char* explanation = "OK";
-        headers = create_header("text/html");
+    return ENCODE_STAGE;
+}
 
-        // Send http response and change stats
-        send_http_response(fd, SUCCESS, explanation, headers,
-                (unsigned char*)message, messageLen);
-        free(message);
-        change_stats(stats, HTTP_SUCCESS);
+/* encode_stage()
+ *
+ * This stage converts the transformed image from a FIBITMAP to PNG data. The
+ * bitmap is released as soon as it is no longer needed.
+ *
+ * job: A pointer to the ImageJob being processed.
+ * pipeline: A pointer to the Pipeline the job is moving through.
+ *
+ * Returns: The next stage for the job.
+ */
+PipelineStage encode_stage(ImageJob* job, Pipeline* pipeline)
+{
+    ServerStats* stats = pipeline->stats;
 
-        return 1;
+    // Convert image from BITMAP to raw binary data
+    unsigned long start = now_usec();
+    job->output = encode_image(job->encoder, job->imageMap, job->compression);
+    record_latency(stats, ENCODE_TIME, start);
+    FreeImage_Unload(job->imageMap);
+    job->imageMap = NULL;
+
+    // Keep the result for identical requests (the cache then owns the output)
+    if (job->resultKey && job->output->data) {
+        job->result = cache_put(pipeline->results, job->resultKey,
+                strlen(job->resultKey), job->output,
+                sizeof(EncodedImage) + job->output->size);
     }
 
-    return 0;
+    return SEND_STAGE;
 }
 
-/* check_operation_arg_number()
+/* send_stage()
  *
- * This function checks the amount of arguments present for each image
- * operation. For rotate and flip there must be only one argument present, no
- * more, no less. For scale there must be only two arguments present no more,
- * no less.
+ * This is the last stage of the image pipeline. It sends a success HTTP
+ * response with the encoded image as the body to the client. The image is
+ * written from where the encoder left it, so the response takes over the job's
+ * output (or its reference to the cached result).
  *
- * split: Array of strings in the format of [operations, arg, arg2, ...].
- *        (This parameter is assumed to be a char** type created by using
- *        split_by_char() function)
+ * job: A pointer to the ImageJob being processed.
+ * pipeline: A pointer to the Pipeline the job is moving through.
  *
- * Returns: If the correct number of arguments are present then 1 is returned
- *     otherwise 0.
+ * Returns: Always PIPELINE_DONE.
  */
-int check_operation_arg_number(char** split)
+PipelineStage send_stage(ImageJob* job, Pipeline* pipeline)
 {
-    int argCount = 0;
-    char* type = split[0];
+    ServerStats* stats = pipeline->stats;
 
-    // Check that the first 'word' is either rotate, flip or scale
-    if (!strcmp(type, "rotate") || !strcmp(type, "flip")) {
-        argCount = 1;
-    } else if (!strcmp(type, "scale")) {
-        argCount = 2;
+    // Create HTTP response
+    EncodedImage* output = job->output;
+    HttpHeader** headers
+            = create_image_headers(job->request, job->encoder, output);
+    const char* explanation = "OK";
+
+    // Send HTTP response
+    if (job->result) {
+        send_body_response(job->request, SUCCESS, explanation, headers,
+                output->data, output->size, release_result,
+                pipeline->results, job->result);
     } else {
-        return 0;
+        send_body_response(job->request, SUCCESS, explanation, headers,
+                output->data, output->size, free_output, NULL, output);
     }
+    job->output = NULL;
+    job->result = NULL;
+    change_stats(stats, HTTP_SUCCESS);
 
-    // Check correct amount of args for scale, flip and rotate
-    for (int i = 1; i < (argCount + 2); i++) {
-        if (i < argCount + 1 && split[i] == NULL) {
-            return 0;
+    return PIPELINE_DONE;
+}
+
+/* process_request()
+ *
+ * This function processes a received HTTP request from a client in the
+ * following order:
+ * 1. Check that the request method is either a GET or POST.
+ * 2. If a GET request is received check that the address of the HTTP request is
+ *    valid.
+ * 3. If a POST request is received check that the address of the HTTP request
+ *    is valid.
+ * 4. Check that the image received (body) within the HTTP request is of valid
+ *    size.
+ *
+ * request: A pointer to the ClientRequest being answered.
+ * method: Method of HTTP request.
+ * address: Address of HTTP request.
+ * len: Length of the body of the HTTP request.
+ * pool: A pointer to an instance of the WorkerPool struct.
+ *
+ * Returns: If the received HTTP request was a POST request and includes a
+ *     valid POST address then the function will return a char** type created
+ *     from arena_split() function which includes all the image operations
+ *     requested. Otherwise NULL will be returned.
+ */
+char** process_request(ClientRequest* request, char* method, char* address,
+        unsigned long len, WorkerPool* pool)
+{
+    ServerStats* stats = pool->stats;
+
+    // Validate the request's method and GET requests
+    if (check_method(request, method, stats)
+            || check_get_request(request, method, address, pool)) {
+        return NULL;
+    }
+
+    // Check POST request
+    char** operations = check_post_request(request, method, address, stats);
+
+    // Check if POST request was valid
+    if (operations == NULL) {
+        return NULL;
+    }
+
+    // Check if image size is valid
+    if (check_image_size(request, len, stats)) {
+        return NULL;
+    }
+
+    return operations;
+}
+
+/* read_input()
+ *
+ * This function reads everything currently available on the connection's
+ * socket (up to READ_BUDGET bytes per call so one busy client can't starve
+ * the others sharing a reactor) and appends it to the input buffer. The time
+ * the first byte of a request arrived is remembered, as is the amount of
+ * input that will be thrown away on a connection that is to be closed. Must be
+ * called with the connection locked.
+ *
+ * conn: A pointer to an instance of the Connection struct.
+ */
+void read_input(Connection* conn)
+{
+    size_t budget = READ_BUDGET;
+
+    while (budget && !conn->peerClosed && !conn->failed) {
+        if (conn->inCap - conn->inLen < READ_CHUNK) {
+            conn->inBuf = buffer_grow(conn->inBuf, conn->inLen,
+                    conn->inCap ? conn->inCap * 2 : READ_CHUNK * 2);
+            conn->inCap = buffer_capacity(conn->inBuf);
         }
-        if (i == argCount + 1 && split[i] != NULL) {
-            return 0;
+
+        ssize_t got = read(conn->fd, conn->inBuf + conn->inLen,
+                conn->inCap - conn->inLen);
+        if (got > 0) {
+            if (!conn->inLen && conn->parser.state == READING_HEADERS) {
+                conn->requestStart = now_usec(); // First bytes of a request
+            }
+            if (conn->parser.discardAll) {
+                conn->discarded += got;
+            }
+            conn->inLen += got;
+            add_stats(conn->stats, BYTES_IN, got);
+            budget = (budget > (size_t)got) ? budget - got : 0;
+        } else if (got == 0) { // Client finished sending
+            conn->peerClosed = true;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        } else if (errno != EINTR) {
+            connection_gone(conn);
         }
     }
+}
 
-    return 1;
+/* consume_input()
+ *
+ * This function removes bytes the HTTP parser has used from the front of the
+ * connection's input buffer, giving the buffer back to the buffer pool once
+ * it is empty so an idle connection holds no buffer at all. Must be called
+ * with the connection locked.
+ *
+ * conn: A pointer to an instance of the Connection struct.
+ * consumed: Number of bytes to remove.
+ */
+void consume_input(Connection* conn, size_t consumed)
+{
+    conn->inLen -= consumed;
+    memmove(conn->inBuf, conn->inBuf + consumed, conn->inLen);
+    if (!conn->inLen) {
+        buffer_free(conn->inBuf);
+        conn->inBuf = NULL;
+        conn->inCap = 0;
+    }
 }
 
-/* check_operation_arg_valid()
+/* admit_request()
  *
- * This function checks that the arguments of each operations are valid.
+ * This function decides whether a newly received request is admitted. It is
+ * shed if more than maxQueue requests are pending (including itself) or if
+ * the estimated pixel work of the pending requests has reached maxPixelWork
+ * (each limit only applies if it is larger than 0).
  *
- * split: Array of strings in the format of [operations, arg, arg2, ...].
- *        (This parameter is assumed to be a char** created by using
- *        split_by_char() function).
+ * stats: A pointer to an instance of the ServerStats struct.
+ * pending: Number of requests pending, including the new one.
  *
- * Returns: If the operation arguments are valid 1 is returned, otherwise 0.
+ * Returns: ADMITTED, or the reason for shedding the request.
  */
-int check_operation_arg_valid(char** split)
+ShedReason admit_request(ServerStats* stats, unsigned pending)
 {
-    char* type = split[0];
+    if (stats->maxQueue > 0 && pending > (unsigned)stats->maxQueue) {
+        return SHED_QUEUE;
+    }
+    if (stats->maxPixelWork > 0
+            && __atomic_load_n(&stats->pixelWork, __ATOMIC_RELAXED)
+                    >= (unsigned long)stats->maxPixelWork) {
+        return SHED_PIXEL_WORK;
+    }
 
-    if (!strcmp(type, "rotate") && !check_rotate_arg(split[1])) {
-        return 0;
+    return ADMITTED;
+}
+
+/* next_request()
+ *
+ * This function feeds the buffered input to the connection's HTTP parser,
+ * which uses up the request's headers and body as they arrive (so a body is
+ * never buffered twice, and one that is too large is never buffered at all).
+ * If a whole request has been received the time taken to receive it is
+ * recorded, it is given the connection's next sequence number and it counts
+ * as in flight (and as pending for admission control) until it has been
+ * answered. Whether it is admitted is decided straight away (see
+ * admit_request()). Must be called with the connection locked.
+ *
+ * conn: A pointer to an instance of the Connection struct.
+ *
+ * Returns: A newly allocated ClientRequest if a whole request was available,
+ *     otherwise NULL.
+ */
+ClientRequest* next_request(Connection* conn)
+{
+    HttpRequest http;
+    size_t consumed;
+    ParseStatus status = http_parser_feed(
+            &conn->parser, conn->inBuf, conn->inLen, &consumed, &http);
+
+    if (status == PARSE_ERROR) { // Malformed request - drop the client
+        conn->failed = true;
+        return NULL;
     }
-    if (!strcmp(type, "flip") && !check_flip_arg(split[1])) {
-        return 0;
+    consume_input(conn, consumed);
+    if (status == PARSE_INCOMPLETE) {
+        return NULL;
     }
-    if (!strcmp(type, "scale") && !check_scale_arg(split[1], split[2])) {
-        return 0;
+
+    // Any rest already belongs to the next request, which starts now
+    record_latency(conn->stats, BODY_READ, conn->requestStart);
+    if (conn->inLen) {
+        conn->requestStart = now_usec();
     }
 
-    return 1;
+    ClientRequest* request = malloc(sizeof(ClientRequest));
+    request->conn = conn;
+    request->http = http;
+    request->seq = conn->nextSeq++;
+    request->responded = false;
+    request->cancel.cancelled = &conn->cancelled;
+    request->cancel.deadline = 0;
+    conn->inFlight++;
+    conn->refCount++;
+    unsigned pending
+            = __atomic_add_fetch(&conn->stats->pending, 1, __ATOMIC_RELAXED);
+    request->admission = admit_request(conn->stats, pending);
+
+    return request;
 }
 
-/* check_image_operation()
+/* finish_request()
  *
- * This function checks that the image 'operation' (and its arguments) given
- * are valid.
+ * This function is called once a request has been answered. It no longer
+ * counts as in flight and, if the client already sent more input (or went
+ * away) while the request was being processed or the connection is to be
+ * closed, the reactor is woken so it can deal with that. A request that was
+ * never answered gets an empty response so the responses to later requests
+ * aren't held up, and the request no longer counts as pending. The number of
+ * allocations made for the request is recorded before it is freed.
  *
- * operation: An operation and it's argument in string format separated by
- *     commas.
+ * request: A pointer to the ClientRequest that has been answered (freed by
+ *     this function).
+ */
+void finish_request(ClientRequest* request)
+{
+    Connection* conn = request->conn;
+
+    if (!request->responded) {
+        queue_output(request, calloc(1, sizeof(OutputChunk)));
+    }
+    __atomic_sub_fetch(&conn->stats->pending, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&conn->lock);
+    conn->inFlight--;
+    if (conn->inLen || conn->peerClosed || conn->parser.discardAll) {
+        conn->wake = true;
+    }
+    update_interest(conn);
+    pthread_mutex_unlock(&conn->lock);
+
+    Arena* arena = &request->http.arena;
+    histogram_record(conn->stats->allocations[ARENA_ALLOCS], arena->allocs);
+    histogram_record(conn->stats->allocations[HEAP_ALLOCS], arena->heapAllocs);
+    free_http_request(&request->http);
+    free(request);
+    release_connection(conn);
+}
+
+/* service_connection()
  *
- * Returns: If the given 'operation' is invalid then 0 will return otherwise 1.
+ * This function is called by a reactor thread whenever epoll reports events
+ * for one of its connections. It reads new input, writes pending output,
+ * hands every completed request (up to the connection's in-flight limit) to
+ * the worker pool and closes the connection once the client has gone (or
+ * failed) and there is nothing left to do for it. A reactor never waits for
+ * the worker pool: a request that wasn't admitted, or that finds its request
+ * queue full, is answered straight away (see overloaded_response()).
+ *
+ * conn: A pointer to an instance of the Connection struct.
+ * events: The epoll events reported for the connection.
+ * pool: A pointer to an instance of the WorkerPool struct.
  */
-int check_image_operation(char* operation)
+void service_connection(Connection* conn, uint32_t events, WorkerPool* pool)
 {
-    // Split given operation string by a comma.
-    char* opCopy = strdup(operation);
-    char** split = split_by_char(opCopy, ',', 0);
-    int returnValue = 1;
+    pthread_mutex_lock(&conn->lock);
+    if (events & EPOLLIN) {
+        read_input(conn);
+    }
+    if ((events & (EPOLLERR | EPOLLHUP)) && !conn->writeShut) {
+        connection_gone(conn); // Reset (or failed) rather than finished
+    } else if ((events & (EPOLLERR | EPOLLHUP)) && !(events & EPOLLIN)) {
+        conn->failed = true;
+    }
+    flush_output(conn);
+    conn->wake = false;
 
-    if (split[0] == NULL) {
-        returnValue = 1;
+    // Parse ahead as far as the in-flight limit allows
+    ClientRequest* requests[MAX_PIPELINE_DEPTH];
+    int count = 0;
+    while (conn->inFlight < conn->maxInFlight && !conn->failed
+            && conn->inLen) {
+        ClientRequest* request = next_request(conn);
+        if (!request) {
+            break;
+        }
+        requests[count++] = request;
     }
 
-    // Check correct number of arguments
-    if (returnValue && !check_operation_arg_number(split)) {
-        returnValue = 0;
+    bool idle = !conn->inFlight && !conn->outHead;
+    bool done = conn->failed || (conn->peerClosed && idle);
+    if (!done && conn->parser.discardAll && idle) {
+        // The response to a request that was too large has been sent. Stop
+        // sending, but keep reading (so the response isn't lost to a reset)
+        // until the client stops or has sent too much more.
+        if (!conn->writeShut) {
+            shutdown(conn->fd, SHUT_WR);
+            conn->writeShut = true;
+        }
+        done = conn->discarded > MAX_DISCARD;
+    }
+    if (done) {
+        close_connection(conn);
+    } else {
+        update_interest(conn);
+    }
+    pthread_mutex_unlock(&conn->lock);
+
+    for (int i = 0; i < count; i++) {
+        ClientRequest* request = requests[i];
+        ShedReason reason = request->admission;
+        request->queuedAt = now_usec();
+        if (reason == ADMITTED && !workqueue_try_push(
+                        pool->requestQueues[conn->group], request)) {
+            reason = SHED_QUEUE;
+        }
+        if (reason != ADMITTED) {
+            overloaded_response(request, reason, pool->stats);
+            finish_request(request);
+        }
+    }
+    if (done) { // Drop the reactor's reference
+        release_connection(conn);
     }
+}
 
-    // Check that arguments are valid
-    if (returnValue && !check_operation_arg_valid(split)) {
-        returnValue = 0;
+/* finish_job()
+ *
+ * This function releases everything held by an ImageJob once it has left the
+ * pipeline and lets its connection continue. The job's estimated and actual
+ * costs are recorded (along with the nanoseconds it took per estimated pixel)
+ * so the estimates can be checked.
+ *
+ * job: A pointer to the ImageJob that has finished (freed by this function).
+ * pipeline: A pointer to the Pipeline.
+ */
+void finish_job(ImageJob* job, Pipeline* pipeline)
+{
+    if (job->imageMap) {
+        FreeImage_Unload(job->imageMap);
+    }
+    if (job->result) {
+        cache_release(pipeline->results, job->result);
+    } else {
+        free_encoded_image(job->output);
+    }
+    if (job->estimatedCost) { // The job went through the pipeline
+        ServerStats* stats = pipeline->stats;
+        histogram_record(stats->costs[ESTIMATED_COST], job->estimatedCost);
+        histogram_record(stats->costs[ACTUAL_COST], job->actualCost);
+        histogram_record(stats->costs[COST_RATIO],
+                job->actualCost * 1000 / job->estimatedCost);
+    }
+    free_plan(&job->plan);
+    set_pixel_work(job, pipeline->stats, 0);
+    finish_request(job->request);
+    free(job);
+}
+
+/* stage_thread()
+ *
+ * This is the thread function for each thread of a pipeline stage. It
+ * repeatedly takes the next job off its group's queue for the stage
+ * (recording how long it waited there), runs the stage on it (adding the time
+ * taken to the job's actual cost) and passes it on to the group's queue for
+ * the next stage (or finishes it). A job whose request has been cancelled is
+ * answered (see cancelled_response()) and finished instead, unless its result
+ * is already waiting to be sent.
+ *
+ * arg: Expected to be a pointer to the thread's StageThread struct.
+ *
+ * Returns: This function never returns.
+ */
+void* stage_thread(void* arg)
+{
+    StageThread* self = (StageThread*)arg;
+    Stage* stage = self->stage;
+    Pipeline* pipeline = stage->pipeline;
+
+    while (1) {
+        ImageJob* job = priorityqueue_pop(stage->queues[self->group]);
+        unsigned long start = now_usec();
+        record_latency(pipeline->stats, QUEUE_WAIT, job->queuedAt);
+        PipelineStage next = PIPELINE_DONE;
+        if (stage != &pipeline->stages[SEND_STAGE]
+                && cancel_requested(&job->request->cancel)) {
+            cancelled_response(job->request, false, pipeline->stats);
+        } else {
+            next = stage->function(job, pipeline);
+        }
+        job->queuedAt = now_usec();
+        job->actualCost += job->queuedAt - start;
+        if (next == PIPELINE_DONE) {
+            finish_job(job, pipeline);
+        } else {
+            priorityqueue_push(pipeline->stages[next].queues[job->group], job,
+                    job->priority);
+        }
+    }
+
+    return NULL;
+}
+
+/* group_threads()
+ *
+ * This function shares out threads between the placement groups in
+ * proportion to their number of worker CPUs.
+ *
+ * placement: A pointer to the Placement.
+ * group: The group to find the number of threads for.
+ * total: Number of threads to share out.
+ *
+ * Returns: The group's share of the threads (at least 1).
+ */
+int group_threads(const Placement* placement, int group, int total)
+{
+    if (placement->count == 1) {
+        return total;
+    }
+
+    int cpus = 0;
+    for (int i = 0; i < placement->count; i++) {
+        cpus += cpuset_count(&placement->workerCpus[i]);
+    }
+    int threads = total * cpuset_count(&placement->workerCpus[group]) / cpus;
+
+    return (threads > 0) ? threads : 1;
+}
+
+/* create_pipeline()
+ *
+ * This function creates the image pipeline. Each stage gets its own bounded
+ * priority queue and its own group of threads so that a slow stage of one
+ * request doesn't hold up a different stage of another. Every placement group
+ * gets its own queues, its share of each stage's threads and its own TaskPool
+ * (with a thread per stage CPU, or per online CPU if stage threads aren't
+ * placed), all running on the group's stage CPUs.
+ *
+ * threads: Number of threads for each stage (indexed by PipelineStage).
+ * placement: A pointer to the Placement of the server's threads.
+ * stats: A pointer to an instance of the ServerStats struct.
+ * parallelPixels: Least amount of pixel work for which an image operation is
+ *     split across a TaskPool.
+ * results: A pointer to the Cache of encoded results (NULL if disabled).
+ * decoded: A pointer to the Cache of decoded images (NULL if disabled).
+ * compression: Default FreeImage PNG flags for encoding results.
+ *
+ * Returns: A pointer to the newly created Pipeline.
+ */
+Pipeline* create_pipeline(const int* threads, const Placement* placement,
+        ServerStats* stats, int parallelPixels, Cache* results,
+        Cache* decoded, int compression)
+{
+    StageFunction functions[STAGE_COUNT]
+            = {decode_stage, transform_stage, encode_stage, send_stage};
+    Pipeline* pipeline = malloc(sizeof(Pipeline));
+    pipeline->groups = placement->count;
+    pipeline->stats = stats;
+    pipeline->results = results;
+    pipeline->decoded = decoded;
+    pipeline->compression = compression;
+
+    for (int g = 0; g < placement->count; g++) {
+        const CpuSet* cpus = &placement->stageCpus[g];
+        int taskThreads = cpuset_count(cpus) ? cpuset_count(cpus)
+                                             : online_cpus();
+        pipeline->tasks[g] = taskpool_create(taskThreads, parallelPixels, cpus);
+    }
+
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        Stage* stage = &pipeline->stages[i];
+        stage->name = stageNames[i];
+        stage->function = functions[i];
+        stage->threads = 0;
+        stage->pipeline = pipeline;
+        for (int g = 0; g < placement->count; g++) {
+            int count = group_threads(placement, g, threads[i]);
+            stage->queues[g]
+                    = priorityqueue_create(count * STAGE_QUEUE_PER_THREAD);
+            stage->threads += count;
+            for (int j = 0; j < count; j++) {
+                StageThread* self = malloc(sizeof(StageThread));
+                self->stage = stage;
+                self->group = g;
+                pthread_t threadID;
+                pthread_create(&threadID, NULL, stage_thread, self);
+                place_thread(threadID, &placement->stageCpus[g]);
+                pthread_detach(threadID);
+            }
+        }
     }
 
-    free(opCopy);
-    free(split);
-
-    return returnValue;
+    return pipeline;
 }
 
-/* check_post_request()
+/* reactor_thread()
  *
- * This function checks that a given POST request is valid. It's validity will
- * depend on if the address is in a valid format
+ * This is the thread function for each epoll reactor. It waits for events on
+ * the connections it watches and services them. No thread is ever blocked on
+ * an idle connection.
  *
- * fd: Socket file descriptor for an accepted connection
- * method: Method of HTTP request
- * address: Address of HTTP request
- * stats: A pointer to an instance of the ServerStats struct.
+ * arg: Expected to be a pointer to an instance of the Reactor struct.
  *
- * Returns: If the POST request is valid then an array of strings
- *     (NULL terminated) will be returned.
+ * Returns: This function never returns.
  */
-char** check_post_request(
-        int fd, char* method, char* address, ServerStats* stats)
+void* reactor_thread(void* arg)
 {
-    // Check method is POST
-    if (strcmp(method, "POST")) {
-        return 0;
-    }
+    Reactor* reactor = (Reactor*)arg;
+    struct epoll_event events[REACTOR_EVENTS];
 
-    bool invalidResp = false;
-
-    // Split address by '/'
-    char** operations = split_by_char(address, '/', 0);
-    int i = 1;
-    // If request address contains nothing or doesn't start with '/'
-    if (strcmp(operations[0], "") || operations[0] == NULL) {
-        invalidResp = true;
-    }
-
-    // Loop over each operation request
-    while (operations[i] != NULL && !invalidResp) {
-        // Check each operation is in the right format
-        if (!check_image_operation(operations[i])) {
-            invalidResp = true;
+    while (1) {
+        int count = epoll_wait(reactor->epollFd, events, REACTOR_EVENTS, -1);
+        for (int i = 0; i < count; i++) {
+            service_connection(
+                    events[i].data.ptr, events[i].events, reactor->pool);
         }
-        i++;
     }
 
-    if (invalidResp) { // If invalid POST request sent fail HTTP response
-        // Construct http response
-        HttpHeader** headers = create_header("text/plain");
-        char* message = "Invalid operation requested\n";
-        int messageLen = strlen(message);
-        const char* explanation = "Bad Request";
+    return NULL;
+}
 
-        // Send http resposne
-        send_http_response(fd, BAD_POST, explanation, headers,
-                (unsigned char*)message, messageLen);
-        change_stats(stats, HTTP_FAIL);
-        free(operations);
-        return NULL;
+/* create_reactors()
+ *
+ * This function creates the epoll reactors and starts a thread for each.
+ *
+ * count: Number of reactors to create.
+ * pool: A pointer to the WorkerPool that completed requests are handed to.
+ * pipelineDepth: Most requests each connection may have in flight.
+ *
+ * Returns: An array of 'count' Reactor structs.
+ */
+Reactor* create_reactors(int count, WorkerPool* pool, int pipelineDepth)
+{
+    Reactor* reactors = malloc(sizeof(Reactor) * count);
+
+    for (int i = 0; i < count; i++) {
+        reactors[i].epollFd = epoll_create1(0);
+        reactors[i].pool = pool;
+        reactors[i].pipelineDepth = pipelineDepth;
+        pthread_create(
+                &reactors[i].thread, NULL, reactor_thread, &reactors[i]);
+        pthread_detach(reactors[i].thread);
     }
 
-    return operations;
+    return reactors;
 }
 
-/* check_image_size()
- *
- * This function checks if the image from the HTTP response is too large.
+/* queue_overload_response()
  *
- * fd: Socket file descriptor to an accepted connection.
- * imageSize: Size of image in bytes.
- * stats: A pointer to instance of the ServerStats struct.
+ * This function queues the response sent to a connection that is shed: a
+ * Service Unavailable response asking the client to try again after
+ * retryAfterSeconds. Everything the client sends is thrown away, and once the
+ * response has been written the connection is closed.
  *
- * Returns: If the image size is valid then the function 0 is returned.
- *     Otherwise 1.
+ * conn: A pointer to the (new) Connection being shed.
  */
-int check_image_size(int fd, unsigned long imageSize, ServerStats* stats)
+void queue_overload_response(Connection* conn)
 {
-    // Check if image size too large
-    if (imageSize > MAX_IMAGE_SIZE) {
-        HttpHeader** headers = create_header("text/plain");
+    HttpHeader retryAfter = {"Retry-After", (char*)retryAfterSeconds};
+    HttpHeader contentType = {"Content-Type", "text/plain"};
+    HttpHeader connection = {"Connection", "close"};
+    HttpHeader* headers[] = {&retryAfter, &contentType, &connection, NULL};
+    size_t bodySize = strlen(overloadMessage);
+
+    char head[RESPONSE_HEAD_SIZE];
+    size_t headLen = format_response_head(head, SERVICE_UNAVAILABLE,
+            "Service Unavailable", headers, bodySize);
+    OutputChunk* chunk = calloc(1, sizeof(OutputChunk) + headLen + bodySize);
+    memcpy(chunk->head, head, headLen);
+    memcpy(chunk->head + headLen, overloadMessage, bodySize);
+    chunk->headLen = headLen + bodySize;
+
+    append_output(conn, chunk);
+    http_parser_discard_all(&conn->parser);
+    conn->events |= EPOLLOUT;
+}
 
-        // Create HTTP response message
-        size_t messageSize = SIZE_ERROR_MSG_DEFAULT + sizeof(imageSize);
-        char* message = malloc(sizeof(char) * messageSize);
-        snprintf(message, messageSize, "Image is too large: %lu bytes\n",
-                imageSize);
-        int messageLen = strlen(message);
-        const char* explanation = "Payload Too Large";
+/* add_connection()
+ *
+ * This function creates the Connection for a newly accepted client and adds
+ * it to the given reactor. A connection that is being shed is only sent the
+ * overload response (see queue_overload_response()) and isn't counted as a
+ * client. The reactor holds a reference to the connection until the
+ * connection is closed.
+ *
+ * fd: Socket file descriptor of the accepted connection.
+ * reactor: A pointer to the Reactor that will watch the connection.
+ * group: The placement group that will handle the connection's requests.
+ * stats: A pointer to an instance of the ServerStats struct.
+ * shed: True if the connection is being shed rather than admitted.
+ */
+void add_connection(int fd, Reactor* reactor, int group, ServerStats* stats,
+        bool shed)
+{
+    Connection* conn = calloc(1, sizeof(Connection));
+    conn->fd = fd;
+    conn->group = group;
+    conn->epollFd = reactor->epollFd;
+    pthread_mutex_init(&conn->lock, NULL);
+    conn->refCount = 1;
+    conn->events = EPOLLIN;
+    conn->maxInFlight = reactor->pipelineDepth;
+    http_parser_init(&conn->parser, MAX_IMAGE_SIZE);
+    conn->stats = stats;
+    conn->shed = shed;
+    if (shed) {
+        queue_overload_response(conn);
+    } else {
+        change_stats(stats, CONNECT);
+    }
 
-        // Send http response
-        send_http_response(fd, IMAGE_TOO_LARGE, explanation, headers,
-                (unsigned char*)message, messageLen);
-        change_stats(stats, HTTP_FAIL);
-        free(message);
+    set_nonblocking(fd);
+    struct epoll_event event;
+    event.events = conn->events;
+    event.data.ptr = conn;
+    epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, fd, &event);
+}
 
-        return 1;
-    }
+/* query_flag()
+ *
+ * This function checks whether a flag is set in a request's query string. A
+ * flag is set if it is present with no value or any value other than "0" or
+ * "false" (e.g. "?exact" or "?exact=1").
+ *
+ * query: The query string of the request.
+ * name: Name of the flag.
+ *
+ * Returns: True if the flag is set, otherwise false.
+ */
+bool query_flag(const char* query, const char* name)
+{
+    char* value = get_query_param(query, name);
+    bool set = value && strcmp(value, "0") && strcmp(value, "false");
+    free(value);
 
-    return 0;
+    return set;
 }
 
-/* invalid_image_response()
+/* body_key()
  *
- * This function creates and sends an invalid image HTTP response to a specified
- * client.
+ * This function builds the key that identifies an uploaded image in the
+ * caches: a hash and the length of the image.
+ *
+ * http: A pointer to the HttpRequest containing the image.
  *
- * fd: Socket file descriptor of an accepted connection.
+ * Returns: The key (allocated from the request's arena).
  */
-void invalid_image_response(int fd)
+char* body_key(HttpRequest* http)
 {
-    char* message = "Invalid image received\n";
-    int messageLen = strlen(message);
-    const char* explanation = "Unprocessable Content";
-    HttpHeader** headers = create_header("text/plain");
+    char* key = arena_alloc(&http->arena, BODY_KEY_SIZE);
 
-    // Send http response
-    send_http_response(fd, BAD_IMAGE, explanation, headers,
-            (unsigned char*)message, messageLen);
+    snprintf(key, BODY_KEY_SIZE, "%016llx:%lu",
+            (unsigned long long)hash64(http->body, http->len, 0), http->len);
+
+    return key;
 }
 
-/* operation_failed_response()
+/* result_key()
  *
- * This function creates and sends an operation failed HTTP response to a
- * specified client.
+ * This function builds the key that the result of an image request is cached
+ * under: the key of the image, whether exact results were requested and a
+ * output format and PNG compression used and a canonical description of the
+ * planned operations. Requests with the same image, output and operations
+ * that have the same effect share a key.
  *
- * fd: Socket file descriptor of an accepted connection.
- * failedOperation: The operation type which is one of 'rotate', 'flip' or
- *     'scale' that the program failed at.
+ * job: A pointer to the (planned) ImageJob.
+ *
+ * Returns: The key (allocated from the request's arena).
  */
-void operation_error_response(int fd, char* failedOperation)
+char* result_key(ImageJob* job)
 {
-    // Create HTTP resposne
-    HttpHeader** headers = create_header("text/plain");
-    size_t messageSize = OP_ERROR_MSG_DEFAULT + sizeof(failedOperation);
-    char* message = malloc(sizeof(char) * messageSize);
-    snprintf(message, messageSize, "Operation did not complete: %s\n",
-            failedOperation);
-    int messageLen = strlen(message);
-    const char* explanation = "Not Implemented";
+    char* description = describe_plan(&job->plan);
+    size_t size = strlen(job->bodyKey) + strlen(description) + BODY_KEY_SIZE;
+    char* key = arena_alloc(&job->request->http.arena, size);
 
-    // Send HTTP response
-    send_http_response(fd, OPERATION_ERROR, explanation, headers,
-            (unsigned char*)message, messageLen);
-    free(message);
+    snprintf(key, size, "%s:%d:%s:%d%s", job->bodyKey, job->exact,
+            job->encoder->name, job->compression, description);
+    free(description);
+
+    return key;
 }
 
-/* operation_success_response()
+/* send_cached_result()
  *
- * This function creates and sends a success HTTP response to a specified
- * client. This function should only be called when all image operations
- * have succeeded.
+ * This function answers an image request from the result cache if an
+ * identical request has been answered before.
  *
- * fd: Socket file descriptor of an accepted connection.
- * imageMap: A pointer to a FIBITMAP struct instance.
+ * job: A pointer to the (planned) ImageJob.
+ * pipeline: A pointer to the Pipeline (whose result cache is enabled).
+ *
+ * Returns: True if the request was answered, false if its result isn't
+ *     cached (in which case job->resultKey has been set for caching it).
  */
-void operation_success_response(int fd, FIBITMAP* imageMap)
+bool send_cached_result(ImageJob* job, Pipeline* pipeline)
 {
-    // Convert image from BITMAP to raw binary data
-    unsigned long imageSize;
-    unsigned char* image = fi_save_png_image_to_buffer(imageMap, &imageSize);
+    job->resultKey = result_key(job);
+    CacheEntry* entry = cache_get(
+            pipeline->results, job->resultKey, strlen(job->resultKey));
+    if (!entry) {
+        return false;
+    }
 
-    // Create HTTP response
-    HttpHeader** headers = create_header("image/png");
-    const char* explanation = "OK";
+    EncodedImage* output = entry->value;
+    send_body_response(job->request, SUCCESS, "OK",
+            create_image_headers(job->request, job->encoder, output),
+            output->data, output->size, release_result, pipeline->results,
+            entry);
+    add_stats(pipeline->stats, OPERATE_IMAGE, job->plan.requested);
+    change_stats(pipeline->stats, HTTP_SUCCESS);
 
-    // Send HTTP response
-    send_http_response(fd, SUCCESS, explanation, headers, image, imageSize);
-    free(image);
-    FreeImage_Unload(imageMap);
+    return true;
 }
 
-/* operate_on_image()
+/* request_compression()
  *
- * This function performs all the types of image manipulation specified within
- * 'operations' on a given 'imageMap'.
+ * This function finds the PNG compression level for an image request: given
+ * by the "compression" query parameter or else the X-Compression header (see
+ * parse_png_level()), otherwise the server's default. An invalid level is
+ * answered with a fail HTTP response.
  *
- * fd: Socket file descriptor of an accepted connection.
- * imageMap: A pointer to a FIBITMAP struct instance.
- * operations: An array of strings in the format of [operation,arg,...].
- *     (Assumed to a char** type created by using the split_by_char() function).
- * stats: A pointer to a ServerStats struct instance.
+ * request: A pointer to the ClientRequest being handled.
+ * pipeline: A pointer to the Pipeline.
  *
- * Returns: If any operations 'rotate', 'flip' or 'scale' was unsuccessful for
- *     some reason the function returns NULL. Otherwise a new modified pointer
- *     to instance of FIBITMAP is returned.
+ * Returns: The FreeImage PNG flags to encode with, or -1 if the level was
+ *     invalid.
  */
-FIBITMAP* operate_on_image(
-        int fd, FIBITMAP* imageMap, char** operations, ServerStats* stats)
+int request_compression(ClientRequest* request, Pipeline* pipeline)
 {
-    int32_t flipStatus = -1;
-    int i = 1;
-    FIBITMAP* tempMap = NULL;
-    FIBITMAP* returnMap = imageMap;
-
-    // Loop over each operation and split
-    while (operations[i] != NULL) {
-        tempMap = returnMap;
-        char** singleOp = split_by_char(operations[i], ',', 0);
-
-        if (!strcmp(singleOp[0], "rotate")) { // Rotate operation
-            double degrees = atoi(singleOp[1]);
-            returnMap = FreeImage_Rotate(returnMap, degrees, NULL);
-            FreeImage_Unload(tempMap);
-        } else if (!strcmp(singleOp[0], "scale")) { // Scale operation
-            int width = atoi(singleOp[1]);
-            int height = atoi(singleOp[2]);
-            returnMap = FreeImage_Rescale(
-                    returnMap, width, height, FILTER_BILINEAR);
-            FreeImage_Unload(tempMap);
-        } else if (!strcmp(singleOp[0], "flip")) { // Flip operation
-            if (!strcmp(singleOp[1], "h")) {
-                flipStatus = FreeImage_FlipHorizontal(returnMap);
-            } else {
-                flipStatus = FreeImage_FlipVertical(returnMap);
-            }
-        }
-        // Check if operation failed
-        if (returnMap == NULL || !flipStatus) {
-            operation_error_response(fd, singleOp[0]); // Send fail response
-            change_stats(stats, HTTP_FAIL);
-            free(singleOp);
-            return NULL;
-        }
-        change_stats(stats, OPERATE_IMAGE);
-        free(singleOp);
-        i++;
+    HttpRequest* http = &request->http;
+    char* value = get_query_param(http->query, "compression");
+    const char* level = value
+            ? value
+            : get_header_value(http->headers, "X-Compression");
+    int compression = level ? parse_png_level(level) : pipeline->compression;
+    free(value);
+
+    if (compression == -1) {
+        char* message = "Invalid compression level\n";
+        send_http_response(request, BAD_POST, "Bad Request",
+                create_header(request, "text/plain"), (unsigned char*)message,
+                strlen(message));
+        change_stats(pipeline->stats, HTTP_FAIL);
     }
-    return returnMap;
+
+    return compression;
 }
 
-/* process_image()
+/* request_encoder()
  *
- * This function 'processes' the given 'image' firstly by trying to load it
- * into a FIBITMAP and then sending it off to be manipulated. If loading the
- * image to a FIBITMAP fails (meaning that it is an invalid image) the function
- * will send a fail HTTP response to the specified client. If the loading and
- * image manipulations were all successful a success HTTP request with the body
- * as the new image will be sent to the specified client.
+ * This function chooses the output format for an image request from its
+ * Accept header (see negotiate_encoder()). If the client accepts none of the
+ * formats a fail HTTP response is sent.
  *
- * fd: Socket file descriptor of an accepted connection.
- * image: The image to be manipulated.
- * imageSize: The size of the given 'image'.
- * operations: An array of strings in the format of [operation,arg,...].
- *     (Assumed to a char** type created by using the split_by_char() function).
+ * request: A pointer to the ClientRequest being handled.
  * stats: A pointer to an instance of the ServerStats struct.
  *
- * Returns: If the loading of image to a FIBITMAP fails or any operations on an
- *     image fails for some reason 0 is returned. Otherwise 1.
+ * Returns: The chosen encoder, or NULL if none was acceptable.
  */
-int process_image(int fd, unsigned char* image, unsigned long imageSize,
-        char** operations, ServerStats* stats)
+const ImageEncoder* request_encoder(ClientRequest* request, ServerStats* stats)
 {
-    // Try loading image into BITMAP
-    FIBITMAP* imageMap = fi_load_image_from_buffer(image, imageSize);
-    if (imageMap == NULL) { // Loading image failed
-        invalid_image_response(fd);
+    const ImageEncoder* encoder = negotiate_encoder(
+            get_header_value(request->http.headers, "Accept"));
+
+    if (!encoder) {
+        char* message = "No acceptable image format\n";
+        send_http_response(request, NOT_ACCEPTABLE, "Not Acceptable",
+                create_header(request, "text/plain"), (unsigned char*)message,
+                strlen(message));
         change_stats(stats, HTTP_FAIL);
-        free(operations);
-        return 0;
     }
 
-    // Do all image operation requests
-    imageMap = operate_on_image(fd, imageMap, operations, stats);
+    return encoder;
+}
 
-    // Check if operations on the image failed.
-    if (imageMap == NULL) {
-        free(operations);
-        return 0;
+/* set_deadline()
+ *
+ * This function sets the deadline of a request: the sooner of the time given
+ * by its X-Request-Timeout header and the server's default, both in
+ * milliseconds from when the request was received. A header value that isn't
+ * a positive number is ignored, and one too large to be a valid --deadline
+ * (over INT_MAX) is taken as INT_MAX so it can't overflow.
+ *
+ * request: A pointer to the ClientRequest.
+ * deadlineMs: The server's default deadline (0 meaning no deadline).
+ */
+void set_deadline(ClientRequest* request, int deadlineMs)
+{
+    unsigned long timeout = deadlineMs;
+    char* value = get_header_value(request->http.headers, timeoutHeader);
+
+    if (value && *value && strspn(value, "0123456789") == strlen(value)) {
+        errno = 0;
+        unsigned long requested = strtoul(value, NULL, 10);
+        if (errno == ERANGE || requested > INT_MAX) {
+            requested = INT_MAX;
+        }
+        if (requested && (!timeout || requested < timeout)) {
+            timeout = requested;
+        }
     }
-
-    // If everything was successful send it to the client.
-    operation_success_response(fd, imageMap);
-    change_stats(stats, HTTP_SUCCESS);
-    free(operations);
-    return 1;
+    request->cancel.deadline
+            = timeout ? request->queuedAt + timeout * 1000 : 0;
 }
 
-/* process_request()
+/* handle_request()
  *
- * This function processes a received HTTP request from a client in the
- * following order:
- * 1. Check that the request method is either a GET or POST.
- * 2. If a GET request is received check that the address of the HTTP request is
- *    valid.
- * 3. If a POST request is received check that the address of the HTTP request
- *    is valid.
- * 4. Check that the image received (body) within the HTTP request is of valid
- *    size.
+ * This function validates a single client request. A request whose deadline
+ * passed while it was queued is turned away (see cancelled_response()).
+ * Invalid requests and GET requests are answered straight away, as are image
+ * requests whose result is cached. Any other valid image request is planned,
+ * its cost is estimated and it is passed on to the first stage of the image
+ * pipeline.
  *
- * fd: Socket file descriptor of an accepted connection.
- * method: Method of HTTP request.
- * address: Address of HTTP request.
- * len: Length of the body of the HTTP request.
- * stats: A pointer to an instance of the ServerStats struct.
+ * request: A pointer to the ClientRequest to be handled.
+ * pool: A pointer to an instance of the WorkerPool struct.
  *
- * Returns: If the received HTTP request was a POST request and includes a
- *     valid POST address then the function will return a char** type created
- *     from split_by_char() function which includes all the image operations
- *     requested. Otherwise NULL will be returned.
+ * Returns: True if the request was passed on to the image pipeline (which then
+ *     finishes it), false if it has already been answered.
  */
-char** process_request(int fd, char* method, char* address, unsigned long len,
-        ServerStats* stats)
+bool handle_request(ClientRequest* request, WorkerPool* pool)
 {
-    // Validate the request's method and GET requests
-    if (check_method(fd, method, stats)
-            || check_get_request(fd, method, address, stats)) {
-        return NULL;
+    HttpRequest* http = &request->http;
+
+    set_deadline(request, pool->deadlineMs);
+    if (cancel_requested(&request->cancel)) {
+        cancelled_response(request, false, pool->stats);
+        return false;
     }
 
-    // Check POST request
-    char** operations = check_post_request(fd, method, address, stats);
+    // Check for invalid requests
+    char** operations = process_request(
+            request, http->method, http->address, http->len, pool);
+    if (!operations) {
+        return false;
+    }
 
-    // Check if POST request was valid
-    if (operations == NULL) {
-        return NULL;
+    const ImageEncoder* encoder = request_encoder(request, pool->stats);
+    int compression
+            = encoder ? request_compression(request, pool->pipeline) : -1;
+    if (compression == -1) {
+        return false;
     }
 
-    // Check if image size is valid
-    if (check_image_size(fd, len, stats)) {
-        free(operations);
-        return NULL;
+    ImageJob* job = calloc(1, sizeof(ImageJob));
+    job->request = request;
+    job->group = request->conn->group;
+    job->operations = operations;
+    job->encoder = encoder;
+    job->compression = compression;
+    job->exact = query_flag(http->query, "exact");
+    job->plan = plan_operations(operations + 1, job->exact);
+    if (pool->pipeline->results || pool->pipeline->decoded) {
+        job->bodyKey = body_key(http);
+    }
+    if (pool->pipeline->results && send_cached_result(job, pool->pipeline)) {
+        finish_job(job, pool->pipeline);
+        return true;
     }
 
-    return operations;
+    // Estimate the job's cost from the size in its image header (or, if
+    // that can't be found, the size of the upload in bytes)
+    unsigned long width, height;
+    unsigned long pixels = peek_image_size(http->headers, http->body,
+                                   http->len, &width, &height)
+            ? width * height
+            : http->len;
+    job->estimatedCost = pixel_work(job, pixels);
+    set_pixel_work(job, pool->stats, job->estimatedCost);
+
+    // Now send the image down the pipeline
+    job->queuedAt = now_usec();
+    job->priority
+            = job->queuedAt + job->estimatedCost / AGING_PIXELS_PER_USEC;
+    priorityqueue_push(pool->pipeline->stages[DECODE_STAGE].queues[job->group],
+            job, job->priority);
+
+    return true;
 }
 
-/* free_http_request()
+/* worker_thread()
  *
- * This function frees all the necessary dynamically allocated memory for a
- * HTTP request.
+ * This is the thread function for each thread of the worker pool. It
+ * repeatedly takes the next fully received request off its group's request
+ * queue (recording how long it waited there) and handles it. Requests that
+ * were answered here let their connection continue straight away.
  *
- * method: Method of HTTP request
- * address: Address of HTTP request
- * body: Body of HTTP request
- * headers: Headers of HTTP request
+ * arg: Expected to be a pointer to the thread's WorkerThread struct.
+ *
+ * Returns: This function never returns.
  */
-void free_http_request(
-        char* method, char* address, unsigned char* body, HttpHeader** headers)
+void* worker_thread(void* arg)
 {
-    free(method);
-    free(address);
-    free(body);
-    free_array_of_headers(headers);
+    WorkerThread* self = (WorkerThread*)arg;
+    WorkerPool* pool = self->pool;
+
+    while (1) {
+        ClientRequest* request
+                = workqueue_pop(pool->requestQueues[self->group]);
+        record_latency(pool->stats, QUEUE_WAIT, request->queuedAt);
+        if (!handle_request(request, pool)) {
+            finish_request(request);
+        }
+    }
+
+    return NULL;
 }
 
-/* client_thread()
+/* create_worker_pool()
  *
- * This is a server thread function for each client connected to the server.
- * This function repeatedly waits for a HTTP request and once upon receiving one
- * it will process it.
+ * This function creates the fixed-size worker pool and starts all of the
+ * worker threads. Every placement group gets its own bounded request queue
+ * and its share of the workers, which run on the group's worker CPUs. A
+ * request queue has room for every pending request the server admits (up to
+ * MAX_REQUEST_QUEUE), so it is only found full when that limit is larger or
+ * there is none.
  *
- * arg: Expected to a pointer to an instance of ClientData struct.
+ * workers: Number of worker threads to start.
+ * placement: A pointer to the Placement of the server's threads.
+ * pipeline: A pointer to the Pipeline that image requests are passed on to.
+ * homePage: A pointer to the HomePage that is served for "GET /".
+ * deadlineMs: Default deadline of requests in milliseconds (0 for none).
  *
- * Returns: This function only returns NULL.
+ * Returns: A pointer to the newly created WorkerPool.
  */
-void* client_thread(void* arg)
+WorkerPool* create_worker_pool(int workers, const Placement* placement,
+        Pipeline* pipeline, HomePage* homePage, int deadlineMs)
 {
-    ClientData* data = (ClientData*)arg;
-    ServerStats* stats = data->serverStats;
-    int fd = data->clientFd;
-    FILE* stream = fdopen(fd, "r");
-    change_stats(stats, CONNECT);
-
-    // Request info
-    char *method, *address;
-    unsigned char* body;
-    unsigned long len;
-    HttpHeader** headers;
-
-    // Loop to continuosly handle HTTP requests
-    while (1) {
-        if (get_HTTP_request(
-                    stream, &method, &address, &headers, &body, &len)) {
-
-            // Check for invalid requests
-            char** operations
-                    = process_request(fd, method, address, len, stats);
-
-            if (!operations) { // If invalid request
-                free_http_request(method, address, body, headers);
-                continue;
-            }
+    WorkerPool* pool = malloc(sizeof(WorkerPool));
+    pool->pipeline = pipeline;
+    pool->stats = pipeline->stats;
+    pool->homePage = homePage;
+    pool->deadlineMs = deadlineMs;
+
+    for (int g = 0; g < placement->count; g++) {
+        int count = group_threads(placement, g, workers);
+        int capacity = count * REQUEST_QUEUE_PER_WORKER;
+        int maxQueue = pool->stats->maxQueue;
+        if (maxQueue > capacity) {
+            capacity = (maxQueue < MAX_REQUEST_QUEUE) ? maxQueue
+                                                      : MAX_REQUEST_QUEUE;
+        }
+        pool->requestQueues[g] = workqueue_create(capacity);
+        for (int i = 0; i < count; i++) {
+            WorkerThread* self = malloc(sizeof(WorkerThread));
+            self->pool = pool;
+            self->group = g;
+            pthread_t threadID;
+            pthread_create(&threadID, NULL, worker_thread, self);
+            place_thread(threadID, &placement->workerCpus[g]);
+            pthread_detach(threadID);
+        }
+    }
 
-            // Now process image
-            process_image(fd, body, len, operations, stats);
+    return pool;
+}
 
-            // Free necessary information
-            free_http_request(method, address, body, headers);
-        } else { // Client disconnected
-            break;
-        }
+/* admit_connection()
+ *
+ * This function decides whether a newly accepted connection is admitted. It
+ * is shed if maxConns connections have already been admitted, if maxQueue
+ * requests are already pending or if the estimated pixel work of those
+ * requests has reached maxPixelWork (each limit only applies if it is larger
+ * than 0). An admitted connection counts as admitted until it is closed.
+ * Several listeners may admit connections at once, so a connection is counted
+ * before the limits are checked (and no longer counted if it is shed).
+ *
+ * stats: A pointer to an instance of the ServerStats struct.
+ *
+ * Returns: ADMITTED, or the reason for shedding the connection.
+ */
+ShedReason admit_connection(ServerStats* stats)
+{
+    ShedReason reason = ADMITTED;
+    unsigned admitted
+            = __atomic_add_fetch(&stats->admitted, 1, __ATOMIC_RELAXED);
+
+    if (stats->maxConns > 0 && admitted > (unsigned)stats->maxConns) {
+        reason = SHED_CONNECTIONS;
+    } else if (stats->maxQueue > 0
+            && __atomic_load_n(&stats->pending, __ATOMIC_RELAXED)
+                    >= (unsigned)stats->maxQueue) {
+        reason = SHED_QUEUE;
+    } else if (stats->maxPixelWork > 0
+            && __atomic_load_n(&stats->pixelWork, __ATOMIC_RELAXED)
+                    >= (unsigned long)stats->maxPixelWork) {
+        reason = SHED_PIXEL_WORK;
     }
 
-    // Clean up and exit
-    change_stats(stats, DISCONNECT);
-    if (stats->maxConns > 0) {
-        sem_post(&(stats->maxConnsLock));
+    if (reason != ADMITTED) {
+        __atomic_sub_fetch(&stats->admitted, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats->shed[reason], 1, __ATOMIC_RELAXED);
     }
-    fclose(stream);
-    free(data);
-    return NULL;
+
+    return reason;
 }
 
 /* process_connections()
  *
- * This function is responsible for handling incoming client connections on the
- * server. It continuously loops to accept incoming connection requests from
- * clients. If maxConns is specified (an integer larger than 0) then it will
- * make sure to limit the amount of clients connected to the server at a time
- * using semaphores. Once a client is accepted it will be put in a thread and
- * sent off.
+ * This function is responsible for handling incoming client connections on
+ * one of the server's listening sockets. It continuously loops to accept
+ * incoming connection requests from clients. Every client is accepted
+ * straight away, but when the server is at its connection limit or
+ * overloaded (see admit_connection()) the client is only told to try again
+ * later, so that it can go elsewhere instead of waiting. Once a client is
+ * accepted it is handed to one of the listener's reactors (in turn) which
+ * then looks after all I/O for that client, and its requests are handled by
+ * the placement group of the NUMA node it was accepted on.
  *
- * fdServer: Socket file descriptor representing the endpoint for communication
- * maxConns: An integer representing the maximum connections possible at a given
- *     time for the server.
- * stats: A pointer to an instance of the ServerStats struct
+ * listener: A pointer to the Listener to accept connections for.
  *
  * REF: This function is inspired by server-multithreaded.c given during week 10
  * REF: lectures.
  */
-void process_connections(int fdServer, int maxConns, ServerStats* stats)
+void process_connections(Listener* listener)
 {
+    int fdServer = listener->fd;
+    Reactor* reactors = listener->reactors;
+    int reactorCount = listener->reactorCount;
+    ServerStats* stats = listener->stats;
     int fd;
     struct sockaddr_in fromAddr;
     socklen_t fromAddrSize;
+    int nextReactor = 0;
 
     // Repeatedly accept connections
     while (1) {
-        // Check max connections
-        if (maxConns > 0) {
-            sem_wait(&stats->maxConnsLock);
-        }
-
         fromAddrSize = sizeof(struct sockaddr_in);
         // Block, waiting for a new connection.
         fd = accept(fdServer, (struct sockaddr*)&fromAddr, &fromAddrSize);
         if (fd < 0) { // If connection could NOT be accepted
-            if (maxConns > 0) {
-                sem_post(&stats->maxConnsLock);
-            }
             continue;
         }
 
-        // Turn our client address
-        char hostname[NI_MAXHOST];
-        getnameinfo((struct sockaddr*)&fromAddr, fromAddrSize, hostname,
-                NI_MAXHOST, NULL, 0, 0);
+        // Hand the client over to the next reactor
+        bool shed = admit_connection(stats) != ADMITTED;
+        int group = listener->placement->groupOf[current_node()];
+        add_connection(fd, &reactors[nextReactor], group, stats, shed);
+        nextReactor = (nextReactor + 1) % reactorCount;
+    }
+}
+
+/* listener_thread()
+ *
+ * This is the thread function for each listener apart from the first (whose
+ * connections are accepted by the main thread).
+ *
+ * arg: Expected to be a pointer to the Listener.
+ *
+ * Returns: This function never returns.
+ */
+void* listener_thread(void* arg)
+{
+    process_connections((Listener*)arg);
 
-        // Create thread for a single client
-        ClientData* clientData = malloc(sizeof(ClientData));
-        clientData->clientFd = fd;
-        clientData->serverStats = stats;
-        pthread_t threadID;
-        pthread_create(&threadID, NULL, client_thread, clientData);
-        pthread_detach(threadID);
+    return NULL;
+}
+
+/* create_listeners()
+ *
+ * This function sets up a Listener for each listening socket and starts
+ * threads for all of them but the first, which is left to the calling (main)
+ * thread. The reactors are divided between the listeners as evenly as
+ * possible (if there are fewer reactors than listeners some of the listeners
+ * share one). If 'pin' is set each listener and its reactors are pinned to a
+ * CPU of their own (in turn, as far as there are CPUs to go around) so a
+ * connection is accepted and serviced on the same CPU.
+ *
+ * listenFds: Array of the listening socket file descriptors.
+ * count: Number of listening sockets.
+ * reactors: Array of the reactors.
+ * reactorCount: Number of reactors within 'reactors'.
+ * pin: Whether to pin listeners and their reactors to CPUs.
+ * placement: A pointer to the Placement of the server's threads.
+ * stats: A pointer to an instance of the ServerStats struct.
+ *
+ * Returns: An array of 'count' Listener structs.
+ */
+Listener* create_listeners(const int* listenFds, int count,
+        Reactor* reactors, int reactorCount, bool pin,
+        const Placement* placement, ServerStats* stats)
+{
+    Listener* listeners = malloc(sizeof(Listener) * count);
+
+    for (int i = 0; i < count; i++) {
+        int first = i * reactorCount / count;
+        int last = (i + 1) * reactorCount / count;
+        listeners[i].fd = listenFds[i];
+        listeners[i].reactors = &reactors[first];
+        listeners[i].reactorCount = (last > first) ? last - first : 1;
+        listeners[i].cpu = pin ? allowed_cpu(i) : -1;
+        listeners[i].placement = placement;
+        listeners[i].stats = stats;
+
+        for (int j = 0; j < last - first; j++) {
+            pin_thread(reactors[first + j].thread, listeners[i].cpu);
+        }
+        if (i) {
+            pthread_t threadID;
+            pthread_create(&threadID, NULL, listener_thread, &listeners[i]);
+            pin_thread(threadID, listeners[i].cpu);
+            pthread_detach(threadID);
+        } else {
+            pin_thread(pthread_self(), listeners[i].cpu);
+        }
     }
+
+    return listeners;
 }
 
 /* signal_handler()
  *
  * This is a thread function specifically designed to catch SIGHUP signals.
  * When a SIGHUP signal is caught it will print out the current statistics of
- * the server.
+ * the server, followed by the thread count and queue depth of each stage of
+ * the image pipeline, the counters of each enabled cache and those of the
+ * buffer pool, and the number of clients shed, of requests shed and of
+ * requests cancelled for each reason.
  *
  * arg: Expected to be pointer to an instance of the sigInfo struct.
  *
@@ -1051,6 +3653,7 @@ void* signal_handler(void* arg)
     SignalThreadInfo* sigInfo = (SignalThreadInfo*)arg;
     sigset_t set = sigInfo->set;
     ServerStats* stats = sigInfo->stats;
+    Pipeline* pipeline = sigInfo->pipeline;
 
     // Now wait for signal to happen
     int signal;
@@ -1060,11 +3663,44 @@ void* signal_handler(void* arg)
         sigwait(&set, &signal);
         // If signal is SIGHUP print statistics
         if (signal == SIGHUP) {
-            fprintf(stderr, currentClientsMsg, stats->currentClients);
-            fprintf(stderr, finishedClientsMsg, stats->totalClients);
-            fprintf(stderr, successHttpMsg, stats->successRequests);
-            fprintf(stderr, failHttpMsg, stats->failRequests);
-            fprintf(stderr, imageOperationMsg, stats->completedOperations);
+            StatsSnapshot snapshot = snapshot_stats(stats);
+            fprintf(stderr, currentClientsMsg, snapshot.currentClients);
+            fprintf(stderr, finishedClientsMsg, snapshot.totalClients);
+            fprintf(stderr, successHttpMsg, snapshot.successRequests);
+            fprintf(stderr, failHttpMsg, snapshot.failRequests);
+            fprintf(stderr, imageOperationMsg, snapshot.completedOperations);
+            for (int i = 0; i < STAGE_COUNT; i++) {
+                Stage* stage = &pipeline->stages[i];
+                fprintf(stderr, stageDepthMsg, stage->name, stage->threads,
+                        stage_depth(stage));
+            }
+            if (pipeline->results) {
+                CacheStats cache = cache_stats(pipeline->results);
+                fprintf(stderr, cacheMsg, "Result", cache.hits, cache.misses,
+                        cache.evictions);
+            }
+            if (pipeline->decoded) {
+                CacheStats cache = cache_stats(pipeline->decoded);
+                fprintf(stderr, cacheMsg, "Decoded image", cache.hits,
+                        cache.misses, cache.evictions);
+            }
+            BufferPoolStats buffers = buffer_pool_stats();
+            fprintf(stderr, bufferPoolMsg, buffers.reused, buffers.allocated,
+                    buffers.retained);
+            for (int i = 0; i < SHED_COUNT; i++) {
+                fprintf(stderr, shedMsg, shedNames[i],
+                        __atomic_load_n(&stats->shed[i], __ATOMIC_RELAXED));
+            }
+            for (int i = SHED_QUEUE; i < SHED_COUNT; i++) {
+                fprintf(stderr, shedRequestMsg, shedNames[i],
+                        __atomic_load_n(
+                                &stats->shedRequests[i], __ATOMIC_RELAXED));
+            }
+            for (int i = 0; i < CANCEL_COUNT; i++) {
+                fprintf(stderr, cancelMsg, cancelNames[i],
+                        __atomic_load_n(
+                                &stats->cancelled[i], __ATOMIC_RELAXED));
+            }
             fflush(stderr);
         }
     }
@@ -1083,31 +3719,86 @@ void create_signal_thread(SignalThreadInfo* sigInfo)
     pthread_detach(signalThread);
 }
 
+/* setup_placement()
+ *
+ * This function decides where the server's threads run (see Placement) from
+ * the --workerCpus and --stageCpus options. If only one of those is given the
+ * other threads aren't restricted to particular CPUs.
+ *
+ * server: The ServerInfo holding the worker and stage CPUs.
+ *
+ * Returns: A pointer to the newly created Placement.
+ */
+Placement* setup_placement(ServerInfo server)
+{
+    Placement* placement = calloc(1, sizeof(Placement));
+    placement->count = 1;
+    placement->placed = cpuset_count(&server.workerCpus)
+            || cpuset_count(&server.stageCpus);
+    if (!placement->placed) {
+        return placement;
+    }
+
+    // Workers can run anywhere if only stage CPUs were given
+    CpuSet workerCpus = server.workerCpus;
+    if (!cpuset_count(&workerCpus)) {
+        allowed_cpus(&workerCpus);
+    }
+
+    placement->count = 0;
+    for (int node = 0; node < node_count(); node++) {
+        int group = placement->count;
+        node_cpus(node, &workerCpus, &placement->workerCpus[group]);
+        if (!cpuset_count(&placement->workerCpus[group])) {
+            continue; // Connections accepted here go to group 0
+        }
+        node_cpus(node, &server.stageCpus, &placement->stageCpus[group]);
+        if (!cpuset_count(&placement->stageCpus[group])) {
+            placement->stageCpus[group] = server.stageCpus;
+        }
+        placement->groupOf[node] = group;
+        placement->count++;
+    }
+
+    // Without any NUMA information everything is a single group
+    if (!placement->count) {
+        placement->count = 1;
+        placement->workerCpus[0] = workerCpus;
+        placement->stageCpus[0] = server.stageCpus;
+    }
+
+    return placement;
+}
+
 /* setup_server_stats()
  *
- * This function initializes a ServerStats struct. This includes all statistics
- * values (to 0), the semaphore for connection limiting and a binary semaphore
- * for statistics update.
+ * This function initializes a ServerStats struct. This includes the limits
+ * used for admission control, an empty list of per-thread statistics shards
+ * (so all statistics values start at 0) and an empty histogram per latency
+ * and per allocation count.
  *
- * maxConns: A value representing the maximum connections possible for the
- *     server at a given moment.
+ * server: The ServerInfo holding the connection, queue and pixel work limits.
  *
  * Returns: Returns a pointer to a "filled" instance of the ServerStats struct.
  */
-ServerStats* setup_server_stats(int maxConns)
+ServerStats* setup_server_stats(ServerInfo server)
 {
-    ServerStats* serverStats = malloc(sizeof(ServerStats));
+    ServerStats* serverStats = calloc(1, sizeof(ServerStats));
 
-    if (maxConns > 0) {
-        sem_init(&serverStats->maxConnsLock, 0, maxConns);
+    pthread_mutex_init(&serverStats->shardsLock, NULL);
+    serverStats->shards = NULL;
+    for (int i = 0; i < LATENCY_COUNT; i++) {
+        serverStats->latencies[i] = histogram_create();
+    }
+    for (int i = 0; i < ALLOC_COUNT; i++) {
+        serverStats->allocations[i] = histogram_create();
     }
-    sem_init(&serverStats->statsLock, 0, 1);
-    serverStats->currentClients = 0;
-    serverStats->totalClients = 0;
-    serverStats->successRequests = 0;
-    serverStats->failRequests = 0;
-    serverStats->completedOperations = 0;
-    serverStats->maxConns = maxConns;
+    for (int i = 0; i < COST_COUNT; i++) {
+        serverStats->costs[i] = histogram_create();
+    }
+    serverStats->maxConns = server.maxConns;
+    serverStats->maxQueue = server.maxQueue;
+    serverStats->maxPixelWork = server.maxPixelWork;
 
     return serverStats;
 }
@@ -1126,13 +3817,17 @@ void handle_sigpipe(int sig __attribute__((unused)))
 /* setupSignalMask()
  *
  * This function masks the SIGHUP signal for all threads created within the
- * program.
+ * program. The signal handling thread itself is started later with
+ * create_signal_thread() once everything it reports on exists (a SIGHUP
+ * received before then stays pending until it is started).
  *
  * stats: A pointer to an instance of the ServerStats struct.
  *
+ * Returns: A pointer to the SignalThreadInfo for the signal handling thread.
+ *
  * REF: Inspired by the man pages (3) pthread_sigmask
  */
-void setup_signal_mask(ServerStats* stats)
+SignalThreadInfo* setup_signal_mask(ServerStats* stats)
 {
     // Signal Mask for SIGHUP
     sigset_t set;
@@ -1140,11 +3835,13 @@ void setup_signal_mask(ServerStats* stats)
     sigaddset(&set, SIGHUP);
     pthread_sigmask(SIG_BLOCK, &set, NULL);
 
-    // Create signal thread
+    // Information for the signal thread
     SignalThreadInfo* sigInfo = malloc(sizeof(SignalThreadInfo));
     sigInfo->set = set;
     sigInfo->stats = stats;
-    create_signal_thread(sigInfo);
+    sigInfo->pipeline = NULL;
+
+    return sigInfo;
 }
 
 int main(int argc, char* argv[])
@@ -1155,20 +3852,47 @@ int main(int argc, char* argv[])
     sa.sa_handler = handle_sigpipe;
     sigaction(SIGPIPE, &sa, NULL);
 
-    // Process command line arguments
+    // Find the NUMA nodes and process command line arguments
+    affinity_init();
     ServerInfo server = process_command_line(argc, argv);
+    Placement* placement = setup_placement(server);
 
     // Check port
-    int fdServer = check_port(server);
-
-    // Set up server statistics
-    ServerStats* serverStats = setup_server_stats(server.maxConns);
+    int* listenFds = check_port(server);
+
+    // Set up server statistics and the pool of large buffers
+    ServerStats* serverStats = setup_server_stats(server);
+    buffer_pool_init(server.bufferPoolBytes);
+
+    // Mask SIGHUP
+    SignalThreadInfo* sigInfo = setup_signal_mask(serverStats);
+
+    // Start the task pools, image pipeline, worker pool and reactors (after
+    // the signal mask so that they inherit it)
+    Cache* results = server.resultCacheBytes
+            ? cache_create(server.resultCacheBytes, free_encoded_image)
+            : NULL;
+    Cache* decoded = server.decodeCacheBytes
+            ? cache_create(server.decodeCacheBytes, unload_image)
+            : NULL;
+    Pipeline* pipeline = create_pipeline(server.stageThreads, placement,
+            serverStats, server.parallelPixels, results, decoded,
+            server.compression);
+    HomePage* homePage = home_page_create(server.homePage);
+    WorkerPool* pool = create_worker_pool(server.workers, placement, pipeline,
+            homePage, server.deadlineMs);
+    Reactor* reactors
+            = create_reactors(server.reactors, pool, server.pipelineDepth);
 
     // Set up SIGHUP handling thread
-    setup_signal_mask(serverStats);
+    sigInfo->pipeline = pipeline;
+    create_signal_thread(sigInfo);
 
     // Starting receiving connections from clients
-    process_connections(fdServer, server.maxConns, serverStats);
+    Listener* listeners = create_listeners(listenFds, server.listeners,
+            reactors, server.reactors, server.pinListeners, placement,
+            serverStats);
+    process_connections(&listeners[0]);
 
     return 0;
 }
@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include "workqueue.h"
+
+/* workqueue_create()
+ *
+ * This function creates an empty WorkQueue that can hold at most 'capacity'
+ * items at a time.
+ *
+ * capacity: Maximum number of items held by the queue (must be > 0).
+ *
+ * Returns: A pointer to a newly allocated WorkQueue.
+ */
+WorkQueue* workqueue_create(unsigned int capacity)
+{
+    WorkQueue* queue = malloc(sizeof(WorkQueue));
+    queue->items = malloc(sizeof(void*) * capacity);
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->count = 0;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->notEmpty, NULL);
+    pthread_cond_init(&queue->notFull, NULL);
+
+    return queue;
+}
+
+/* workqueue_push()
+ *
+ * This function adds 'item' to the back of the queue. If the queue is full the
+ * calling thread blocks until a consumer makes room.
+ *
+ * queue: A pointer to an instance of the WorkQueue struct.
+ * item: The item to be added.
+ */
+void workqueue_push(WorkQueue* queue, void* item)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->capacity) {
+        pthread_cond_wait(&queue->notFull, &queue->lock);
+    }
+
+    queue->items[(queue->head + queue->count) % queue->capacity] = item;
+    queue->count++;
+
+    pthread_cond_signal(&queue->notEmpty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/* workqueue_try_push()
+ *
+ * This function adds 'item' to the back of the queue if there is room for it.
+ * Unlike workqueue_push() it never blocks.
+ *
+ * queue: A pointer to an instance of the WorkQueue struct.
+ * item: The item to be added.
+ *
+ * Returns: True if the item was added, false if the queue was full.
+ */
+bool workqueue_try_push(WorkQueue* queue, void* item)
+{
+    pthread_mutex_lock(&queue->lock);
+    bool added = queue->count < queue->capacity;
+    if (added) {
+        queue->items[(queue->head + queue->count) % queue->capacity] = item;
+        queue->count++;
+        pthread_cond_signal(&queue->notEmpty);
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return added;
+}
+
+/* workqueue_pop()
+ *
+ * This function removes the item at the front of the queue. If the queue is
+ * empty the calling thread blocks until a producer adds an item.
+ *
+ * queue: A pointer to an instance of the WorkQueue struct.
+ *
+ * Returns: The item that was at the front of the queue.
+ */
+void* workqueue_pop(WorkQueue* queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0) {
+        pthread_cond_wait(&queue->notEmpty, &queue->lock);
+    }
+
+    void* item = queue->items[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+
+    pthread_cond_signal(&queue->notFull);
+    pthread_mutex_unlock(&queue->lock);
+
+    return item;
+}
+
+/* workqueue_depth()
+ *
+ * This function returns the number of items currently waiting in the queue.
+ *
+ * queue: A pointer to an instance of the WorkQueue struct.
+ *
+ * Returns: Number of queued items.
+ */
+unsigned int workqueue_depth(WorkQueue* queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    unsigned int depth = queue->count;
+    pthread_mutex_unlock(&queue->lock);
+
+    return depth;
+}
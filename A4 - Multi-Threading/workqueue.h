@@ -0,0 +1,28 @@
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+/* A bounded, blocking, multi-producer multi-consumer FIFO queue of pointers.
+ * Producers block while the queue is full (unless they only try to push) and
+ * consumers block while it is empty.
+ */
+typedef struct {
+    void** items;
+    unsigned int capacity;
+    unsigned int head;
+    unsigned int count;
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+} WorkQueue;
+
+// Function Prototypes
+WorkQueue* workqueue_create(unsigned int capacity);
+void workqueue_push(WorkQueue* queue, void* item);
+bool workqueue_try_push(WorkQueue* queue, void* item);
+void* workqueue_pop(WorkQueue* queue);
+unsigned int workqueue_depth(WorkQueue* queue);
+
+#endif